@@ -34,6 +34,16 @@ Page {
         onModelReset: {
             scrollToEnd()
         }
+
+        // An older page was inserted at the top. Keep the rows we were looking at in place.
+        onRowsInserted: {
+            if (first === 0 && last + 1 < list.count) {
+                list.positionViewAtIndex(last + 1, ListView.Beginning)
+            }
+
+            // The rows may not fill the view, so it can't be scrolled to the top
+            Qt.callLater(list.fetchOlderIfAtTop)
+        }
     }
 
     ListView {
@@ -49,6 +59,15 @@ Page {
         ScrollBar.vertical: ScrollBar { id: scrollbar}
         model: messages
 
+        function fetchOlderIfAtTop() {
+            if (atYBeginning) {
+                messages.fetchOlder()
+            }
+        }
+
+        // The model only loads the newest messages. Get older ones when we reach the top.
+        onAtYBeginningChanged: fetchOlderIfAtTop()
+
         // Scroll to the end
         onCountChanged: {
             if (currentIndex === -1 || currentIndex === (count -2)) {
@@ -29,6 +29,7 @@ Page {
             // This is where we synchronize the Contacts and conversations with the current selected identity
             contacts.setIdentity(currentIdentity.uuid)
             conversations.setIdentity(currentIdentity.uuid)
+            searchResults.setIdentity(currentIdentity.uuid)
         }
 
         delegate: Item {
@@ -17,6 +17,7 @@
 #include "ds/messagesmodel.h"
 #include "ds/message.h"
 #include "ds/filesmodel.h"
+#include "ds/searchresultsmodel.h"
 #include "ds/imageprovider.h"
 #include "ds/identitynamevalidator.h"
 #include "ds/torprotocolmanager.h"
@@ -121,6 +122,10 @@ int main(int argc, char *argv[])
                                                    "FilesModel",
                                                    "Cannot create FilesModel in QML");
 
+    qmlRegisterUncreatableType<ds::models::SearchResultsModel>("com.jgaa.darkspeak", 1, 0,
+                                                   "SearchResultsModel",
+                                                   "Cannot create SearchResultsModel in QML");
+
 
     qmlRegisterType<ds::core::QmlIdentityReq>("com.jgaa.darkspeak", 1, 0, "QmlIdentityReq");
     qmlRegisterType<ds::models::IdentityNameValidator>("com.jgaa.darkspeak", 1, 0, "IdentityNameValidator");
@@ -135,6 +140,7 @@ int main(int argc, char *argv[])
     engine.rootContext()->setContextProperty("conversations", manager->conversationsModel());
     engine.rootContext()->setContextProperty("messages", manager->messagesModel());
     engine.rootContext()->setContextProperty("files", manager->filesModel());
+    engine.rootContext()->setContextProperty("searchResults", manager->searchResultsModel());
 
     auto tmpProvider = new ImageProvider{"temp", [&manager](const QString& id) {
             Q_UNUSED(id)
@@ -107,8 +107,19 @@ public:
     Q_PROPERTY(bool iBlocked READ iBlocked WRITE setBlocked NOTIFY blockedChanged)
     Q_PROPERTY(bool theyBlocked READ theyBlocked WRITE setBlocked NOTIFY blockedChanged)
     Q_PROPERTY(bool sendBlockNotice READ getSendBlockNotice WRITE setSendBlockNotice NOTIFY sendBlockNoticeChanged)
+    Q_PROPERTY(int rtt READ getRtt NOTIFY connectionStatsChanged)
+    Q_PROPERTY(qlonglong sendRate READ getSendRate NOTIFY connectionStatsChanged)
+    Q_PROPERTY(qlonglong receiveRate READ getReceiveRate NOTIFY connectionStatsChanged)
 
     Q_INVOKABLE void connectToContact();
+
+    /*! Connect with simultaneous-open avoidance.
+     *
+     * Only the side with the lesser Identity hash dials immediately. The other
+     * side waits for the "connectArbitrationWindow" (milliseconds) for an
+     * incoming connection, and only dials if none arrived.
+     */
+    void autoConnectToContact();
     Q_INVOKABLE void disconnectFromContact(bool manual = false);
     Q_INVOKABLE Conversation *getDefaultConversation();
 
@@ -165,8 +176,20 @@ public:
     bool getSendBlockNotice() const;
     void setSendBlockNotice(bool value);
 
+    // True if we are the side that should dial when both sides auto-connect
+    bool isPreferredDialer() const;
+
+    // Measured quality of the current connection
+    ConnectionStats getConnectionStats() const;
+    int getRtt() const;
+    qlonglong getSendRate() const;
+    qlonglong getReceiveRate() const;
+
     void queueMessage(const Message::ptr_t& message);
     void queueFile(const std::shared_ptr<File>& file);
+
+    // Called by the TransferScheduler when a queued transfer gets a slot
+    void startAdmittedTransfer(const std::shared_ptr<File>& file);
     void sendAvatar(const QImage& avatar);
 
     /*! Add the new Identity to the database. */
@@ -204,6 +227,7 @@ signals:
     void manuallyDisconnectedChanged();
     void sentAvatarChanged();
     void avatarUrlChanged();
+    void connectionStatsChanged();
     void blockedChanged();
     void sendBlockNoticeChanged();
 
@@ -224,6 +248,7 @@ private slots:
     void onReceivedFileOffer(const PeerFileOffer& msg);
     void onReceivedAvatar(const PeerSetAvatarReq& avatar);
     void onOutputBufferEmptied();
+    void onDataConnectionsWanted(const QUuid& transfer, const int count);
 
 private:
     static void bind(QSqlQuery& query, ContactData& data);
@@ -245,12 +270,14 @@ private:
     int id_ = -1; // Database id
     bool online_ = false;
     bool loadedMessageQueue_ = false;
+    bool loadingMessageQueue_ = false; // Waiting for the DbExecutor
     bool loadedFileQueue_ = false;
     data_t data_;
     QString onlineIcon_ = "qrc:///images/onion-bw.svg";
     OnlineStatus onlineStatus_ = DISCONNECTED;
     bool sentAvatarPendingAck_ = false;
     bool avatarUrlChanging_ = false;
+    bool arbitrationPending_ = false;
 
     std::unique_ptr<Connection> connection_;
     std::deque<Message::ptr_t> messageQueue_;
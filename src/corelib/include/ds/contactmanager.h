@@ -29,6 +29,8 @@ public:
 
     // Put the contact at the front of the lru cache
     void touch(const Contact::ptr_t& contact);
+    Registry<QUuid, Contact>::Stats getRegistryStats() const { return registry_.getStats(); }
+    LruCache<Contact::ptr_t>::Stats getCacheStats() const { return lru_cache_.getStats(); }
 
 signals:
     void contactAdded(const Contact::ptr_t& contact);
@@ -40,7 +42,7 @@ private slots:
 
 private:
     Registry<QUuid, Contact> registry_;
-    LruCache<Contact::ptr_t> lru_cache_{7};
+    LruCache<Contact::ptr_t> lru_cache_;
 };
 
 }}
@@ -40,6 +40,8 @@ public:
 
     // Put the Conversation at the front of the lru cache
     void touch(const Conversation::ptr_t& conversation);
+    Registry<QUuid, Conversation>::Stats getRegistryStats() const { return registry_.getStats(); }
+    LruCache<Conversation::ptr_t>::Stats getCacheStats() const { return lru_cache_.getStats(); }
 
 signals:
     void conversationAdded(const Conversation::ptr_t& conversation);
@@ -50,7 +52,7 @@ private:
     void initConnections(const Conversation::ptr_t& conversation);
 
     Registry<QUuid, Conversation> registry_;
-    LruCache<Conversation::ptr_t> lru_cache_{3};
+    LruCache<Conversation::ptr_t> lru_cache_;
 
 };
 
@@ -1,7 +1,9 @@
 #ifndef DATABASE_H
 #define DATABASE_H
 
+#include <memory>
 #include <stdexcept>
+#include <vector>
 
 #include <QObject>
 #include <QSettings>
@@ -9,6 +11,10 @@
 #include <QSqlDriver>
 #include <QSqlError>
 #include <QSqlQuery>
+#include <QTimer>
+
+#include "ds/statementcache.h"
+#include "ds/writebehind.h"
 
 namespace ds {
 namespace core {
@@ -31,19 +37,74 @@ public:
     };
 
     QSqlDatabase& getDb() { return db_; }
+    StatementCache& getStatementCache() { return *statements_; }
 
 signals:
 
 public slots:
 
+protected slots:
+    void checkpoint();
+
 protected:
     void createDatabase();
+
+    /*! Bring the schema up to currentVersion.
+     *
+     * Each migration runs in its own transaction, together with the
+     * update of the version in the ds table. If we are interrupted,
+     * we resume with the first migration that was not committed.
+     */
+    void migrate(int fromVersion);
+
+    /*! Create the FTS5 index over message.content, if it don't exist.
+     *
+     * It's not a migration, as SQLite may be built without FTS5.
+     * Then we just don't have search.
+     */
+    void createSearchIndex();
+
+    // Warn about hot queries that scan a whole table (debug builds)
+    void checkQueryPlans();
     void exec(const char *sql);
+    void exec(const QString& sql);
+    QVariant queryValue(const QString& sql);
     void prepareData();
 
-    static constexpr int currentVersion = 1;
+    /*! Apply the storage profile from the settings.
+     *
+     * "dbProfile" selects the defaults:
+     *  - "fast" (default): WAL journal, synchronous=NORMAL and larger caches.
+     *    A crash may lose the last transactions, but never corrupt the database.
+     *  - "safe": WAL journal, synchronous=FULL.
+     *  - "legacy": Rollback journal, synchronous=FULL, SQLite's own defaults.
+     *
+     * Each value can be overridden with "dbJournalMode", "dbSynchronous",
+     * "dbCacheSizeKb", "dbMmapSize" and "dbTempStore".
+     *
+     * "dbBusyTimeout" (milliseconds, default 5000) is how long we wait
+     * for the DbExecutor's connection to release its lock.
+     */
+    void applyProfile();
+
+    // Log the pragmas that are actually in effect
+    void reportProfile();
+
+    struct Migration {
+        int version; // The schema version after the migration
+        const char *description;
+        std::vector<const char *> statements;
+    };
+
+    static const std::vector<Migration>& getMigrations();
+
+    static constexpr int currentVersion = 3;
     QSqlDatabase db_;
     QSettings& settings_;
+    QString journalMode_;
+    std::unique_ptr<StatementCache> statements_;
+    std::unique_ptr<WriteBehind> writeBehind_;
+    QTimer checkpointTimer_;
 };
 
 }} // namespaces
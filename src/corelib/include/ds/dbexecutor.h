@@ -0,0 +1,149 @@
+#ifndef DBEXECUTOR_H
+#define DBEXECUTOR_H
+
+#include <functional>
+#include <memory>
+#include <type_traits>
+
+#include <QFuture>
+#include <QFutureInterface>
+#include <QObject>
+#include <QPointer>
+#include <QSettings>
+#include <QSqlDatabase>
+#include <QThread>
+
+#include "logfault/logfault.h"
+
+namespace ds {
+namespace core {
+
+/*! Runs database work on a dedicated thread.
+ *
+ * The worker thread has its own connection to the database, so
+ * long queries don't block the GUI thread. The work is a functor
+ * that gets the worker's QSqlDatabase. It must only use that
+ * connection, and must not touch any QObjects that live in the
+ * GUI thread. Copy what it needs into the lambda.
+ *
+ * The work items are run one at the time, in the order they were
+ * submitted, and their callbacks are called in the GUI thread in
+ * the same order. So updates to one entity are never re-ordered.
+ *
+ * A callback is only called if its context object still exists.
+ *
+ * In-memory databases can not be shared between connections. For
+ * those, the work runs in the GUI thread on the default connection,
+ * but still asynchronously.
+ */
+class DbExecutor : public QObject
+{
+    Q_OBJECT
+public:
+    using work_t = std::function<void (QSqlDatabase& db)>;
+    using failed_t = std::function<void (const QString& reason)>;
+
+    DbExecutor(QSettings& settings);
+    ~DbExecutor();
+
+    /*! Run work(db) on the worker, and call done(result) in the GUI thread.
+     *
+     * If work throws, failed(reason) is called instead.
+     */
+    template <typename Fn, typename Done>
+    void query(Fn work, QObject *context, Done done, failed_t failed = {}) {
+        using result_t = std::invoke_result_t<Fn, QSqlDatabase&>;
+        QPointer<QObject> ctx{context};
+
+        post([this, work=std::move(work), ctx, done=std::move(done), failed=std::move(failed)]
+             (QSqlDatabase& db) {
+            try {
+                if constexpr (std::is_void_v<result_t>) {
+                    work(db);
+                    deliver(ctx, [done]() { done(); });
+                } else {
+                    auto result = std::make_shared<result_t>(work(db));
+                    deliver(ctx, [done, result]() { done(std::move(*result)); });
+                }
+            } catch(const std::exception& ex) {
+                LFLOG_WARN << "Caught exception from database work: " << ex.what();
+                if (failed) {
+                    deliver(ctx, [failed, reason=QString{ex.what()}]() { failed(reason); });
+                }
+            }
+        });
+    }
+
+    // Same as query(), but the work runs in a transaction that is rolled back if it throws
+    template <typename Fn, typename Done>
+    void transaction(Fn work, QObject *context, Done done, failed_t failed = {}) {
+        query([work=std::move(work)](QSqlDatabase& db) {
+            begin(db);
+            try {
+                if constexpr (std::is_void_v<std::invoke_result_t<Fn, QSqlDatabase&>>) {
+                    work(db);
+                    commit(db);
+                } else {
+                    auto result = work(db);
+                    commit(db);
+                    return result;
+                }
+            } catch(const std::exception&) {
+                db.rollback();
+                throw;
+            }
+        }, context, std::move(done), std::move(failed));
+    }
+
+    /*! Run work(db) on the worker and get the result as a future.
+     *
+     * The future is finished in the worker thread. Use a QFutureWatcher
+     * to get notified in the GUI thread. If the work throws, the future
+     * is cancelled.
+     */
+    template <typename Fn>
+    QFuture<std::invoke_result_t<Fn, QSqlDatabase&>> run(Fn work) {
+        using result_t = std::invoke_result_t<Fn, QSqlDatabase&>;
+        auto promise = std::make_shared<QFutureInterface<result_t>>();
+        promise->reportStarted();
+
+        post([promise, work=std::move(work)](QSqlDatabase& db) {
+            try {
+                if constexpr (std::is_void_v<result_t>) {
+                    work(db);
+                } else {
+                    promise->reportResult(work(db));
+                }
+            } catch(const std::exception& ex) {
+                LFLOG_WARN << "Caught exception from database work: " << ex.what();
+                promise->reportCanceled();
+            }
+            promise->reportFinished();
+        });
+
+        return promise->future();
+    }
+
+    // Fire and forget
+    void post(work_t work);
+
+    static DbExecutor& instance();
+
+private:
+    void deliver(const QPointer<QObject>& context, std::function<void ()> fn);
+    void open();
+    void close();
+    static void begin(QSqlDatabase& db);
+    static void commit(QSqlDatabase& db);
+
+    QSettings& settings_;
+    const bool useWorker_;
+    std::unique_ptr<QThread> thread_;
+    std::unique_ptr<QObject> worker_; // Lives in thread_
+    QSqlDatabase db_; // Only used in thread_
+    static DbExecutor *instance_;
+};
+
+}} // namespaces
+
+#endif // DBEXECUTOR_H
@@ -6,6 +6,7 @@
 #include <QObject>
 #include <QSettings>
 #include <QMap>
+#include <QTimer>
 
 #include "ds/message.h"
 //#include "ds/database.h"
@@ -20,6 +21,8 @@
 #include "ds/conversationmanager.h"
 #include "ds/messagemanager.h"
 #include "ds/filemanager.h"
+#include "ds/transportpool.h"
+#include "ds/transferscheduler.h"
 
 class QSqlDatabase;
 
@@ -27,6 +30,7 @@ namespace ds {
 namespace core {
 
 class Database;
+class DbExecutor;
 
 /*! The core engine of DarkSpeak.
  *
@@ -56,11 +60,14 @@ public:
     static DsEngine& instance();
     State getState() const;
     QSqlDatabase& getDb();
+    DbExecutor& getDbExecutor();
     IdentityManager *getIdentityManager();
     ContactManager *getContactManager();
     ConversationManager *getConversationManager();
     MessageManager *getMessageManager();
     FileManager *getFileManager();
+    TransportPool *getTransportPool();
+    TransferScheduler *getTransferScheduler();
 
     QSettings& settings() noexcept { return *settings_; }
     ProtocolManager& getProtocolMgr(ProtocolManager::Transport transport);
@@ -90,6 +97,8 @@ private slots:
     void onServiceFailed(const QUuid& id, const QByteArray& reason);
     void onServiceStarted(const QUuid& id, const bool newService);
     void onServiceStopped(const QUuid& id);
+    void onServicePublished(const QUuid& id, const bool published);
+    void logRegistryStats();
 
 signals:
     void ready();
@@ -109,6 +118,7 @@ protected:
 
     std::unique_ptr<QSettings> settings_;
     std::unique_ptr<Database> database_;
+    std::unique_ptr<DbExecutor> dbExecutor_; // Destroyed before database_
     static DsEngine *instance_;
     ProtocolManager::ptr_t tor_mgr_;
     State state_ = State::INITIALIZING;
@@ -118,6 +128,9 @@ protected:
     ConversationManager *conversationManager_ = {};
     MessageManager *messageManager_ = {};
     FileManager *fileManager_ = {};
+    TransportPool *transportPool_ = {};
+    TransferScheduler *transferScheduler_ = {};
+    QTimer registryStatsTimer_;
 };
 
 }} // namepsaces
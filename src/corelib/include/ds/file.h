@@ -4,6 +4,7 @@
 
 #include <deque>
 #include <functional>
+#include <vector>
 #include <QUuid>
 #include <QObject>
 #include <chrono>
@@ -74,6 +75,7 @@ public:
     Q_PROPERTY(qlonglong size READ getSize NOTIFY sizeChanged)
     Q_PROPERTY(float progress READ getProgress NOTIFY bytesTransferredChanged)
     Q_PROPERTY(qlonglong bytesTransferred READ getBytesTransferred NOTIFY bytesTransferredChanged)
+    Q_PROPERTY(int queuePosition READ getQueuePosition NOTIFY queuePositionChanged)
 
     Q_INVOKABLE void cancel();
     Q_INVOKABLE void accept();
@@ -116,6 +118,10 @@ public:
     void setChannel(quint32 channel);
     float getProgress() const noexcept;
 
+    // Position in the TransferScheduler's queue, or 0 if not waiting there
+    int getQueuePosition() const noexcept;
+    void setQueuePosition(const int position);
+
     /*! Add the new File to the database. */
     void addToDb();
 
@@ -125,6 +131,13 @@ public:
     static File::ptr_t load(QObject& parent, const int dbId);
     static File::ptr_t load(QObject& parent, int conversation, const QByteArray& hash);
 
+    /*! Load many files with one query for each max_in_list ids.
+     *
+     * The files are returned in the order of dbIds. Ids that are
+     * not found are skipped.
+     */
+    static std::vector<File::ptr_t> load(QObject& parent, const std::vector<int>& dbIds);
+
     const char *getTableName() const noexcept { return "file"; }
 
     void asynchCalculateHash(hash_cb_t callback = {});
@@ -152,16 +165,19 @@ signals:
     void fileTimeChanged();
     void sizeChanged();
     void bytesTransferredChanged();
+    void queuePositionChanged();
     void transferDone(File *file, bool succeess);
 
 private:
     static QString getSelectStatement(const QString& where);
     static ptr_t load(QObject& parent, const std::function<void(QSqlQuery&)>& prepare);
+    static ptr_t fromQuery(QObject& parent, const QSqlQuery& query);
     void flushBytesAdded();
 
     int id_ = 0;
     std::unique_ptr<FileData> data_;
     quint32 channel_ = 0;
+    int queuePosition_ = 0;
     qlonglong bytesAdded_ = {};
     std::unique_ptr<std::chrono::steady_clock::time_point> nextFlush_;
 };
@@ -3,6 +3,7 @@
 
 #include <set>
 #include <deque>
+#include <vector>
 #include <QUuid>
 #include <QObject>
 #include <QSettings>
@@ -23,6 +24,12 @@ public:
     explicit FileManager(QObject &parent, QSettings& settings);
 
     File::ptr_t getFile(const int dbId);
+
+    /*! Get many files. The ones that are not in the registry are loaded with one query.
+     *
+     * The files are returned in the order of dbIds. Ids that are not found are skipped.
+     */
+    std::vector<File::ptr_t> getFiles(const std::vector<int>& dbIds);
     File::ptr_t getFile(const QByteArray& hash, Conversation& conversation);
     File::ptr_t getFileFromId(const QByteArray& fileId, Conversation& conversation);
     File::ptr_t getFileFromId(const QByteArray& fileId, const File::Direction direction);
@@ -33,6 +40,8 @@ public:
     void receivedFileOffer(Conversation& conversation, const PeerFileOffer& offer);
 
     void touch(const File::ptr_t& file);
+    Registry<int, File>::Stats getRegistryStats() const { return registry_.getStats(); }
+    LruCache<File::ptr_t>::Stats getCacheStats() const { return lru_cache_.getStats(); }
 
     void onFileStateChanged(const File *file);
 
@@ -47,7 +56,7 @@ private:
     void hashIt(const File::ptr_t& file);
 
     Registry<int, File> registry_;
-    LruCache<File::ptr_t> lru_cache_{3};
+    LruCache<File::ptr_t> lru_cache_;
     //std::set<File::ptr_t> hashing_;
     QSettings &settings_;
 };
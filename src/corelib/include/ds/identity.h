@@ -133,6 +133,8 @@ public:
     Q_PROPERTY(QByteArray b58identity READ getB58EncodedIdetity CONSTANT)
     Q_PROPERTY(QByteArray handle READ getHandle CONSTANT)
     Q_PROPERTY(bool autoConnect READ isAutoConnect WRITE setAutoConnect NOTIFY autoConnectChanged)
+    Q_PROPERTY(bool published READ isPublished NOTIFY publishedChanged)
+    Q_PROPERTY(int redundantHandshakesAvoided READ getRedundantHandshakesAvoided NOTIFY redundantHandshakesAvoidedChanged)
 
     Q_INVOKABLE void addContact(const QVariantMap& args);
     Q_INVOKABLE void startService();
@@ -154,6 +156,10 @@ public:
     void setAvatar(const QImage& avatar);
     bool isOnline() const noexcept;
     void setOnline(const bool value);
+
+    // True when Tor has uploaded the descriptor for our hidden service
+    bool isPublished() const noexcept;
+    void setPublished(const bool value);
     QUuid getUuid() const noexcept;
     QByteArray getHash() const noexcept;
     QDateTime getCreated() const noexcept;
@@ -179,6 +185,10 @@ public:
     void registerConnection(const Contact::ptr_t& contact);
     void unregisterConnection(const QUuid& uuid);
 
+    // Called by Contact when dial arbitration saved us a duplicate connection
+    void registerAvoidedHandshake();
+    int getRedundantHandshakesAvoided() const noexcept;
+
 public slots:
     void onAddmeRequest(const PeerAddmeReq& req);
 
@@ -190,7 +200,9 @@ signals:
     void avatarChanged();
     void avatarUrlChanged();
     void onlineChanged();
+    void publishedChanged();
     void autoConnectChanged();
+    void redundantHandshakesAvoidedChanged();
     void processOnlineLater();
 
 private slots:
@@ -209,9 +221,11 @@ private:
 
     int id_ = -1; // Database id
     bool online_ = false;
+    bool published_ = false;
     IdentityData data_;
     QDateTime created_;
     bool avatarUrlChanging_ = false;
+    int redundantHandshakesAvoided_ = 0;
 
     // Active Connections in any direction
     // Keeps connected Contacts in memory
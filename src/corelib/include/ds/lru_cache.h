@@ -1,45 +1,115 @@
 #ifndef cache_H
 #define cache_H
 
+#include <functional>
 #include <list>
-#include <algorithm>
+#include <unordered_map>
+
+#include <QtGlobal>
 
 namespace ds {
 namespace core {
 
+/*! Keeps the most recently used objects alive.
+ *
+ * T is a shared pointer (or something else that is hashable and cheap
+ * to copy). touch() and remove() are O(1): The list is in the order of
+ * use, and the map finds an object's place in the list.
+ *
+ * The cache holds at most maxEntries objects, and, if maxBytes is
+ * not 0, at most about maxBytes as reported by the sizer. The most
+ * recently used object is always kept.
+ */
 template <typename T>
 class LruCache {
+    struct Entry {
+        typename std::list<T>::iterator pos;
+        size_t bytes = 0;
+    };
+
 public:
+    using sizer_t = std::function<size_t (const T&)>;
+
+    struct Stats {
+        size_t entries = {};
+        size_t bytes = {}; // As reported by the sizer
+        quint64 hits = {};
+        quint64 misses = {};
+        quint64 evictions = {};
+    };
+
     LruCache() = default;
-    LruCache(size_t size) : size_{size} {}
+    LruCache(size_t maxEntries, size_t maxBytes = 0, sizer_t sizer = {})
+        : maxEntries_{maxEntries}, maxBytes_{maxBytes}, sizer_{std::move(sizer)} {}
 
     void touch(const T& v) {
-        auto it = find(cache_.begin(), cache_.end(), v);
-        if (it != cache_.end()) {
+        auto it = index_.find(v);
+        if (it != index_.end()) {
             // Just relocate existing pointer to front
-            auto ptr = move(*it);
-            cache_.erase(it);
-            cache_.push_front(move(ptr));
-        } else {
-            // Add the pointer
-            cache_.push_front(v);
-            if (cache_.size() >= size_) {
-                cache_.pop_back();
-            }
+            ++stats_.hits;
+            cache_.splice(cache_.begin(), cache_, it->second.pos);
+            return;
         }
+
+        // Add the pointer
+        ++stats_.misses;
+        cache_.push_front(v);
+        const size_t bytes = sizer_ ? sizer_(v) : 0;
+        index_.emplace(v, Entry{cache_.begin(), bytes});
+        bytes_ += bytes;
+        evict();
     }
 
     void remove(const T& v) {
-        cache_.erase(std::find(cache_.begin(), cache_.end(), v));
+        auto it = index_.find(v);
+        if (it != index_.end()) {
+            bytes_ -= it->second.bytes;
+            cache_.erase(it->second.pos);
+            index_.erase(it);
+        }
     }
 
     void clear() {
+        index_.clear();
         cache_.clear();
+        bytes_ = 0;
+    }
+
+    void setLimits(size_t maxEntries, size_t maxBytes) {
+        maxEntries_ = maxEntries;
+        maxBytes_ = maxBytes;
+        evict();
+    }
+
+    size_t size() const noexcept { return cache_.size(); }
+    size_t bytes() const noexcept { return bytes_; }
+    Stats getStats() const noexcept {
+        auto stats = stats_;
+        stats.entries = cache_.size();
+        stats.bytes = bytes_;
+        return stats;
     }
 
 private:
-    std::list<T> cache_;
-    size_t size_ = 32;
+    void evict() {
+        while ((cache_.size() > 1)
+               && ((cache_.size() > maxEntries_)
+                   || (maxBytes_ && (bytes_ > maxBytes_)))) {
+            auto it = index_.find(cache_.back());
+            bytes_ -= it->second.bytes;
+            index_.erase(it);
+            cache_.pop_back();
+            ++stats_.evictions;
+        }
+    }
+
+    std::list<T> cache_; // Most recently used first
+    std::unordered_map<T, Entry> index_;
+    size_t maxEntries_ = 256;
+    size_t maxBytes_ = 0;
+    size_t bytes_ = 0;
+    sizer_t sizer_;
+    Stats stats_;
 };
 
 }}
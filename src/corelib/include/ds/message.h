@@ -2,10 +2,12 @@
 #define MESSAGE_H
 
 #include <memory>
+#include <vector>
 
 #include <QObject>
 #include <QByteArray>
 #include <QDateTime>
+#include <QSqlQuery>
 
 #include "ds/dscert.h"
 
@@ -84,11 +86,20 @@ public:
 
     static ptr_t load(QObject& parent, int dbId);
 
+    /*! Load many messages with one query for each max_in_list ids.
+     *
+     * The messages are returned in the order of dbIds. Ids that are
+     * not found are skipped.
+     */
+    static std::vector<ptr_t> load(QObject& parent, const std::vector<int>& dbIds);
+
 signals:
     void receivedChanged();
     void stateChanged();
 
 private:
+    static ptr_t fromQuery(QObject& parent, const QSqlQuery& query);
+
     int id_ = -1;
     int conversationId_ = -1;
     Direction direction_ = Direction::OUTGOING;
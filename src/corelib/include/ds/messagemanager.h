@@ -2,11 +2,15 @@
 #define MESSAGEMANAGER_H
 
 #include <deque>
+#include <functional>
 #include <unordered_map>
+#include <vector>
+#include <QDateTime>
 #include <QUuid>
 #include <QObject>
 
 #include "ds/conversation.h"
+#include "ds/dbexecutor.h"
 #include "ds/message.h"
 #include "ds/registry.h"
 #include "ds/lru_cache.h"
@@ -18,15 +22,53 @@ class MessageManager : public QObject
 {
     Q_OBJECT
 public:
+    struct SearchHit {
+        int messageId = 0;
+        int conversationId = 0;
+        QString conversationName;
+        QDateTime composedTime;
+        QString snippet; // HTML. The matches are in <b></b>
+        double rank = 0; // Lower is better
+    };
+
+    using search_cb_t = std::function<void (std::vector<SearchHit> hits)>;
+
     explicit MessageManager(QObject& parent);
 
     Message::ptr_t getMessage(int dbId);
+
+    // Returns the message if it's in memory. Never loads it.
+    Message::ptr_t findLoaded(const int dbId) const { return registry_.fetch(dbId); }
+
+    /*! Get many messages. The ones that are not in the registry are loaded with one query.
+     *
+     * The messages are returned in the order of dbIds. Ids that are not found are skipped.
+     */
+    std::vector<Message::ptr_t> getMessages(const std::vector<int>& dbIds);
     Message::ptr_t getMessage(const QByteArray& messageId, const int conversationId);
     Message::ptr_t getMessage(const QByteArray& messageId, const Message::Direction direction);
     Message::ptr_t sendMessage(Conversation& conversation, MessageData data);
     Message::ptr_t receivedMessage(Conversation& conversation, MessageData data);
     void touch(const Message::ptr_t& message);
 
+    /*! Full-text search in the content of the messages.
+     *
+     * All the words in text must match. A word ending with '*' matches
+     * as a prefix. Only the conversations of identityId are searched,
+     * so the identities stay apart. If conversationId is 0, we search
+     * all the conversations for the identity.
+     *
+     * The search runs in the DbExecutor. done() gets the best hits
+     * first, in the GUI thread, unless context is deleted.
+     */
+    void search(const QString& text, const int identityId, const int conversationId, const int limit,
+                QObject *context, search_cb_t done, DbExecutor::failed_t failed = {});
+
+    // Make a FTS5 query from what the user typed
+    static QString toMatchExpression(const QString& text);
+    Registry<int, Message>::Stats getRegistryStats() const { return registry_.getStats(); }
+    LruCache<Message::ptr_t>::Stats getCacheStats() const { return lru_cache_.getStats(); }
+
     void onMessageReceivedDateChanged(const Message::ptr_t& message);
     void onMessageStateChanged(const Message::ptr_t& message);
 
@@ -39,7 +81,7 @@ signals:
 
 private:
     Registry<int, Message> registry_;
-    LruCache<Message::ptr_t> lru_cache_{3};
+    LruCache<Message::ptr_t> lru_cache_;
 
 };
 
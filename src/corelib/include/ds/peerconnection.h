@@ -170,6 +170,20 @@ struct PeerUserInfo : public PeerReq
 };
 
 
+/*! Measured quality of a connection */
+struct ConnectionStats
+{
+    // Smoothed round-trip time in milliseconds, measured with ping/pong. -1 if unknown.
+    int rtt = -1;
+
+    // Bytes per second delivered to the network and received from the peer
+    qint64 sendRate = 0;
+    qint64 receiveRate = 0;
+
+    quint64 bytesSent = 0;
+    quint64 bytesReceived = 0;
+};
+
 /*! Representation of a incoming or outgoing connection to a contact.
  *
  *  Owned by the protocol module. Lifetime is purely managed as std::shared_ptr.
@@ -205,6 +219,15 @@ public:
     virtual uint64_t sendSome(File& file) = 0;
     virtual void disableNotifications() = 0;
 
+    /*! Attach an authenticated data connection to the same contact.
+     *
+     * Data connections carry ranges of large files in parallel with
+     * this connection, over other Tor circuits.
+     */
+    virtual void addDataConnection(const ptr_t& peer) = 0;
+
+    virtual ConnectionStats getStats() const = 0;
+
 signals:
     void connectedToPeer(const std::shared_ptr<PeerConnection>& peer);
     void disconnectedFromPeer(const std::shared_ptr<PeerConnection>& peer);
@@ -215,6 +238,14 @@ signals:
     void receivedAvatar(const PeerSetAvatarReq& avatar);
     void receivedUserInfo(const PeerUserInfo& uinfo);
     void outputBufferEmptied();
+
+    // We want count data connections to the peer for a striped transfer.
+    // The connections must be created with ConnectData::transfer set
+    // to transfer, and given to addDataConnection() when connected.
+    void dataConnectionsWanted(const QUuid& transfer, const int count);
+
+    // The numbers returned by getStats() are updated
+    void statsChanged();
 };
 
 }}
@@ -23,6 +23,7 @@ struct ConnectData {
     QByteArray address;  // Onion address
     crypto::DsCert::ptr_t contactsCert;
     crypto::DsCert::ptr_t identitysCert;
+    QUuid transfer; // Set for connections dedicated to one bulk transfer
 };
 
 struct AddmeReq {
@@ -119,6 +120,9 @@ signals:
     void serviceStarted(const QUuid& service, const bool newService);
     void serviceStopped(const QUuid& service);
 
+    /*! The service is (or is no longer) reachable from the network */
+    void servicePublished(const QUuid& service, const bool published);
+
     void incomingPeer(const std::shared_ptr<PeerConnection>& peer);
 
 public slots:
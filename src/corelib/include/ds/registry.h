@@ -3,16 +3,48 @@
 
 // See https://lastviking.eu/singleton_objects.html
 
-#include <map>
+#include <functional>
 #include <memory>
-#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <QHash>
+#include <QUuid>
 
 namespace ds {
 namespace core {
 
+// std::hash for the keys that have it, qHash() for QUuid
+struct RegistryHash {
+    size_t operator()(const QUuid& key) const noexcept {
+        return qHash(key);
+    }
+
+    template <typename T>
+    size_t operator()(const T& key) const noexcept {
+        return std::hash<T>{}(key);
+    }
+};
+
+/*! Maps a key to the one live instance of an object.
+ *
+ * The registry only holds weak pointers. Expired entries are removed
+ * when they are found by fetch(), and by an incremental sweep: Each
+ * add() looks at the next sweep_buckets buckets of the hash table. So
+ * the number of dead entries stays in proportion to the live ones,
+ * without ever walking the whole table at once.
+ */
 template <typename keyT, typename valueT>
 class Registry {
 public:
+    struct Stats {
+        size_t entries = 0; // Live and expired
+        quint64 added = 0;
+        quint64 expired = 0; // Expired entries removed so far
+    };
+
+    static constexpr size_t sweep_buckets = 4;
+
     Registry() = default;
 
     std::shared_ptr<valueT> fetch(const keyT& key) const {
@@ -24,6 +56,7 @@ public:
 
             // Expired.
             registry_.erase(it);
+            ++stats_.expired;
         }
 
         return {};
@@ -31,17 +64,45 @@ public:
 
     void add(const keyT& key, const std::shared_ptr<valueT>& value) {
         registry_[key] = value;
+        ++stats_.added;
+        sweep(sweep_buckets);
     }
 
     void remove(const keyT& key) {
         registry_.erase(key);
     }
 
+    // Remove the expired entries in the next numBuckets buckets
+    void sweep(size_t numBuckets) {
+        const auto buckets = registry_.bucket_count();
+        for(; numBuckets > 0; --numBuckets) {
+            if (sweepBucket_ >= buckets) {
+                sweepBucket_ = 0;
+            }
+
+            // Erasing don't rehash, but it invalidates the bucket's local iterators
+            for(auto it = registry_.begin(sweepBucket_); it != registry_.end(sweepBucket_); ++it) {
+                if (it->second.expired()) {
+                    expiredKeys_.push_back(it->first);
+                }
+            }
+
+            for(const auto& key : expiredKeys_) {
+                registry_.erase(key);
+                ++stats_.expired;
+            }
+            expiredKeys_.clear();
+
+            ++sweepBucket_;
+        }
+    }
+
+    // Remove all the expired entries
     void clean() {
         for(auto it = registry_.begin(); it != registry_.end();) {
             if (it->second.expired()) {
-                static_assert(__cplusplus >= 201103L, "Require at least C++ 11");
                 it = registry_.erase(it);
+                ++stats_.expired;
             } else {
                 ++it;
             }
@@ -52,12 +113,32 @@ public:
         return registry_.size();
     }
 
+    // Walks the whole table. For diagnostics.
+    size_t countExpired() const {
+        size_t count = 0;
+        for(const auto& e : registry_) {
+            if (e.second.expired()) {
+                ++count;
+            }
+        }
+        return count;
+    }
+
+    Stats getStats() const {
+        auto stats = stats_;
+        stats.entries = registry_.size();
+        return stats;
+    }
+
     void clear() {
         registry_.clear();
     }
 
 private:
-    mutable std::map<keyT, std::weak_ptr<valueT>> registry_;
+    mutable std::unordered_map<keyT, std::weak_ptr<valueT>, RegistryHash> registry_;
+    mutable Stats stats_;
+    size_t sweepBucket_ = 0;
+    std::vector<keyT> expiredKeys_;
 };
 
 }}
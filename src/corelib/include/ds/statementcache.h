@@ -0,0 +1,103 @@
+#ifndef STATEMENTCACHE_H
+#define STATEMENTCACHE_H
+
+#include <memory>
+
+#include <QHash>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QString>
+
+namespace ds {
+namespace core {
+
+/*! Cache of prepared statements, keyed by the SQL text.
+ *
+ * Compiling a statement is often more expensive than running it
+ * for the simple lookups we do all the time. The cache keeps the
+ * prepared QSqlQuery objects for the database, so they are only
+ * compiled once.
+ *
+ * There is one cache for each Database.
+ */
+class StatementCache
+{
+    struct Entry {
+        Entry(const QSqlDatabase& db) : query{db} {}
+
+        QSqlQuery query;
+        bool inUse = false;
+    };
+
+public:
+    struct Stats {
+        quint64 hits = {};
+        quint64 misses = {};
+    };
+
+    /*! A prepared query, borrowed from the cache.
+     *
+     * Bind the values and exec() it as usual. The query is
+     * finish()'ed and returned to the cache when this object goes
+     * out of scope.
+     */
+    class Query {
+    public:
+        Query(Query&&) = default;
+        Query(const Query&) = delete;
+        Query& operator = (const Query&) = delete;
+        Query& operator = (Query&&) = delete;
+        ~Query();
+
+        QSqlQuery& operator *() noexcept { return *query_; }
+        QSqlQuery *operator ->() noexcept { return query_; }
+
+    private:
+        friend class StatementCache;
+        Query(std::shared_ptr<Entry> entry);
+        Query(std::unique_ptr<QSqlQuery> uncached);
+
+        std::shared_ptr<Entry> entry_;
+        std::unique_ptr<QSqlQuery> uncached_;
+        QSqlQuery *query_ = {};
+    };
+
+    StatementCache(QSqlDatabase& db, int maxEntries = 256);
+    ~StatementCache();
+
+    /*! Get a prepared query for sql.
+     *
+     * If the statement is already in use (by a recursive call),
+     * a new query is prepared, and not cached.
+     *
+     * Throws Error if the statement can not be prepared.
+     */
+    Query get(const QString& sql);
+
+    // Remove all the statements. Must be called before the database is closed.
+    void clear();
+
+    const Stats& getStats() const noexcept { return stats_; }
+
+    // The cache for the current Database
+    static StatementCache& instance();
+
+private:
+    std::unique_ptr<QSqlQuery> prepare(const QString& sql);
+
+    QSqlDatabase& db_;
+    const int maxEntries_;
+    QHash<QString, std::shared_ptr<Entry>> entries_;
+    Stats stats_;
+    static StatementCache *instance_;
+};
+
+// "?,?,?" for count values. For queries like "WHERE id IN (...)"
+QString placeholders(const size_t count);
+
+// Max number of values we bind in one "IN (...)" list
+constexpr size_t max_in_list = 500;
+
+}} // namespaces
+
+#endif // STATEMENTCACHE_H
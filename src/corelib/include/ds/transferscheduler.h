@@ -0,0 +1,125 @@
+#ifndef TRANSFERSCHEDULER_H
+#define TRANSFERSCHEDULER_H
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <vector>
+
+#include <QObject>
+#include <QSettings>
+
+#include "ds/file.h"
+
+namespace ds {
+namespace core {
+
+class DsEngine;
+
+/*! Admission control for file transfers.
+ *
+ * Contacts ask the scheduler before they start sending a queued file.
+ * If there is no free slot, the transfer waits here until one of
+ * the active transfers ends, and then the Contact is told to start it.
+ *
+ * Only outgoing transfers are scheduled. The sender controls the data
+ * flow, so a slot on the receiving side would be held by a transfer
+ * that may still be waiting in the sender's queue.
+ *
+ * Limits, from the settings:
+ *  - "maxTransfers": active transfers in total (default 8)
+ *  - "maxTransfersPerContact": active transfers for one contact (default 2)
+ *  - "maxLargeTransfers": active transfers of files of at least
+ *     "largeTransferSize" bytes (default 2, and 64 MB).
+ *  - "transferDiskStallMs": no new large transfer is started while the
+ *     file reads and writes of the active transfers block for longer
+ *     than this on average (default 20). See reportDiskIo().
+ *
+ * When a slot is free, the next transfer is taken from the identity
+ * with the fewest active transfers, so one busy identity can not starve
+ * the others. Within the identity, the smallest file goes first, unless
+ * a file has waited for more than "transferMaxWaitSecs" (default 300).
+ * Those go first, in the order they arrived.
+ */
+class TransferScheduler : public QObject
+{
+    Q_OBJECT
+public:
+    TransferScheduler(DsEngine& engine, QSettings& settings);
+
+    /*! Ask for a slot for an outgoing file in state FS_QUEUED.
+     *
+     * Returns true if the transfer can start now. If not, the
+     * file is queued, and Contact::startAdmittedTransfer() is
+     * called when it gets a slot.
+     */
+    bool admit(const File::ptr_t& file);
+
+    /*! Report how long a read or write of file data blocked, in microseconds.
+     *
+     * The file channels call this for their disk I/O, in both directions,
+     * as the reads and writes compete for the same disk.
+     */
+    void reportDiskIo(const qint64 usecs);
+
+    /*! Forget the transfers for a contact that went offline.
+     *
+     * The queued files are loaded again by the Contact when
+     * it reconnects.
+     */
+    void releaseContact(const int contactId);
+
+    size_t getActiveCount() const noexcept { return active_.size(); }
+    size_t getQueuedCount() const noexcept { return queue_.size(); }
+
+signals:
+    void queueChanged();
+
+private slots:
+    void onFileStateChanged(const File *file);
+
+private:
+    struct Active {
+        int contact = {};
+        int identity = {};
+        bool large = false;
+    };
+
+    struct Queued {
+        File::ptr_t file;
+        quint64 seq = {}; // Arrival order
+        qint64 queued = {}; // When it arrived, in milliseconds since epoch
+    };
+
+    // Move the files that can start from the queue to active_
+    std::vector<File::ptr_t> activate();
+    void schedule();
+    void start(const File::ptr_t& file);
+    bool canStart(const File& file) const;
+    bool isLarge(const File& file) const;
+    bool isDiskBusy() const;
+    void sortQueue();
+    void updatePositions();
+
+    template <typename T>
+    int countFor(T Active::*member, const T value) const {
+        return static_cast<int>(std::count_if(active_.begin(), active_.end(),
+                                              [member, value](const auto& a) {
+            return a.second.*member == value;
+        }));
+    }
+
+    DsEngine& engine_;
+    QSettings& settings_;
+    std::map<int, Active> active_; // By file id
+    std::deque<Queued> queue_; // Sorted in the order the files will start
+    std::map<int, quint64> lastServed_; // When each identity last got a slot
+    quint64 seq_ = {};
+    double diskStall_ = {}; // Moving average of reportDiskIo(), in microseconds
+    qint64 lastDiskIo_ = {}; // Milliseconds since epoch
+    bool diskRetryPending_ = false;
+};
+
+}} // namespaces
+
+#endif // TRANSFERSCHEDULER_H
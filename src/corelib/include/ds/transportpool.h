@@ -0,0 +1,74 @@
+#ifndef TRANSPORTPOOL_H
+#define TRANSPORTPOOL_H
+
+#include <QObject>
+#include <QSettings>
+#include <QTimer>
+#include <QUuid>
+
+#include "ds/transporthandle.h"
+
+namespace ds {
+namespace core {
+
+class DsEngine;
+
+/*! Pool of pre-created transport handles (Tor hidden service keys).
+ *
+ * The pool keeps a few handles that are created in advance, when the
+ * engine is idle, so that createIdentity() can assign one immediately.
+ * The Tor protocol manager generates the keys locally, so a pooled key
+ * is not known to the Tor network until an Identity starts its service.
+ *
+ * The handles are stored in the database, encrypted with a key
+ * kept in the settings. The size of the pool is set by the
+ * "transportPoolSize" setting. 0 disables the pool.
+ */
+class TransportPool : public QObject
+{
+    Q_OBJECT
+public:
+    TransportPool(DsEngine& engine, QSettings& settings);
+
+    /*! Assign a pooled handle to an identity.
+     *
+     * Emits transportHandleReady() for the identity and returns
+     * true if the pool had a handle available.
+     */
+    bool assign(const QString& identityName, const QUuid& uuid);
+
+    /*! Returns true if the handle was requested by the pool. */
+    bool add(const TransportHandle& th);
+
+    /*! Returns true if the failed request was made by the pool. */
+    bool onError(const TransportHandleError& the);
+
+    /*! Number of handles available in the pool */
+    int count() const;
+
+    int getSize() const;
+
+signals:
+    void transportHandleReady(const TransportHandle& th);
+
+public slots:
+    /*! Start refilling the pool when the engine has been idle for a while */
+    void scheduleRefill();
+
+private slots:
+    void refill();
+
+private:
+    QByteArray getKey();
+    QByteArray encrypt(const QByteArray& data);
+    bool decrypt(const QByteArray& data, QByteArray& plaintext);
+
+    DsEngine& engine_;
+    QSettings& settings_;
+    QTimer idleTimer_;
+    QUuid pending_; // The handle we are currently waiting for
+};
+
+}} // namespaces
+
+#endif // TRANSPORTPOOL_H
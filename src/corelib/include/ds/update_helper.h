@@ -8,6 +8,7 @@
 #include <QImage>
 
 #include "ds/errors.h"
+#include "ds/writebehind.h"
 
 namespace ds {
 namespace core {
@@ -15,20 +16,8 @@ namespace core {
 
 template <typename T>
 void update(T *self, const char *name, const QVariant& value) {
-    QByteArray sql{"UPDATE "};
-    sql += self->getTableName();
-    sql += " SET ";
-    sql += name;
-    sql += " =:value where id=:id";
-
-    QSqlQuery query;
-    query.prepare(sql);
-    query.bindValue(":id", self->getId());
-    query.bindValue(":value", value);
-    if(!query.exec()) {
-        throw Error(QStringLiteral("SQL query failed: %1").arg(
-                        query.lastError().text()));
-    }
+    // Written now, or in a batch a little later, depending on the column
+    WriteBehind::instance().update(self->getTableName(), self->getId(), name, value);
 }
 
 // https://wiki.qt.io/How_to_Store_and_Retrieve_Image_on_SQLite
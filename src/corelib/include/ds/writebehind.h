@@ -0,0 +1,75 @@
+#ifndef WRITEBEHIND_H
+#define WRITEBEHIND_H
+
+#include <map>
+#include <tuple>
+
+#include <QByteArray>
+#include <QObject>
+#include <QSettings>
+#include <QSqlDatabase>
+#include <QTimer>
+#include <QVariant>
+
+#include "ds/statementcache.h"
+
+namespace ds {
+namespace core {
+
+/*! Write-behind for the property updates done by core::update().
+ *
+ * When enabled ("dbWriteBehindDelay" > 0 milliseconds), updates of the
+ * columns below are held in memory, and written in one transaction when
+ * the delay expires. Later updates of the same column replace the pending
+ * value. On a crash, we lose at most the last delay's worth of these:
+ *
+ *  - contact.last_seen: Only shown to the user.
+ *  - conversation.updated, conversation.unread: Only shown to the user.
+ *    A message may be shown as unread again.
+ *  - file.bytes_transferred: The progress shown to the user. Transfers
+ *    that were active are restarted from the beginning anyway.
+ *  - message.state: A message may be sent again. The receiver ignores
+ *    messages it already has.
+ *
+ * All other columns are written at once. If there are pending updates,
+ * they are written in the same transaction, so the database is never
+ * ahead of itself for those. The pending updates are also written when
+ * the database is closed.
+ */
+class WriteBehind : public QObject
+{
+    Q_OBJECT
+public:
+    WriteBehind(QSqlDatabase& db, StatementCache& statements, QSettings& settings);
+    ~WriteBehind();
+
+    // UPDATE table SET column=value WHERE id=id
+    void update(const char *table, const int id, const char *column, const QVariant& value);
+
+    // Returns true if the column may be written later
+    static bool isDeferrable(const QByteArray& table, const QByteArray& column);
+
+    static WriteBehind& instance();
+
+public slots:
+    // Write all pending updates
+    void flush();
+
+private:
+    using key_t = std::tuple<QByteArray, QByteArray, int>; // table, column, id
+
+    void write(const key_t& key, const QVariant& value);
+
+    QSqlDatabase& db_;
+    StatementCache& statements_;
+    const int delay_;
+    std::map<key_t, QVariant> pending_;
+    QTimer timer_;
+    quint64 updates_ = {};
+    quint64 transactions_ = {};
+    static WriteBehind *instance_;
+};
+
+}} // namespaces
+
+#endif // WRITEBEHIND_H
@@ -1,5 +1,8 @@
 ﻿
+#include <algorithm>
+#include <iterator>
 #include <memory>
+#include <vector>
 
 #include <QTimer>
 
@@ -10,6 +13,7 @@
 #include "ds/update_helper.h"
 #include "ds/errors.h"
 #include "ds/conversation.h"
+#include "ds/dbexecutor.h"
 
 #include "logfault/logfault.h"
 
@@ -101,6 +105,45 @@ void Contact::connectToContact()
     setManuallyDisconnected(false);
 }
 
+void Contact::autoConnectToContact()
+{
+    if (isPreferredDialer()) {
+        connectToContact();
+        return;
+    }
+
+    if (arbitrationPending_) {
+        return;
+    }
+
+    const auto window = DsEngine::instance().settings().value(
+                "connectArbitrationWindow", 15000).toInt();
+
+    LFLOG_DEBUG << "Waiting up to " << (window / 1000)
+                << " seconds for Contact " << getName()
+                << " to connect to Identity " << getIdentity()->getName()
+                << " before dialing.";
+
+    arbitrationPending_ = true;
+    QTimer::singleShot(window, this, [this]() {
+        arbitrationPending_ = false;
+
+        if (getOnlineStatus() != DISCONNECTED) {
+            // Only count it if it was the peer that connected, not a manual dial
+            if (connection_ && (connection_->peer->getDirection() == PeerConnection::INCOMING)) {
+                LFLOG_DEBUG << "Contact " << getName()
+                            << " connected first. Not dialing.";
+                getIdentity()->registerAvoidedHandshake();
+            }
+            return;
+        }
+
+        if (!iBlocked() && !wasManuallyDisconnected()) {
+            connectToContact();
+        }
+    });
+}
+
 void Contact::disconnectFromContact(bool manual)
 {
     prepareForNewConnection();
@@ -335,6 +378,30 @@ Contact::OnlineStatus Contact::getOnlineStatus() const noexcept
     return onlineStatus_;
 }
 
+ConnectionStats Contact::getConnectionStats() const
+{
+    if (connection_) {
+        return connection_->peer->getStats();
+    }
+
+    return {};
+}
+
+int Contact::getRtt() const
+{
+    return getConnectionStats().rtt;
+}
+
+qlonglong Contact::getSendRate() const
+{
+    return getConnectionStats().sendRate;
+}
+
+qlonglong Contact::getReceiveRate() const
+{
+    return getConnectionStats().receiveRate;
+}
+
 void Contact::setOnlineStatus(const Contact::OnlineStatus status)
 {
     if (onlineStatus_ != status) {
@@ -427,6 +494,18 @@ void Contact::queueFile(const std::shared_ptr<File> &file)
     processFilesQueue();
 }
 
+void Contact::startAdmittedTransfer(const std::shared_ptr<File> &file)
+{
+    if (file->getState() == File::FS_QUEUED) {
+        try {
+            queueTransfer(file);
+        } catch(const std::exception& ex) {
+            LFLOG_WARN << "Caught exception while starting transfer: " << ex.what();
+            file->transferFailed(ex.what(), File::FS_FAILED);
+        }
+    }
+}
+
 void Contact::sendAvatar(const QImage &avatar)
 {
     if (!isOnline()) {
@@ -621,9 +700,11 @@ void Contact::onConnectedToPeer(const std::shared_ptr<PeerConnection>& peer)
          */
 
         if (isOnline() && connection_ && (connection_->peer->getDirection() != peer->getDirection())) {
-            if (getCert()->getHash().toByteArray() < peer->getPeerCert()->getHash().toByteArray()) {
-                LFLOG_NOTICE << "Incmoing connection with id " << peer->getConnectionId().toString()
-                             << " has a 'larger' hash than my hash. "
+            const auto preferred = isPreferredDialer()
+                    ? PeerConnection::OUTGOING : PeerConnection::INCOMING;
+            if (peer->getDirection() != preferred) {
+                LFLOG_NOTICE << "Connection with id " << peer->getConnectionId().toString()
+                             << " was not dialed by the side with the lesser hash. "
                              << "I will therefore prefer my current, active connection "
                              << connection_->peer->getConnectionId().toString();
                 peer->close();
@@ -666,6 +747,12 @@ void Contact::onConnectedToPeer(const std::shared_ptr<PeerConnection>& peer)
     connect(connection_->peer.get(), &PeerConnection::outputBufferEmptied,
             this, &Contact::onOutputBufferEmptied);
 
+    connect(connection_->peer.get(), &PeerConnection::dataConnectionsWanted,
+            this, &Contact::onDataConnectionsWanted);
+
+    connect(connection_->peer.get(), &PeerConnection::statsChanged,
+            this, &Contact::connectionStatsChanged);
+
     setOnlineStatus(ONLINE);
     touchLastSeen();
 }
@@ -678,6 +765,27 @@ void Contact::onIncomingPeer(const std::shared_ptr<PeerConnection> &peer)
         return;
     }
 
+    if (connection_
+            && (connection_->peer->getDirection() == PeerConnection::OUTGOING)
+            && (getOnlineStatus() == CONNECTING)
+            && !isPreferredDialer()) {
+        // The peer is the preferred dialer. Drop our own dial before
+        // it completes its handshake.
+        LFLOG_DEBUG << "Cancelling outgoing connection "
+                    << connection_->peer->getConnectionId().toString()
+                    << " to Contact " << getName()
+                    << " in favour of incoming connection "
+                    << peer->getConnectionId().toString();
+        prepareForNewConnection();
+        connection_.reset();
+
+        // We are not connected until the incoming peer completes its handshake.
+        // If it fails, nothing else will take us out of CONNECTING.
+        setOnlineStatus(DISCONNECTED);
+        getIdentity()->unregisterConnection(getUuid());
+        getIdentity()->registerAvoidedHandshake();
+    }
+
     connect(peer.get(), &PeerConnection::connectedToPeer,
             this, &Contact::onConnectedToPeer);
 
@@ -694,6 +802,45 @@ void Contact::onDisconnectedFromPeer(const std::shared_ptr<PeerConnection>& peer
     setOnlineStatus(DISCONNECTED);
     clearFileQueues();
     getIdentity()->unregisterConnection(getUuid());
+    emit connectionStatsChanged();
+}
+
+void Contact::onDataConnectionsWanted(const QUuid &transfer, const int count)
+{
+    auto identity = getIdentity();
+    if (!identity || !isOnline()) {
+        return;
+    }
+
+    for(int i = 0; i < count; ++i) {
+        ConnectData cd;
+        cd.address = getAddress();
+        cd.contactsCert = getCert();
+        cd.identitysCert = identity->getCert();
+        cd.service = identity->getUuid();
+        cd.transfer = transfer;
+
+        try {
+            const auto peer = identity->getProtocolManager().connectTo(cd);
+
+            LFLOG_DEBUG << "Opening data connection " << peer->getConnectionId().toString()
+                        << " to " << getName() << " for transfer " << transfer.toString();
+
+            // The data connection is owned by the protocol layer
+            connect(peer.get(), &PeerConnection::connectedToPeer,
+                    this, [this](const std::shared_ptr<PeerConnection>& peer) {
+                if (isOnline()) {
+                    connection_->peer->addDataConnection(peer);
+                } else {
+                    peer->close();
+                }
+            });
+        } catch(const std::exception& ex) {
+            LFLOG_WARN << "Failed to open data connection to " << getName()
+                       << ": " << ex.what();
+            return;
+        }
+    }
 }
 
 void Contact::onSendAddMeLater()
@@ -986,6 +1133,11 @@ void Contact::onReceivedAck(const PeerAck &ack)
 
 bool Contact::procesMessageQueue()
 {
+    if (loadingMessageQueue_) {
+        // Don't send the new messages before the old ones
+        return false;
+    }
+
     if (isOnline() && !messageQueue_.empty()) {
         // Send one message. Wait for the socket's buffer to be clear before proceeding with the next
 
@@ -1022,6 +1174,11 @@ bool Contact::processFilesQueue()
                     file->setState(File::FS_OFFERED);
                     break;
                 case File::FS_QUEUED:
+                    if (!DsEngine::instance().getTransferScheduler()->admit(file)) {
+                        // The scheduler starts it when there is a free slot
+                        fileQueue_.erase(fileQueue_.begin());
+                        return processFilesQueue();
+                    }
                     queueTransfer(file);
                     break;
                 default:
@@ -1033,6 +1190,7 @@ bool Contact::processFilesQueue()
             } else /* File::INCOMING */ {
                 switch(file->getState()) {
                 case File::FS_QUEUED:
+                    // The sender schedules the transfer
                     queueTransfer(file);
                     break;
                 default:
@@ -1199,33 +1357,60 @@ void Contact::onOutputBufferEmptied()
 
 void Contact::loadMessageQueue()
 {
-    if (loadedMessageQueue_) {
+    if (loadedMessageQueue_ || loadingMessageQueue_) {
         return;
     }
 
-    QSqlQuery query;
-    query.prepare("SELECT m.id FROM message AS m LEFT JOIN conversation AS c ON m.conversation_id = c.id WHERE c.participants = :contact AND m.received_time IS NULL ORDER BY m.id");
-    query.bindValue(":contact", getUuid().toString());
+    loadingMessageQueue_ = true;
 
-    if(!query.exec()) {
-        throw Error(QStringLiteral("Failed to query message-queue: %1").arg(
-                        query.lastError().text()));
-    }
+    // The query joins all the messages in the conversations. Let the worker do it.
+    DsEngine::instance().getDbExecutor().query(
+                [contact=getUuid().toString()](QSqlDatabase& db) {
+        QSqlQuery query(db);
+        query.prepare("SELECT m.id FROM message AS m LEFT JOIN conversation AS c ON m.conversation_id = c.id WHERE c.participants = :contact AND m.received_time IS NULL ORDER BY m.id");
+        query.bindValue(":contact", contact);
 
-    auto messageMgr = DsEngine::instance().getMessageManager();
+        if(!query.exec()) {
+            throw Error(QStringLiteral("Failed to query message-queue: %1").arg(
+                            query.lastError().text()));
+        }
 
-    while(query.next()) {
-        messageQueue_.push_back(messageMgr->getMessage(query.value(0).toInt()));
-    }
+        vector<int> ids;
+        while(query.next()) {
+            ids.push_back(query.value(0).toInt());
+        }
+        return ids;
+    }, this, [this](vector<int> ids) {
+        auto messageMgr = DsEngine::instance().getMessageManager();
+
+        // Messages queued while we were loading may also be in the result
+        ids.erase(remove_if(ids.begin(), ids.end(), [this](const int id) {
+            return any_of(messageQueue_.begin(), messageQueue_.end(), [id](const auto& m) {
+                return m->getId() == id;
+            });
+        }), ids.end());
+
+        const auto messages = messageMgr->getMessages(ids);
+        decltype(messageQueue_) queue{messages.begin(), messages.end()};
+
+        if (!queue.empty()) {
+            LFLOG_DEBUG << "Loaded " << queue.size()
+                        << " queued messages for contact "
+                        << getName()
+                        << " on identity " << getIdentity()->getName();
+        }
 
-    if (!messageQueue_.empty()) {
-        LFLOG_DEBUG << "Loaded " << messageQueue_.size()
-                    << " queued messages for contact "
-                    << getName()
-                    << " on identity " << getIdentity()->getName();
-    }
+        // The old messages go first
+        move(messageQueue_.begin(), messageQueue_.end(), back_inserter(queue));
+        messageQueue_.swap(queue);
 
-    loadedMessageQueue_ = true;
+        loadingMessageQueue_ = false;
+        loadedMessageQueue_ = true;
+        onOutputBufferEmptied();
+    }, [this](const QString&) {
+        // Try again next time
+        loadingMessageQueue_ = false;
+    });
 }
 
 void Contact::loadFileQueue()
@@ -1247,10 +1432,13 @@ void Contact::loadFileQueue()
                         query.lastError().text()));
     }
 
-    auto fileMgr = DsEngine::instance().getFileManager();
-
+    vector<int> ids;
     while(query.next()) {
-        fileQueue_.push_back(fileMgr->getFile(query.value(0).toInt()));
+        ids.push_back(query.value(0).toInt());
+    }
+
+    for(auto& file : DsEngine::instance().getFileManager()->getFiles(ids)) {
+        fileQueue_.push_back(move(file));
     }
 
     if (!fileQueue_.empty()) {
@@ -1327,6 +1515,15 @@ void Contact::clearFileQueues()
 
     transferringFileQueue_.clear();
     loadedFileQueue_ = false; // No longer loaded
+
+    DsEngine::instance().getTransferScheduler()->releaseContact(getId());
+}
+
+bool Contact::isPreferredDialer() const
+{
+    // Both sides compare the same two hashes, so exactly one of them wins
+    return getIdentity()->getCert()->getHash().toByteArray()
+            < getCert()->getHash().toByteArray();
 }
 
 void Contact::prepareForNewConnection()
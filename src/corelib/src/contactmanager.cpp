@@ -17,6 +17,7 @@ using namespace std;
 
 ContactManager::ContactManager(QObject &parent)
     : QObject (&parent)
+    , lru_cache_{DsEngine::instance().settings().value("contactCacheSize", 64).toUInt()}
 {
     connect(this, &ContactManager::contactAdded,
             this, &ContactManager::onContactAddedLater);
@@ -6,6 +6,7 @@
 #include "ds/dsengine.h"
 #include "ds/identity.h"
 #include "ds/database.h"
+#include "ds/statementcache.h"
 
 #include "logfault/logfault.h"
 
@@ -16,6 +17,7 @@ using namespace std;
 
 ConversationManager::ConversationManager(QObject &parent)
 : QObject{&parent}
+, lru_cache_{DsEngine::instance().settings().value("conversationCacheSize", 64).toUInt()}
 {
 
 }
@@ -41,12 +43,11 @@ Conversation::ptr_t ConversationManager::getConversation(const QUuid &uuid)
 
 Conversation::ptr_t ConversationManager::getConversation(const int dbId)
 {
-    QSqlQuery query;
-    query.prepare("SELECT uuid FROM conversation WHERE id=:id");
-    query.bindValue(":id", dbId);
-    query.exec();
-    if (query.next()) {
-        return getConversation(query.value(0).toUuid());
+    auto query = StatementCache::instance().get("SELECT uuid FROM conversation WHERE id=:id");
+    query->bindValue(":id", dbId);
+    query->exec();
+    if (query->next()) {
+        return getConversation(query->value(0).toUuid());
     }
 
     return {};
@@ -54,13 +55,12 @@ Conversation::ptr_t ConversationManager::getConversation(const int dbId)
 
 Conversation::ptr_t ConversationManager::getConversation(Contact *participant)
 {
-    QSqlQuery query;
-    query.prepare("SELECT uuid FROM conversation WHERE participants=:uuid AND identity=:identity");
-    query.bindValue(":uuid", participant->getUuid());
-    query.bindValue(":identity", participant->getIdentityId());
-    query.exec();
-    if (query.next()) {
-        return getConversation(query.value(0).toUuid());
+    auto query = StatementCache::instance().get("SELECT uuid FROM conversation WHERE participants=:uuid AND identity=:identity");
+    query->bindValue(":uuid", participant->getUuid());
+    query->bindValue(":identity", participant->getIdentityId());
+    query->exec();
+    if (query->next()) {
+        return getConversation(query->value(0).toUuid());
     }
 
     return addConversation({}, {}, participant);
@@ -68,14 +68,13 @@ Conversation::ptr_t ConversationManager::getConversation(Contact *participant)
 
 Conversation::ptr_t ConversationManager::getConversation(const QByteArray &hash, Contact *participant)
 {
-    QSqlQuery query;
-    query.prepare("SELECT uuid FROM conversation WHERE hash=:hash AND participants=:uuid AND identity=:identity");
-    query.bindValue(":hash", hash);
-    query.bindValue(":uuid", participant->getUuid());
-    query.bindValue(":identity", participant->getIdentityId());
-    query.exec();
-    if (query.next()) {
-        return getConversation(query.value(0).toUuid());
+    auto query = StatementCache::instance().get("SELECT uuid FROM conversation WHERE hash=:hash AND participants=:uuid AND identity=:identity");
+    query->bindValue(":hash", hash);
+    query->bindValue(":uuid", participant->getUuid());
+    query->bindValue(":identity", participant->getIdentityId());
+    query->exec();
+    if (query->next()) {
+        return getConversation(query->value(0).toUuid());
     }
 
     return {};
@@ -1,5 +1,8 @@
 
+#include <array>
+
 #include <QFileInfo>
+#include <QSqlRecord>
 
 #include "ds/database.h"
 #include "ds/file.h"
@@ -29,12 +32,19 @@ Database::Database(QSettings& settings)
         throw Error("Failed to open database");
     }
 
+    statements_ = std::make_unique<StatementCache>(db_);
+    writeBehind_ = std::make_unique<WriteBehind>(db_, *statements_, settings_);
+
+    // The journal mode can not be changed inside a transaction
+    applyProfile();
+
     if (new_database) {
         LFLOG_NOTICE << "Creating new database at location: " << dbpath;
         createDatabase();
     }
 
     exec("PRAGMA foreign_keys = ON");
+    reportProfile();
 
     QSqlQuery query("SELECT * FROM ds");
     if (!query.next()) {
@@ -42,19 +52,47 @@ Database::Database(QSettings& settings)
     }
 
     const auto dbver = query.value(DS_VERSION).toInt();
+    query.finish();
     LFLOG_DEBUG << "Database schema version is " << dbver;
-    if (dbver != currentVersion) {
-        LFLOG_WARN << "Database schema version is "
+    if (dbver > currentVersion) {
+        LFLOG_ERROR << "Database schema version is "
                    << dbver
-                   << " while I expected " << currentVersion;
+                   << " while I only know up to version " << currentVersion;
+        throw Error("The database is from a newer version of DarkSpeak");
     }
 
+    migrate(dbver);
+    createSearchIndex();
+
+#ifdef QT_DEBUG
+    checkQueryPlans();
+#endif
+
     prepareData();
 
+    if (journalMode_ == "wal") {
+        connect(&checkpointTimer_, &QTimer::timeout, this, &Database::checkpoint);
+        checkpointTimer_.start(settings.value("dbCheckpointInterval", 300000).toInt());
+    }
 }
 
 Database::~Database()
 {
+    // Write the pending updates
+    writeBehind_.reset();
+
+    if (journalMode_ == "wal") {
+        try {
+            // Leave a compact database file behind
+            exec("PRAGMA wal_checkpoint(TRUNCATE)");
+        } catch(const std::exception& ex) {
+            LFLOG_WARN << "Failed to checkpoint the database: " << ex.what();
+        }
+    }
+
+    // The prepared statements must go before the database is closed
+    statements_.reset();
+
     // Close the database and remove the connection to make our tests happy (no warnings).
     const auto name = db_.connectionName();
     db_.close();
@@ -74,12 +112,14 @@ void Database::createDatabase()
         exec(R"(CREATE TABLE "message" ( `id` INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT UNIQUE, `direction` INTEGER NOT NULL, `state` INTEGER NOT NULL, `conversation_id` INTEGER NOT NULL, `conversation` BLOB NOT NULL, `message_id` BLOB NOT NULL, `composed_time` INTEGER NOT NULL, `received_time` INTEGER, `content` TEXT NOT NULL, `signature` BLOB NOT NULL, `sender` BLOB NOT NULL, `encoding` INTEGER NOT NULL ))");
         exec(R"(CREATE TABLE "notification" ( `id` INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT UNIQUE, `status` INTEGER NOT NULL, `priority` INTEGER NOT NULL, `identity` INTEGER NOT NULL, `contact` INTEGER, `type` INTEGER NOT NULL, `timestamp` TEXT NOT NULL, `message` TEXT, `data` BLOB, `hash` BLOB ))");
         exec(R"(CREATE TABLE "file" ( `id` INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT UNIQUE, `file_id` BLOB NOT NULL, `state` INTEGER, `direction` INTEGER, `identity_id` INTEGER NOT NULL, `conversation_id` INTEGER, `contact_id` INTEGER NOT NULL, `hash` BLOB, `name` TEXT NOT NULL, `path` TEXT, `size` INTEGER NOT NULL, `file_time` TEXT, `created_time` TEXT NOT NULL, `ack_time` TEXT, `bytes_transferred` INTEGER DEFAULT 0, FOREIGN KEY(`conversation_id`) REFERENCES `conversation`(`id`), FOREIGN KEY(`identity_id`) REFERENCES `identity`(`id`), FOREIGN KEY(`contact_id`) REFERENCES `contact`(`id`) ))");
+        exec(R"(CREATE TABLE "transport_pool" ( `id` INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT UNIQUE, `created` TEXT NOT NULL, `data` BLOB NOT NULL ))");
         exec(R"(CREATE UNIQUE INDEX `ix_contact_hash` ON `contact` ( `identity`, `hash` ))");
         exec(R"(CREATE UNIQUE INDEX `ix_contact_name` ON `contact` ( `identity`, `name` ))");
         exec(R"(CREATE UNIQUE INDEX `ix_message_id` ON `message` (`conversation_id` ,`id` ))");
         QSqlQuery query(db_);
         query.prepare("INSERT INTO ds (version) VALUES (:version)");
-        query.bindValue(":version", currentVersion);
+        // The migrations bring the new database up to date
+        query.bindValue(":version", 1);
         if(!query.exec()) {
             throw Error("Failed to initialize database");
         }
@@ -92,6 +132,160 @@ void Database::createDatabase()
     db_.commit();
 }
 
+const std::vector<Database::Migration>& Database::getMigrations()
+{
+    // Append new migrations here, and update currentVersion.
+    // Statements that may have partially run before must be idempotent.
+    static const std::vector<Migration> migrations = {
+        {2, "Add the transport pool, and indexes for the frequent queries", {
+            R"(CREATE TABLE IF NOT EXISTS "transport_pool" ( `id` INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT UNIQUE, `created` TEXT NOT NULL, `data` BLOB NOT NULL ))",
+            R"(CREATE INDEX IF NOT EXISTS `ix_file_contact_state` ON `file` ( `contact_id`, `direction`, `state` ))",
+            R"(CREATE INDEX IF NOT EXISTS `ix_file_file_id` ON `file` ( `file_id`, `conversation_id` ))",
+            R"(CREATE INDEX IF NOT EXISTS `ix_message_message_id` ON `message` ( `message_id`, `direction` ))",
+            R"(CREATE INDEX IF NOT EXISTS `ix_message_received` ON `message` ( `conversation_id`, `received_time` ))",
+            R"(CREATE INDEX IF NOT EXISTS `ix_conversation_participants` ON `conversation` ( `identity`, `participants` ))",
+            R"(CREATE INDEX IF NOT EXISTS `ix_notification_hash` ON `notification` ( `hash` ))"
+        }},
+        {3, "Add indexes for paging through conversations", {
+            R"(CREATE INDEX IF NOT EXISTS `ix_message_conversation_composed` ON `message` ( `conversation_id`, `composed_time`, `id` ))",
+            R"(CREATE INDEX IF NOT EXISTS `ix_file_conversation_created` ON `file` ( `conversation_id`, `created_time`, `id` ))"
+        }}
+    };
+
+    return migrations;
+}
+
+void Database::migrate(const int fromVersion)
+{
+    for(const auto& m : getMigrations()) {
+        if (m.version <= fromVersion) {
+            continue;
+        }
+
+        LFLOG_NOTICE << "Migrating the database to schema version " << m.version
+                     << ": " << m.description;
+
+        if (!db_.transaction()) {
+            throw Error(QStringLiteral("Failed to start migration transaction: %1").arg(
+                            db_.lastError().text()));
+        }
+
+        try {
+            for(const auto sql : m.statements) {
+                exec(sql);
+            }
+
+            QSqlQuery query(db_);
+            query.prepare("UPDATE ds SET version=:version");
+            query.bindValue(":version", m.version);
+            if(!query.exec()) {
+                throw Error(QStringLiteral("Failed to update schema version: %1").arg(
+                                query.lastError().text()));
+            }
+        } catch(const std::exception& ex) {
+            LFLOG_ERROR << "Migration to schema version " << m.version
+                        << " failed: " << ex.what();
+            db_.rollback();
+            throw;
+        }
+
+        if (!db_.commit()) {
+            throw Error(QStringLiteral("Failed to commit migration: %1").arg(
+                            db_.lastError().text()));
+        }
+    }
+}
+
+void Database::createSearchIndex()
+{
+    if (queryValue("SELECT count(0) FROM sqlite_master WHERE type='table' AND name='message_fts'").toInt()) {
+        return;
+    }
+
+    if (!db_.transaction()) {
+        throw Error(QStringLiteral("Failed to start transaction: %1").arg(
+                        db_.lastError().text()));
+    }
+
+    try {
+        // The snippets mark the hits with char(1) and char(2). The content
+        // is from the peers, so these are removed from what we index.
+        exec(R"(CREATE VIEW IF NOT EXISTS message_fts_content AS SELECT id, replace(replace(content, char(1), ''), char(2), '') AS content FROM message)");
+    } catch(const std::exception&) {
+        db_.rollback();
+        throw;
+    }
+
+    // An external content table. The triggers keep it in sync with message.content.
+    try {
+        exec(R"(CREATE VIRTUAL TABLE message_fts USING fts5(content, content='message_fts_content', content_rowid='id', tokenize='unicode61 remove_diacritics 2'))");
+    } catch(const std::exception& ex) {
+        db_.rollback();
+        LFLOG_WARN << "Full-text search is not available. SQLite lacks FTS5? " << ex.what();
+        return;
+    }
+
+    try {
+        // Same as in the view. 'delete' must get exactly what was indexed.
+        exec(R"(CREATE TRIGGER IF NOT EXISTS message_fts_ai AFTER INSERT ON message BEGIN INSERT INTO message_fts(rowid, content) VALUES (new.id, replace(replace(new.content, char(1), ''), char(2), '')); END)");
+        exec(R"(CREATE TRIGGER IF NOT EXISTS message_fts_ad AFTER DELETE ON message BEGIN INSERT INTO message_fts(message_fts, rowid, content) VALUES ('delete', old.id, replace(replace(old.content, char(1), ''), char(2), '')); END)");
+        exec(R"(CREATE TRIGGER IF NOT EXISTS message_fts_au AFTER UPDATE OF content ON message BEGIN INSERT INTO message_fts(message_fts, rowid, content) VALUES ('delete', old.id, replace(replace(old.content, char(1), ''), char(2), '')); INSERT INTO message_fts(rowid, content) VALUES (new.id, replace(replace(new.content, char(1), ''), char(2), '')); END)");
+
+        LFLOG_NOTICE << "Building the full-text search index for the messages.";
+        exec("INSERT INTO message_fts(message_fts) VALUES ('rebuild')");
+    } catch(const std::exception&) {
+        db_.rollback();
+        throw;
+    }
+
+    if (!db_.commit()) {
+        throw Error(QStringLiteral("Failed to commit the search index: %1").arg(
+                        db_.lastError().text()));
+    }
+}
+
+void Database::checkQueryPlans()
+{
+    // The queries we run all the time, and the table (or alias) each one must not scan
+    static const std::vector<std::pair<const char *, const char *>> queries = {
+        {"SELECT id FROM file WHERE contact_id=1 AND ((direction=0 AND state=2) OR (direction=1 AND state=4))", "file"},
+        {"SELECT id FROM file WHERE file_id=x'00' AND conversation_id=1", "file"},
+        {"SELECT id FROM message WHERE message_id=x'00' and direction=0", "message"},
+        {"SELECT id FROM message WHERE conversation_id=1 and message_id=x'00'", "message"},
+        {"SELECT m.id FROM message AS m LEFT JOIN conversation AS c ON m.conversation_id = c.id WHERE c.participants = x'00' AND m.received_time IS NULL ORDER BY m.id", "m"},
+        {"SELECT uuid FROM conversation WHERE participants=x'00' AND identity=1", "conversation"},
+        {"SELECT count(0) FROM notification WHERE hash=x'00'", "notification"},
+        {"SELECT id FROM message WHERE conversation_id=1 AND composed_time <= '' ORDER BY composed_time DESC, id DESC", "message"},
+        {"SELECT id FROM file WHERE conversation_id=1 AND created_time <= '' ORDER BY created_time DESC, id DESC", "file"}
+    };
+
+    for(const auto& q : queries) {
+        QSqlQuery query(db_);
+        if (!query.exec(QStringLiteral("EXPLAIN QUERY PLAN %1").arg(q.first))) {
+            LFLOG_WARN << "Failed to get the query plan for: " << q.first
+                       << ": " << query.lastError().text();
+            continue;
+        }
+
+        // The last column is the description, like "SCAN file",
+        // "SCAN TABLE message AS m" or "SEARCH file USING INDEX ..."
+        while(query.next()) {
+            const auto detail = query.value(query.record().count() - 1).toString();
+            const auto words = detail.split(' ', QString::SkipEmptyParts);
+            if (words.value(0) != "SCAN") {
+                continue;
+            }
+
+            const int ix = (words.value(1) == "TABLE") ? 2 : 1;
+            const auto alias = (words.value(ix + 1) == "AS") ? words.value(ix + 2) : QString{};
+            if ((words.value(ix) == q.second) || (alias == q.second)) {
+                LFLOG_WARN << "Full table scan in hot query \"" << q.first
+                           << "\": " << detail;
+            }
+        }
+    }
+}
+
 void Database::exec(const char *sql)
 {
     QSqlQuery query(db_);
@@ -101,6 +295,99 @@ void Database::exec(const char *sql)
     }
 }
 
+void Database::exec(const QString &sql)
+{
+    exec(sql.toUtf8().constData());
+}
+
+QVariant Database::queryValue(const QString &sql)
+{
+    QSqlQuery query(db_);
+    query.exec(sql);
+    if (query.lastError().type() != QSqlError::NoError) {
+        throw Error(QStringLiteral("SQL query failed: %1").arg(query.lastError().text()));
+    }
+
+    return query.next() ? query.value(0) : QVariant{};
+}
+
+void Database::applyProfile()
+{
+    const auto profile = settings_.value("dbProfile", "fast").toString();
+
+    QString journalMode = "wal", synchronous = "NORMAL", tempStore = "MEMORY";
+    qlonglong cacheSizeKb = 16384, mmapSize = 64 * 1024 * 1024;
+
+    if (profile == "safe") {
+        synchronous = "FULL";
+    } else if (profile == "legacy") {
+        journalMode = "delete";
+        synchronous = "FULL";
+        tempStore = "DEFAULT";
+        cacheSizeKb = 2000;
+        mmapSize = 0;
+    } else if (profile != "fast") {
+        LFLOG_WARN << "Unknown database profile \"" << profile << "\". Using \"fast\".";
+    }
+
+    journalMode = settings_.value("dbJournalMode", journalMode).toString().toLower();
+    synchronous = settings_.value("dbSynchronous", synchronous).toString().toUpper();
+    tempStore = settings_.value("dbTempStore", tempStore).toString().toUpper();
+    cacheSizeKb = settings_.value("dbCacheSizeKb", cacheSizeKb).toLongLong();
+    mmapSize = settings_.value("dbMmapSize", mmapSize).toLongLong();
+
+    // journal_mode returns the mode in effect. In-memory databases can't use WAL.
+    journalMode_ = queryValue(QStringLiteral("PRAGMA journal_mode = %1").arg(journalMode))
+            .toString().toLower();
+    if (journalMode_ != journalMode) {
+        LFLOG_WARN << "Requested database journal mode \"" << journalMode
+                   << "\", but got \"" << journalMode_ << "\"";
+    }
+
+    exec(QStringLiteral("PRAGMA synchronous = %1").arg(synchronous));
+    exec(QStringLiteral("PRAGMA temp_store = %1").arg(tempStore));
+
+    // A negative value is the size in KiB rather than in pages
+    exec(QStringLiteral("PRAGMA cache_size = %1").arg(-cacheSizeKb));
+    exec(QStringLiteral("PRAGMA mmap_size = %1").arg(mmapSize));
+
+    // The DbExecutor's worker thread writes to the same file
+    exec(QStringLiteral("PRAGMA busy_timeout = %1").arg(
+             settings_.value("dbBusyTimeout", 5000).toInt()));
+}
+
+void Database::reportProfile()
+{
+    static const std::array<const char *, 4> synchronous_names = {"OFF", "NORMAL", "FULL", "EXTRA"};
+    static const std::array<const char *, 3> temp_store_names = {"DEFAULT", "FILE", "MEMORY"};
+
+    const auto synchronous = queryValue("PRAGMA synchronous").toUInt();
+    const auto tempStore = queryValue("PRAGMA temp_store").toUInt();
+
+    LFLOG_NOTICE << "Database profile: journal_mode=" << queryValue("PRAGMA journal_mode").toString()
+                 << ", synchronous=" << (synchronous < synchronous_names.size()
+                                         ? synchronous_names[synchronous] : "?")
+                 << ", cache_size=" << queryValue("PRAGMA cache_size").toLongLong()
+                 << ", mmap_size=" << queryValue("PRAGMA mmap_size").toLongLong()
+                 << ", temp_store=" << (tempStore < temp_store_names.size()
+                                        ? temp_store_names[tempStore] : "?")
+                 << ", foreign_keys=" << queryValue("PRAGMA foreign_keys").toInt();
+}
+
+void Database::checkpoint()
+{
+    // Returns: busy, frames in the WAL, frames checkpointed
+    QSqlQuery query(db_);
+    if (!query.exec("PRAGMA wal_checkpoint(PASSIVE)") || !query.next()) {
+        LFLOG_WARN << "Database checkpoint failed: " << query.lastError().text();
+        return;
+    }
+
+    LFLOG_TRACE << "Database checkpoint: busy=" << query.value(0).toInt()
+                << ", wal frames=" << query.value(1).toInt()
+                << ", checkpointed=" << query.value(2).toInt();
+}
+
 void Database::prepareData()
 {
     {   // Set outgoing files that was being transferred, when we last quit, to waiting state
@@ -0,0 +1,143 @@
+
+#include <cassert>
+
+#include <QSqlError>
+#include <QSqlQuery>
+
+#include "ds/dbexecutor.h"
+#include "ds/dsengine.h"
+#include "ds/errors.h"
+
+#include "logfault/logfault.h"
+
+namespace ds {
+namespace core {
+
+using namespace std;
+
+DbExecutor *DbExecutor::instance_;
+
+namespace {
+const QString connection_name{QStringLiteral("ds-worker")};
+}
+
+DbExecutor::DbExecutor(QSettings &settings)
+    : settings_{settings}
+    , useWorker_{settings.value("dbpath").toString() != ":memory:"}
+{
+    if (useWorker_) {
+        thread_ = make_unique<QThread>();
+        thread_->setObjectName("ds-db");
+        worker_ = make_unique<QObject>();
+        worker_->moveToThread(thread_.get());
+        thread_->start();
+
+        post([this](QSqlDatabase&) { open(); });
+    } else {
+        LFLOG_DEBUG << "DbExecutor: Using the main connection for the in-memory database.";
+    }
+
+    assert(!instance_);
+    instance_ = this;
+}
+
+DbExecutor::~DbExecutor()
+{
+    if (useWorker_) {
+        // Finish the work that is already queued, then stop the thread
+        QMetaObject::invokeMethod(worker_.get(), [this]() {
+            close();
+            QThread::currentThread()->quit();
+        }, Qt::QueuedConnection);
+
+        thread_->wait();
+    }
+
+    assert(instance_ == this);
+    instance_ = {};
+}
+
+void DbExecutor::post(DbExecutor::work_t work)
+{
+    auto fn = [this, work=move(work)]() {
+        auto& db = useWorker_ ? db_ : DsEngine::instance().getDb();
+        try {
+            work(db);
+        } catch(const std::exception& ex) {
+            LFLOG_WARN << "Caught exception from database work: " << ex.what();
+        }
+    };
+
+    QMetaObject::invokeMethod(useWorker_ ? worker_.get() : this, fn, Qt::QueuedConnection);
+}
+
+DbExecutor &DbExecutor::instance()
+{
+    assert(instance_);
+    return *instance_;
+}
+
+void DbExecutor::deliver(const QPointer<QObject> &context, std::function<void ()> fn)
+{
+    QMetaObject::invokeMethod(this, [context, fn=move(fn)]() {
+        if (!context) {
+            return; // The receiver is gone
+        }
+
+        try {
+            fn();
+        } catch(const std::exception& ex) {
+            LFLOG_ERROR << "Caught exception from database callback: " << ex.what();
+        }
+    }, Qt::QueuedConnection);
+}
+
+void DbExecutor::open()
+{
+    assert(QThread::currentThread() == thread_.get());
+
+    db_ = QSqlDatabase::addDatabase(QStringLiteral("QSQLITE"), connection_name);
+    db_.setDatabaseName(settings_.value("dbpath").toString());
+
+    if (!db_.open()) {
+        LFLOG_ERROR << "DbExecutor: Failed to open the database: "
+                    << db_.lastError().text();
+        return;
+    }
+
+    // The worker and the GUI thread share the file. Wait for the
+    // other one's write lock rather than failing at once.
+    QSqlQuery query(db_);
+    query.exec("PRAGMA foreign_keys = ON");
+    query.exec(QStringLiteral("PRAGMA busy_timeout = %1").arg(
+                   settings_.value("dbBusyTimeout", 5000).toInt()));
+
+    LFLOG_DEBUG << "DbExecutor: Opened the database in the worker thread.";
+}
+
+void DbExecutor::close()
+{
+    if (db_.isValid()) {
+        db_.close();
+        db_ = {};
+        QSqlDatabase::removeDatabase(connection_name);
+    }
+}
+
+void DbExecutor::begin(QSqlDatabase &db)
+{
+    if (!db.transaction()) {
+        throw Error(QStringLiteral("Failed to start transaction: %1").arg(
+                        db.lastError().text()));
+    }
+}
+
+void DbExecutor::commit(QSqlDatabase &db)
+{
+    if (!db.commit()) {
+        throw Error(QStringLiteral("Failed to commit transaction: %1").arg(
+                        db.lastError().text()));
+    }
+}
+
+}} // namespaces
@@ -12,6 +12,7 @@
 #include "ds/identity.h"
 #include "ds/base32.h"
 #include "ds/database.h"
+#include "ds/dbexecutor.h"
 #include "ds/logutil.h"
 #include "ds/bytes.h"
 #include "ds/memoryview.h"
@@ -73,6 +74,12 @@ QSqlDatabase& DsEngine::getDb()
     return database_->getDb();
 }
 
+DbExecutor &DsEngine::getDbExecutor()
+{
+    assert(dbExecutor_);
+    return *dbExecutor_;
+}
+
 IdentityManager *DsEngine::getIdentityManager()
 {
     return identityManager_;
@@ -98,6 +105,16 @@ FileManager *DsEngine::getFileManager()
     return fileManager_;
 }
 
+TransportPool *DsEngine::getTransportPool()
+{
+    return transportPool_;
+}
+
+TransferScheduler *DsEngine::getTransferScheduler()
+{
+    return transferScheduler_;
+}
+
 ProtocolManager &DsEngine::getProtocolMgr(ProtocolManager::Transport)
 {
     assert(tor_mgr_);
@@ -178,6 +195,7 @@ void DsEngine::online()
     }
 
     identityManager_->onOnline();
+    transportPool_->scheduleRefill();
 }
 
 void DsEngine::onServiceFailed(const QUuid& serviceId, const QByteArray &reason)
@@ -201,12 +219,47 @@ void DsEngine::onServiceStopped(const QUuid& serviceId)
     serviceStopped(serviceId);
 
     if (auto identity = identityManager_->identityFromUuid(serviceId)) {
+        identity->setPublished(false);
         identity->setOnline(false);
     }
 }
 
+void DsEngine::onServicePublished(const QUuid &serviceId, const bool published)
+{
+    if (auto identity = identityManager_->identityFromUuid(serviceId)) {
+        identity->setPublished(published);
+    }
+}
+
+void DsEngine::logRegistryStats()
+{
+    const auto log = [](const char *name, const auto& stats) {
+        LFLOG_DEBUG << "Registry " << name << ": " << stats.entries << " entries, "
+                    << stats.added << " added, " << stats.expired << " expired entries removed.";
+    };
+
+    const auto logCache = [](const char *name, const auto& stats) {
+        LFLOG_DEBUG << "Cache " << name << ": " << stats.entries << " entries, "
+                    << stats.bytes << " bytes, " << stats.hits << " hits, "
+                    << stats.misses << " misses, " << stats.evictions << " evictions.";
+    };
+
+    log("messages", messageManager_->getRegistryStats());
+    logCache("messages", messageManager_->getCacheStats());
+    log("files", fileManager_->getRegistryStats());
+    logCache("files", fileManager_->getCacheStats());
+    log("conversations", conversationManager_->getRegistryStats());
+    logCache("conversations", conversationManager_->getCacheStats());
+    log("contacts", contactManager_->getRegistryStats());
+    logCache("contacts", contactManager_->getCacheStats());
+}
+
 void DsEngine::onTransportHandleReady(const TransportHandle &th)
 {
+    if (transportPool_->add(th)) {
+        return;
+    }
+
     if (auto identity = identityManager_->identityFromUuid(th.uuid)) {
         LFLOG_NOTICE << "Assigning new handle " << th.handle
                      << " to identity " << identity->getName();
@@ -222,6 +275,10 @@ void DsEngine::onTransportHandleReady(const TransportHandle &th)
 
 void DsEngine::onTransportHandleError(const TransportHandleError &the)
 {
+    if (transportPool_->onError(the)) {
+        return;
+    }
+
     if (auto identity = getIdentityManager()->identityFromUuid(the.uuid)) {
         if (!identity->getAddress().isEmpty()) {
             LFLOG_WARN << "Failed to start " << identity->getAddress()
@@ -288,6 +345,10 @@ void DsEngine::start()
             &ds::core::ProtocolManager::serviceFailed,
             this, &DsEngine::onServiceFailed);
 
+    connect(tor_mgr_.get(),
+            &ds::core::ProtocolManager::servicePublished,
+            this, &DsEngine::onServicePublished);
+
     connect(tor_mgr_.get(),
             &ds::core::ProtocolManager::incomingPeer,
             this, [this](const std::shared_ptr<PeerConnection>& peer) {
@@ -445,12 +506,23 @@ void DsEngine::initialize()
     }
 
     database_ = std::make_unique<Database>(*settings_);
+    dbExecutor_ = std::make_unique<DbExecutor>(*settings_);
 
     identityManager_ = new IdentityManager(*this);
     contactManager_ = new ContactManager(*this);
     conversationManager_ = new ConversationManager(*this);
     messageManager_ = new MessageManager(*this);
     fileManager_ = new FileManager(*this, *settings_);
+    transportPool_ = new TransportPool(*this, *settings_);
+    transferScheduler_ = new TransferScheduler(*this, *settings_);
+
+    connect(transportPool_, &TransportPool::transportHandleReady,
+            this, &DsEngine::onTransportHandleReady);
+
+    if (const auto interval = settings_->value("registryStatsInterval", 600000).toInt()) {
+        connect(&registryStatsTimer_, &QTimer::timeout, this, &DsEngine::logRegistryStats);
+        registryStatsTimer_.start(interval);
+    }
 }
 
 void DsEngine::setState(DsEngine::State state)
@@ -1,5 +1,7 @@
 
+#include <algorithm>
 #include <chrono>
+#include <map>
 
 #include "ds/errors.h"
 #include "ds/dsengine.h"
@@ -294,6 +296,19 @@ float File::getProgress() const noexcept
     return status;
 }
 
+int File::getQueuePosition() const noexcept
+{
+    return queuePosition_;
+}
+
+void File::setQueuePosition(const int position)
+{
+    if (queuePosition_ != position) {
+        queuePosition_ = position;
+        emit queuePositionChanged();
+    }
+}
+
 Contact *File::getContact() const
 {
     return DsEngine::instance().getContactManager()->getContact(getContactId()).get();
@@ -420,10 +435,6 @@ File::ptr_t File::load(QObject &parent, const std::function<void (QSqlQuery &)>
 {
     QSqlQuery query;
 
-    enum Fields {
-        id, file_id, state, direction, identity_id, conversation_id, contact_id, hash, name, path, size, file_time, created_time, ack_time, bytes_transferred
-    };
-
     prepare(query);
 
     if(!query.exec()) {
@@ -435,6 +446,51 @@ File::ptr_t File::load(QObject &parent, const std::function<void (QSqlQuery &)>
         throw NotFoundError(QStringLiteral("file not found!"));
     }
 
+    return fromQuery(parent, query);
+}
+
+std::vector<File::ptr_t> File::load(QObject &parent, const std::vector<int> &dbIds)
+{
+    map<int, ptr_t> loaded;
+
+    for(size_t first = 0; first < dbIds.size(); first += max_in_list) {
+        const auto count = min(max_in_list, dbIds.size() - first);
+
+        QSqlQuery query;
+        query.prepare(getSelectStatement(QStringLiteral("id IN (%1)").arg(placeholders(count))));
+        for(size_t i = first; i < first + count; ++i) {
+            query.addBindValue(dbIds[i]);
+        }
+
+        if(!query.exec()) {
+            throw Error(QStringLiteral("Failed to fetch files: %1").arg(
+                            query.lastError().text()));
+        }
+
+        while(query.next()) {
+            auto ptr = fromQuery(parent, query);
+            loaded[ptr->getId()] = move(ptr);
+        }
+    }
+
+    std::vector<ptr_t> files;
+    files.reserve(loaded.size());
+    for(const auto id : dbIds) {
+        const auto it = loaded.find(id);
+        if (it != loaded.end()) {
+            files.push_back(it->second);
+        }
+    }
+
+    return files;
+}
+
+File::ptr_t File::fromQuery(QObject &parent, const QSqlQuery &query)
+{
+    enum Fields {
+        id, file_id, state, direction, identity_id, conversation_id, contact_id, hash, name, path, size, file_time, created_time, ack_time, bytes_transferred
+    };
+
     auto ptr = make_shared<File>(parent);
     ptr->id_ = query.value(id).toInt();
     ptr->data_->fileId = query.value(file_id).toByteArray();
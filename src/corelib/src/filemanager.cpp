@@ -1,10 +1,12 @@
 
+#include <map>
 #include <regex>
 #include <QDir>
 #include <QSqlQuery>
 #include <QStandardPaths>
 
 #include "include/ds/filemanager.h"
+#include "ds/statementcache.h"
 
 #include "logfault/logfault.h"
 
@@ -14,7 +16,9 @@ namespace ds {
 namespace core {
 
 FileManager::FileManager(QObject &parent, QSettings &settings)
-    : QObject{&parent}, settings_{settings}
+    : QObject{&parent}
+    , lru_cache_{settings.value("fileCacheSize", 128).toUInt()}
+    , settings_{settings}
 {
     // TODO: Load non-hashed files and start hashing them.
 }
@@ -32,15 +36,46 @@ File::ptr_t FileManager::getFile(const int dbId)
     return file;
 }
 
+std::vector<File::ptr_t> FileManager::getFiles(const std::vector<int> &dbIds)
+{
+    // Hold strong references from here on. touch() may evict from the
+    // LRU cache, and then the registry would lose the ones we already found.
+    std::map<int, File::ptr_t> found;
+    vector<int> missing;
+    for(const auto id : dbIds) {
+        if (auto file = registry_.fetch(id)) {
+            found[id] = move(file);
+        } else {
+            missing.push_back(id);
+        }
+    }
+
+    for(auto& file : File::load(*this, missing)) {
+        registry_.add(file->getId(), file);
+        found[file->getId()] = move(file);
+    }
+
+    std::vector<File::ptr_t> files;
+    files.reserve(dbIds.size());
+    for(const auto id : dbIds) {
+        const auto it = found.find(id);
+        if (it != found.end()) {
+            touch(it->second);
+            files.push_back(it->second);
+        }
+    }
+
+    return files;
+}
+
 File::ptr_t FileManager::getFile(const QByteArray &hash, Conversation &conversation)
 {
-    QSqlQuery query;
-    query.prepare("SELECT id FROM file WHERE hash=:hash AND conversation_id=:cid");
-    query.bindValue(":hash", hash);
-    query.bindValue(":cid", conversation.getId());
-    query.exec();
-    if (query.next()) {
-        return getFile(query.value(0).toInt());
+    auto query = StatementCache::instance().get("SELECT id FROM file WHERE hash=:hash AND conversation_id=:cid");
+    query->bindValue(":hash", hash);
+    query->bindValue(":cid", conversation.getId());
+    query->exec();
+    if (query->next()) {
+        return getFile(query->value(0).toInt());
     }
 
     return {};
@@ -48,14 +83,13 @@ File::ptr_t FileManager::getFile(const QByteArray &hash, Conversation &conversat
 
 File::ptr_t FileManager::getFileFromId(const QByteArray &fileId, Conversation &conversation)
 {
-    QSqlQuery query;
-    query.prepare("SELECT id FROM file WHERE file_id=:fid AND conversation_id=:cid");
-    query.bindValue(":fid", fileId);
-    query.bindValue(":cid", conversation.getId());
-    query.exec();
-
-    if (query.next()) {
-        return getFile(query.value(0).toInt());
+    auto query = StatementCache::instance().get("SELECT id FROM file WHERE file_id=:fid AND conversation_id=:cid");
+    query->bindValue(":fid", fileId);
+    query->bindValue(":cid", conversation.getId());
+    query->exec();
+
+    if (query->next()) {
+        return getFile(query->value(0).toInt());
     }
 
     return {};
@@ -63,14 +97,13 @@ File::ptr_t FileManager::getFileFromId(const QByteArray &fileId, Conversation &c
 
 File::ptr_t FileManager::getFileFromId(const QByteArray &fileId, const File::Direction direction)
 {
-    QSqlQuery query;
-    query.prepare("SELECT id FROM file WHERE file_id=:fid AND direction=:direction");
-    query.bindValue(":fid", fileId);
-    query.bindValue(":direction", static_cast<int>(direction));
-    query.exec();
-
-    if (query.next()) {
-        return getFile(query.value(0).toInt());
+    auto query = StatementCache::instance().get("SELECT id FROM file WHERE file_id=:fid AND direction=:direction");
+    query->bindValue(":fid", fileId);
+    query->bindValue(":direction", static_cast<int>(direction));
+    query->exec();
+
+    if (query->next()) {
+        return getFile(query->value(0).toInt());
     }
 
     return {};
@@ -78,14 +111,13 @@ File::ptr_t FileManager::getFileFromId(const QByteArray &fileId, const File::Dir
 
 File::ptr_t FileManager::getFileFromId(const QByteArray &fileId, const Contact &contact)
 {
-    QSqlQuery query;
-    query.prepare("SELECT id FROM file WHERE file_id=:fid AND contact_id=:cid");
-    query.bindValue(":fid", fileId);
-    query.bindValue(":cid", contact.getId());
-    query.exec();
-
-    if (query.next()) {
-        return getFile(query.value(0).toInt());
+    auto query = StatementCache::instance().get("SELECT id FROM file WHERE file_id=:fid AND contact_id=:cid");
+    query->bindValue(":fid", fileId);
+    query->bindValue(":cid", contact.getId());
+    query->exec();
+
+    if (query->next()) {
+        return getFile(query->value(0).toInt());
     }
 
     return {};
@@ -187,6 +187,8 @@ void Identity::onAddmeRequest(const PeerAddmeReq &req)
 
 void Identity::onProcessOnlineLater()
 {
+    // Dialing a contact only depends on the contact's descriptor, not ours.
+    // DsClient holds back retries while Tor can't find it.
     connectContacts();
 }
 
@@ -226,7 +228,7 @@ void Identity::connectContacts()
                       && ((contact->getState() == Contact::WAITING_FOR_ACCEPTANCE)
                        || (contact->getState() == Contact::ACCEPTED)
                        || (contact->getState() == Contact::PENDING))) {
-                    contact->connectToContact();
+                    contact->autoConnectToContact();
                 }
             }
         });
@@ -372,6 +374,22 @@ void Identity::unregisterConnection(const QUuid &uuid)
                 << " active connections ";
 }
 
+void Identity::registerAvoidedHandshake()
+{
+    ++redundantHandshakesAvoided_;
+
+    LFLOG_DEBUG << "Identity " << getName()
+                << " has avoided " << redundantHandshakesAvoided_
+                << " redundant handshakes.";
+
+    emit redundantHandshakesAvoidedChanged();
+}
+
+int Identity::getRedundantHandshakesAvoided() const noexcept
+{
+    return redundantHandshakesAvoided_;
+}
+
 int Identity::getId() const noexcept {
     return id_;
 }
@@ -464,6 +482,22 @@ void Identity::setOnline(const bool value) {
     }
 }
 
+bool Identity::isPublished() const noexcept
+{
+    return published_;
+}
+
+void Identity::setPublished(const bool value)
+{
+    if (value != published_) {
+        published_ = value;
+        emit publishedChanged();
+
+        LFLOG_DEBUG << "The service for Identity " << getName()
+                    << (published_ ? " is published." : " is no longer published.");
+    }
+}
+
 QUuid Identity::getUuid() const noexcept {
     return data_.uuid;
 }
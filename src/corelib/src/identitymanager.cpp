@@ -134,11 +134,23 @@ void IdentityManager::createIdentity(const QmlIdentityReq *req)
     id.cert = DsCert::create();
     id.hash = id.cert->getHash().toByteArray();
 
-    addIdentity(id);
+    if (!addIdentity(id)) {
+        return;
+    }
 
     auto name = id.name;
     auto uuid = id.uuid;
 
+    // Use a pre-created handle if we have one, so we don't have to wait for Tor.
+    try {
+        if (DsEngine::instance().getTransportPool()->assign(name, uuid)) {
+            return;
+        }
+    } catch (const std::exception& ex) {
+        LFLOG_WARN << "Failed to use the transport pool for " << name
+                   << ": " << ex.what();
+    }
+
     DsEngine::instance().whenOnline([this, name, uuid]() { tryMakeTransport(name, uuid); });
 }
 
@@ -1,4 +1,7 @@
 
+#include <algorithm>
+#include <map>
+
 #include <QTime>
 
 #include "ds/crypto.h"
@@ -93,16 +96,15 @@ void Message::setState(Message::State state)
 
 Conversation *Message::getConversation() const
 {
-    QSqlQuery query;
-    query.prepare("SELECT uuid FROM conversation WHERE id=:id");
-    query.bindValue(":id", getConversationId());
-    if(!query.exec()) {
+    auto query = StatementCache::instance().get("SELECT uuid FROM conversation WHERE id=:id");
+    query->bindValue(":id", getConversationId());
+    if(!query->exec()) {
         throw Error(QStringLiteral("Failed to fetch conversation from id: %1").arg(
-                        query.lastError().text()));
+                        query->lastError().text()));
     }
 
-    if (query.next()) {
-        return DsEngine::instance().getConversationManager()->getConversation(query.value(0).toUuid()).get();
+    if (query->next()) {
+        return DsEngine::instance().getConversationManager()->getConversation(query->value(0).toUuid()).get();
     }
 
     return {};
@@ -144,35 +146,34 @@ bool Message::validate(const DsCert &cert) const
 
 void Message::addToDb()
 {
-    QSqlQuery query;
-
-    query.prepare("INSERT INTO message ("
-                  "direction, state, conversation_id, conversation, message_id, composed_time, received_time, content, signature, sender, encoding"
-                  ") VALUES ("
-                  ":direction, :state, :conversation_id, :conversation, :message_id, :composed_time, :received_time, :content, :signature, :sender, :encoding"
-                  ")");
+    auto query = StatementCache::instance().get(
+                "INSERT INTO message ("
+                "direction, state, conversation_id, conversation, message_id, composed_time, received_time, content, signature, sender, encoding"
+                ") VALUES ("
+                ":direction, :state, :conversation_id, :conversation, :message_id, :composed_time, :received_time, :content, :signature, :sender, :encoding"
+                ")");
     assert(data_);
     assert(data_->composedTime.isValid());
 
-    query.bindValue(":direction", static_cast<int>(direction_));
-    query.bindValue(":state", static_cast<int>(state_));
-    query.bindValue(":conversation_id", conversationId_);
-    query.bindValue(":conversation", data_->conversation);
-    query.bindValue(":message_id", data_->messageId);
-    query.bindValue(":composed_time", data_->composedTime);
-    query.bindValue(":received_time", sentReceivedTime_);
-    query.bindValue(":content", data_->content);
-    query.bindValue(":signature", data_->signature);
-    query.bindValue(":sender", data_->sender);
-    query.bindValue(":encoding", data_->encoding);
+    query->bindValue(":direction", static_cast<int>(direction_));
+    query->bindValue(":state", static_cast<int>(state_));
+    query->bindValue(":conversation_id", conversationId_);
+    query->bindValue(":conversation", data_->conversation);
+    query->bindValue(":message_id", data_->messageId);
+    query->bindValue(":composed_time", data_->composedTime);
+    query->bindValue(":received_time", sentReceivedTime_);
+    query->bindValue(":content", data_->content);
+    query->bindValue(":signature", data_->signature);
+    query->bindValue(":sender", data_->sender);
+    query->bindValue(":encoding", data_->encoding);
 
 
-    if(!query.exec()) {
+    if(!query->exec()) {
         throw Error(QStringLiteral("Failed to add Message: %1").arg(
-                        query.lastError().text()));
+                        query->lastError().text()));
     }
 
-    id_ = query.lastInsertId().toInt();
+    id_ = query->lastInsertId().toInt();
 
     LFLOG_INFO << "Added message " << data_->messageId.toHex()
                << " to the database with id " << id_;
@@ -193,28 +194,69 @@ void Message::deleteFromDb()
 
 Message::ptr_t Message::load(QObject &parent, int dbId)
 {
-    QSqlQuery query;
-
-    enum Fields {
-        direction, state,  conversation_id, conversation, message_id, composed_time, received_time, content, signature, sender, encoding
-    };
-
-    query.prepare("SELECT direction, state, conversation_id, conversation, message_id, composed_time, received_time, content, signature, sender, encoding FROM message where id=:id ");
-    query.bindValue(":id", dbId);
+    auto query = StatementCache::instance().get("SELECT id, direction, state, conversation_id, conversation, message_id, composed_time, received_time, content, signature, sender, encoding FROM message where id=:id ");
+    query->bindValue(":id", dbId);
 
-    if(!query.exec()) {
+    if(!query->exec()) {
         throw Error(QStringLiteral("Failed to fetch Message: %1").arg(
-                        query.lastError().text()));
+                        query->lastError().text()));
     }
 
-    if (!query.next()) {
+    if (!query->next()) {
         throw NotFoundError(QStringLiteral("Message not found!"));
     }
 
+    return fromQuery(parent, *query);
+}
+
+std::vector<Message::ptr_t> Message::load(QObject &parent, const std::vector<int> &dbIds)
+{
+    map<int, ptr_t> loaded;
+
+    for(size_t first = 0; first < dbIds.size(); first += max_in_list) {
+        const auto count = min(max_in_list, dbIds.size() - first);
+
+        // Not cached. There could be one statement for each count.
+        QSqlQuery query;
+        query.prepare(QStringLiteral("SELECT id, direction, state, conversation_id, conversation, message_id, composed_time, received_time, content, signature, sender, encoding FROM message where id IN (%1)")
+                      .arg(placeholders(count)));
+        for(size_t i = first; i < first + count; ++i) {
+            query.addBindValue(dbIds[i]);
+        }
+
+        if(!query.exec()) {
+            throw Error(QStringLiteral("Failed to fetch Messages: %1").arg(
+                            query.lastError().text()));
+        }
+
+        while(query.next()) {
+            auto ptr = fromQuery(parent, query);
+            loaded[ptr->getId()] = move(ptr);
+        }
+    }
+
+    std::vector<ptr_t> messages;
+    messages.reserve(loaded.size());
+    for(const auto id : dbIds) {
+        const auto it = loaded.find(id);
+        if (it != loaded.end()) {
+            messages.push_back(it->second);
+        }
+    }
+
+    return messages;
+}
+
+Message::ptr_t Message::fromQuery(QObject &parent, const QSqlQuery &query)
+{
+    enum Fields {
+        id, direction, state,  conversation_id, conversation, message_id, composed_time, received_time, content, signature, sender, encoding
+    };
+
     auto ptr = make_shared<Message>(parent);
     ptr->data_ = make_unique<MessageData>();
 
-    ptr->id_ = dbId;
+    ptr->id_ = query.value(id).toInt();
     ptr->direction_ = static_cast<Direction>(query.value(direction).toInt());
     ptr->state_ = static_cast<State>(query.value(state).toInt());
     ptr->conversationId_ = query.value(conversation_id).toInt();
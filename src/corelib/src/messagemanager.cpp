@@ -1,6 +1,13 @@
+#include <map>
+
 #include "ds/messagemanager.h"
 #include "ds/dsengine.h"
 #include "ds/database.h"
+#include "ds/statementcache.h"
+
+#include <QRegExp>
+#include <QSqlError>
+#include <QSqlQuery>
 
 #include "logfault/logfault.h"
 
@@ -11,6 +18,13 @@ using namespace std;
 
 MessageManager::MessageManager(QObject &parent)
 : QObject{&parent}
+, lru_cache_{DsEngine::instance().settings().value("messageCacheSize", 256).toUInt(),
+             DsEngine::instance().settings().value("messageCacheBytes", 4 * 1024 * 1024).toUInt(),
+             [](const Message::ptr_t& message) {
+                 // Most of a message is the content
+                 return sizeof(Message) + sizeof(MessageData)
+                        + static_cast<size_t>(message->getContent().size()) * sizeof(QChar);
+             }}
 {
 }
 
@@ -27,20 +41,51 @@ Message::ptr_t MessageManager::getMessage(int dbId)
     return message;
 }
 
+std::vector<Message::ptr_t> MessageManager::getMessages(const std::vector<int> &dbIds)
+{
+    // Hold strong references from here on. touch() may evict from the
+    // LRU cache, and then the registry would lose the ones we already found.
+    std::map<int, Message::ptr_t> found;
+    vector<int> missing;
+    for(const auto id : dbIds) {
+        if (auto message = registry_.fetch(id)) {
+            found[id] = move(message);
+        } else {
+            missing.push_back(id);
+        }
+    }
+
+    for(auto& message : Message::load(*this, missing)) {
+        registry_.add(message->getId(), message);
+        found[message->getId()] = move(message);
+    }
+
+    std::vector<Message::ptr_t> messages;
+    messages.reserve(dbIds.size());
+    for(const auto id : dbIds) {
+        const auto it = found.find(id);
+        if (it != found.end()) {
+            touch(it->second);
+            messages.push_back(it->second);
+        }
+    }
+
+    return messages;
+}
+
 Message::ptr_t MessageManager::getMessage(const QByteArray &messageId,
                                           const int conversationId)
 {
-    QSqlQuery query;
-    query.prepare("SELECT id FROM message WHERE conversation_id=:cid and message_id=:mid");
-    query.bindValue(":cid", conversationId);
-    query.bindValue(":mid", messageId);
-    if(!query.exec()) {
+    auto query = StatementCache::instance().get("SELECT id FROM message WHERE conversation_id=:cid and message_id=:mid");
+    query->bindValue(":cid", conversationId);
+    query->bindValue(":mid", messageId);
+    if(!query->exec()) {
         throw Error(QStringLiteral("Failed to fetch Message from hash: %1").arg(
-                        query.lastError().text()));
+                        query->lastError().text()));
     }
 
-    if (query.next()) {
-        return getMessage(query.value(0).toInt());
+    if (query->next()) {
+        return getMessage(query->value(0).toInt());
     }
 
     return {};
@@ -48,17 +93,16 @@ Message::ptr_t MessageManager::getMessage(const QByteArray &messageId,
 
 Message::ptr_t MessageManager::getMessage(const QByteArray &messageId, const Message::Direction direction)
 {
-    QSqlQuery query;
-    query.prepare("SELECT id FROM message WHERE message_id=:mid and direction=:direction");
-    query.bindValue(":mid", messageId);
-    query.bindValue(":direction", static_cast<int>(direction));
-    if(!query.exec()) {
+    auto query = StatementCache::instance().get("SELECT id FROM message WHERE message_id=:mid and direction=:direction");
+    query->bindValue(":mid", messageId);
+    query->bindValue(":direction", static_cast<int>(direction));
+    if(!query->exec()) {
         throw Error(QStringLiteral("Failed to fetch Message from hash: %1").arg(
-                        query.lastError().text()));
+                        query->lastError().text()));
     }
 
-    if (query.next()) {
-        return getMessage(query.value(0).toInt());
+    if (query->next()) {
+        return getMessage(query->value(0).toInt());
     }
 
     return {};
@@ -118,6 +162,83 @@ void MessageManager::touch(const Message::ptr_t &message)
     lru_cache_.touch(message);
 }
 
+void MessageManager::search(const QString &text, const int identityId,
+                            const int conversationId, const int limit,
+                            QObject *context, MessageManager::search_cb_t done,
+                            DbExecutor::failed_t failed)
+{
+    const auto match = toMatchExpression(text);
+    if (match.isEmpty() || !identityId) {
+        done({});
+        return;
+    }
+
+    DsEngine::instance().getDbExecutor().query([match, identityId, conversationId, limit](QSqlDatabase& db) {
+        // The ranking is done by the index. The snippet is only made for the hits we return.
+        QSqlQuery query(db);
+        query.prepare(QStringLiteral(
+            "SELECT m.id, m.conversation_id, c.name, m.composed_time, "
+            "snippet(message_fts, 0, char(1), char(2), '...', 12), message_fts.rank "
+            "FROM message_fts JOIN message AS m ON m.id = message_fts.rowid "
+            "JOIN conversation AS c ON c.id = m.conversation_id "
+            "WHERE message_fts MATCH :match AND c.identity = :identity %1 "
+            "ORDER BY message_fts.rank LIMIT :limit")
+                      .arg(conversationId ? "AND m.conversation_id = :cid" : ""));
+        query.bindValue(":match", match);
+        query.bindValue(":identity", identityId);
+        query.bindValue(":limit", limit);
+        if (conversationId) {
+            query.bindValue(":cid", conversationId);
+        }
+
+        if(!query.exec()) {
+            throw Error(QStringLiteral("Search failed: %1").arg(
+                            query.lastError().text()));
+        }
+
+        enum Fields { id, conversation_id, name, composed_time, snippet, rank };
+
+        std::vector<SearchHit> hits;
+        while(query.next()) {
+            SearchHit hit;
+            hit.messageId = query.value(id).toInt();
+            hit.conversationId = query.value(conversation_id).toInt();
+            hit.conversationName = query.value(name).toString();
+            hit.composedTime = query.value(composed_time).toDateTime();
+
+            // The content is from the peer. Escape it before we add our markup.
+            // The markers are removed from the indexed content, so they are ours.
+            hit.snippet = query.value(snippet).toString().toHtmlEscaped()
+                    .replace(QChar(1), "<b>").replace(QChar(2), "</b>");
+            hit.rank = query.value(rank).toDouble();
+            hits.push_back(move(hit));
+        }
+
+        return hits;
+    }, context, move(done), move(failed));
+}
+
+QString MessageManager::toMatchExpression(const QString &text)
+{
+    // Each word is a quoted string, so the user can't write FTS5 syntax by accident
+    QStringList terms;
+    for(auto word : text.split(QRegExp("\\s+"), QString::SkipEmptyParts)) {
+        const bool prefix = word.endsWith('*');
+        word.remove('*');
+        if (word.isEmpty()) {
+            continue;
+        }
+
+        auto term = QStringLiteral("\"%1\"").arg(word.replace('"', "\"\""));
+        if (prefix) {
+            term += '*';
+        }
+        terms << term;
+    }
+
+    return terms.join(' ');
+}
+
 void MessageManager::onMessageReceivedDateChanged(const Message::ptr_t &message)
 {
     touch(message);
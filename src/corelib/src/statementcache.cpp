@@ -0,0 +1,111 @@
+
+#include <cassert>
+
+#include <QSqlError>
+
+#include "ds/statementcache.h"
+#include "ds/errors.h"
+
+#include "logfault/logfault.h"
+
+namespace ds {
+namespace core {
+
+using namespace std;
+
+StatementCache *StatementCache::instance_;
+
+StatementCache::Query::Query(std::shared_ptr<StatementCache::Entry> entry)
+    : entry_{move(entry)}, query_{&entry_->query}
+{
+    entry_->inUse = true;
+}
+
+StatementCache::Query::Query(std::unique_ptr<QSqlQuery> uncached)
+    : uncached_{move(uncached)}, query_{uncached_.get()}
+{
+}
+
+StatementCache::Query::~Query()
+{
+    if (entry_) {
+        // Release the locks held by an unfinished SELECT
+        entry_->query.finish();
+        entry_->inUse = false;
+    }
+}
+
+StatementCache::StatementCache(QSqlDatabase &db, const int maxEntries)
+    : db_{db}, maxEntries_{maxEntries}
+{
+    assert(!instance_);
+    instance_ = this;
+}
+
+StatementCache::~StatementCache()
+{
+    LFLOG_DEBUG << "Statement cache: " << stats_.hits << " hits, "
+                << stats_.misses << " misses, "
+                << entries_.size() << " statements.";
+
+    clear();
+    assert(instance_ == this);
+    instance_ = {};
+}
+
+StatementCache::Query StatementCache::get(const QString &sql)
+{
+    const auto it = entries_.find(sql);
+    if (it != entries_.end()) {
+        if (!it.value()->inUse) {
+            ++stats_.hits;
+            return {it.value()};
+        }
+    } else if (entries_.size() < maxEntries_) {
+        ++stats_.misses;
+        auto entry = make_shared<Entry>(db_);
+        if (!entry->query.prepare(sql)) {
+            throw Error(QStringLiteral("Failed to prepare SQL statement: %1").arg(
+                            entry->query.lastError().text()));
+        }
+        entries_.insert(sql, entry);
+        return {move(entry)};
+    }
+
+    ++stats_.misses;
+    return {prepare(sql)};
+}
+
+void StatementCache::clear()
+{
+    entries_.clear();
+}
+
+StatementCache &StatementCache::instance()
+{
+    assert(instance_);
+    return *instance_;
+}
+
+std::unique_ptr<QSqlQuery> StatementCache::prepare(const QString &sql)
+{
+    auto query = make_unique<QSqlQuery>(db_);
+    if (!query->prepare(sql)) {
+        throw Error(QStringLiteral("Failed to prepare SQL statement: %1").arg(
+                        query->lastError().text()));
+    }
+
+    return query;
+}
+
+QString placeholders(const size_t count)
+{
+    QString list;
+    list.reserve(static_cast<int>(count * 2));
+    for(size_t i = 0; i < count; ++i) {
+        list += (i ? ",?" : "?");
+    }
+    return list;
+}
+
+}} // namespaces
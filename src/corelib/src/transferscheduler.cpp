@@ -0,0 +1,256 @@
+
+#include <cassert>
+#include <tuple>
+
+#include <QDateTime>
+#include <QTimer>
+
+#include "ds/transferscheduler.h"
+#include "ds/dsengine.h"
+
+#include "logfault/logfault.h"
+
+namespace ds {
+namespace core {
+
+using namespace std;
+
+TransferScheduler::TransferScheduler(DsEngine& engine, QSettings& settings)
+    : QObject{&engine}, engine_{engine}, settings_{settings}
+{
+    connect(engine_.getFileManager(), &FileManager::fileStateChanged,
+            this, &TransferScheduler::onFileStateChanged);
+}
+
+bool TransferScheduler::admit(const File::ptr_t &file)
+{
+    assert(file->getState() == File::FS_QUEUED);
+    assert(file->getDirection() == File::OUTGOING);
+
+    const auto id = file->getId();
+    if (active_.find(id) != active_.end()) {
+        return true;
+    }
+
+    if (find_if(queue_.begin(), queue_.end(), [id](const Queued& q) {
+            return q.file->getId() == id;
+        }) == queue_.end()) {
+        queue_.push_back({file, ++seq_, QDateTime::currentMSecsSinceEpoch()});
+    }
+
+    // Start what we can. The caller starts its own file.
+    bool admitted = false;
+    for(const auto& ready : activate()) {
+        if (ready == file) {
+            admitted = true;
+        } else {
+            start(ready);
+        }
+    }
+
+    if (!admitted) {
+        LFLOG_DEBUG << "File #" << id << " is waiting for a transfer slot. "
+                    << active_.size() << " transfers are active and "
+                    << queue_.size() << " are queued.";
+    }
+
+    updatePositions();
+    return admitted;
+}
+
+void TransferScheduler::reportDiskIo(const qint64 usecs)
+{
+    const bool wasBusy = isDiskBusy();
+
+    // Smooth out single slow calls
+    diskStall_ += (static_cast<double>(usecs) - diskStall_) / 8.0;
+    lastDiskIo_ = QDateTime::currentMSecsSinceEpoch();
+
+    if (wasBusy && !isDiskBusy() && !queue_.empty()) {
+        LFLOG_DEBUG << "The disk is keeping up again. Average I/O stall is "
+                    << static_cast<qint64>(diskStall_) << " us.";
+        QTimer::singleShot(0, this, &TransferScheduler::schedule);
+    }
+}
+
+void TransferScheduler::releaseContact(const int contactId)
+{
+    for(auto it = active_.begin(); it != active_.end();) {
+        if (it->second.contact == contactId) {
+            it = active_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    for(auto it = queue_.begin(); it != queue_.end();) {
+        if (it->file->getContactId() == contactId) {
+            it->file->setQueuePosition(0);
+            it = queue_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    // The contacts own events are still being processed
+    QTimer::singleShot(0, this, &TransferScheduler::schedule);
+}
+
+void TransferScheduler::onFileStateChanged(const File *file)
+{
+    const auto state = file->getState();
+    if ((state == File::FS_QUEUED) || (state == File::FS_TRANSFERRING)) {
+        return;
+    }
+
+    const auto id = file->getId();
+    const auto it = find_if(queue_.begin(), queue_.end(), [id](const Queued& q) {
+        return q.file->getId() == id;
+    });
+
+    if (it != queue_.end()) {
+        it->file->setQueuePosition(0);
+        queue_.erase(it);
+        updatePositions();
+    }
+
+    if (active_.erase(id)) {
+        // We are called from the code that changed the state
+        QTimer::singleShot(0, this, &TransferScheduler::schedule);
+    }
+}
+
+std::vector<File::ptr_t> TransferScheduler::activate()
+{
+    std::vector<File::ptr_t> ready;
+
+    const auto max_transfers = settings_.value("maxTransfers", 8).toInt();
+
+    while(static_cast<int>(active_.size()) < max_transfers) {
+        sortQueue();
+
+        const auto it = find_if(queue_.begin(), queue_.end(), [this](const Queued& q) {
+            return canStart(*q.file);
+        });
+
+        if (it == queue_.end()) {
+            break;
+        }
+
+        auto file = move(it->file);
+        queue_.erase(it);
+
+        active_[file->getId()] = {file->getContactId(), file->getIdentityId(), isLarge(*file)};
+        lastServed_[file->getIdentityId()] = ++seq_;
+        file->setQueuePosition(0);
+        ready.push_back(move(file));
+    }
+
+    // We get no new measurements if the active transfers go quiet
+    if (!queue_.empty() && isDiskBusy() && !diskRetryPending_) {
+        diskRetryPending_ = true;
+        QTimer::singleShot(1000, this, [this] {
+            diskRetryPending_ = false;
+            schedule();
+        });
+    }
+
+    return ready;
+}
+
+void TransferScheduler::schedule()
+{
+    for(const auto& file : activate()) {
+        start(file);
+    }
+
+    updatePositions();
+}
+
+void TransferScheduler::start(const File::ptr_t &file)
+{
+    auto contact = file->getContact();
+    if (!contact || !contact->isOnline()) {
+        // It will be queued again when the contact comes online
+        active_.erase(file->getId());
+        return;
+    }
+
+    LFLOG_DEBUG << "File #" << file->getId() << " got a transfer slot.";
+    contact->startAdmittedTransfer(file);
+}
+
+bool TransferScheduler::canStart(const File &file) const
+{
+    if (countFor(&Active::contact, file.getContactId())
+            >= settings_.value("maxTransfersPerContact", 2).toInt()) {
+        return false;
+    }
+
+    if (isLarge(file)
+            && (countFor(&Active::large, true)
+                >= settings_.value("maxLargeTransfers", 2).toInt())) {
+        return false;
+    }
+
+    // Don't add another large stream to a disk that can't keep up.
+    // With no active transfers, the measurement is from the past.
+    if (isLarge(file) && !active_.empty() && isDiskBusy()) {
+        return false;
+    }
+
+    return true;
+}
+
+bool TransferScheduler::isDiskBusy() const
+{
+    // Old measurements don't tell us anything about the disk now
+    if ((QDateTime::currentMSecsSinceEpoch() - lastDiskIo_) > 2000) {
+        return false;
+    }
+
+    return diskStall_ > (settings_.value("transferDiskStallMs", 20).toDouble() * 1000.0);
+}
+
+bool TransferScheduler::isLarge(const File &file) const
+{
+    return file.getSize() >= settings_.value("largeTransferSize",
+                                             1024LL * 1024 * 64).toLongLong();
+}
+
+void TransferScheduler::sortQueue()
+{
+    // Identities with fewer active transfers first, then the identity
+    // that waited longest for a slot, then files that waited too long,
+    // then small files, then arrival.
+    const auto max_wait = settings_.value("transferMaxWaitSecs", 300).toLongLong() * 1000;
+    const auto now = QDateTime::currentMSecsSinceEpoch();
+    const auto key = [this, max_wait, now](const Queued& q) {
+        const auto identity = q.file->getIdentityId();
+        const auto served = lastServed_.find(identity);
+        const bool starving = (now - q.queued) >= max_wait;
+        return make_tuple(countFor(&Active::identity, identity),
+                          served == lastServed_.end() ? quint64{} : served->second,
+                          !starving,
+                          starving ? qint64{} : q.file->getSize(),
+                          q.seq);
+    };
+
+    stable_sort(queue_.begin(), queue_.end(), [&key](const Queued& left, const Queued& right) {
+        return key(left) < key(right);
+    });
+}
+
+void TransferScheduler::updatePositions()
+{
+    sortQueue();
+
+    int position = 0;
+    for(auto& q : queue_) {
+        q.file->setQueuePosition(++position);
+    }
+
+    emit queueChanged();
+}
+
+}} // namespaces
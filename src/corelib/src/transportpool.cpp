@@ -0,0 +1,220 @@
+
+#include <sodium.h>
+
+#include <QSqlQuery>
+#include <QSqlError>
+
+#include "ds/transportpool.h"
+#include "ds/dsengine.h"
+#include "ds/crypto.h"
+#include "ds/errors.h"
+
+#include "logfault/logfault.h"
+
+namespace ds {
+namespace core {
+
+using namespace std;
+
+TransportPool::TransportPool(DsEngine& engine, QSettings& settings)
+    : QObject{&engine}, engine_{engine}, settings_{settings}
+{
+    idleTimer_.setSingleShot(true);
+    connect(&idleTimer_, &QTimer::timeout, this, &TransportPool::refill);
+}
+
+bool TransportPool::assign(const QString &identityName, const QUuid &uuid)
+{
+    QSqlQuery query;
+    query.prepare("SELECT id, data FROM transport_pool ORDER BY id LIMIT 1");
+    if(!query.exec()) {
+        throw Error(QStringLiteral("Failed to query transport pool: %1").arg(
+                        query.lastError().text()));
+    }
+
+    if (!query.next()) {
+        LFLOG_DEBUG << "The transport pool is empty.";
+        return false;
+    }
+
+    const auto id = query.value(0).toInt();
+    QByteArray json;
+    const bool decrypted = decrypt(query.value(1).toByteArray(), json);
+
+    // The handle is used (or useless) from now on.
+    QSqlQuery del;
+    del.prepare("DELETE FROM transport_pool WHERE id=:id");
+    del.bindValue(":id", id);
+    if(!del.exec()) {
+        throw Error(QStringLiteral("Failed to delete from transport pool: %1").arg(
+                        del.lastError().text()));
+    }
+
+    scheduleRefill();
+
+    if (!decrypted) {
+        LFLOG_WARN << "Failed to decrypt transport handle #" << id
+                   << " from the pool. Discarding it.";
+        return false;
+    }
+
+    const auto map = DsEngine::fromJson(json);
+
+    TransportHandle th;
+    th.identityName = identityName;
+    th.uuid = uuid;
+    th.handle = map.value("handle").toByteArray();
+    th.data = map.value("data").toMap();
+
+    LFLOG_NOTICE << "Assigning pre-created transport handle " << th.handle
+                 << " to identity " << identityName;
+
+    emit transportHandleReady(th);
+    return true;
+}
+
+bool TransportPool::add(const TransportHandle &th)
+{
+    if (pending_.isNull() || (th.uuid != pending_)) {
+        return false;
+    }
+
+    pending_ = {};
+
+    QVariantMap map;
+    map.insert("handle", th.handle);
+    map.insert("data", th.data);
+
+    QSqlQuery query;
+    query.prepare("INSERT INTO transport_pool (created, data) VALUES (:created, :data)");
+    query.bindValue(":created", DsEngine::getSafeNow());
+    query.bindValue(":data", encrypt(DsEngine::toJson(map)));
+    if(!query.exec()) {
+        throw Error(QStringLiteral("Failed to add to transport pool: %1").arg(
+                        query.lastError().text()));
+    }
+
+    LFLOG_DEBUG << "Added transport handle " << th.handle
+                << " to the pool. The pool now has " << count() << " handles.";
+
+    scheduleRefill();
+    return true;
+}
+
+bool TransportPool::onError(const TransportHandleError &the)
+{
+    if (pending_.isNull() || (the.uuid != pending_)) {
+        return false;
+    }
+
+    LFLOG_DEBUG << "Failed to create transport handle for the pool: "
+                << the.explanation;
+
+    pending_ = {};
+    scheduleRefill();
+    return true;
+}
+
+int TransportPool::count() const
+{
+    QSqlQuery query;
+    query.prepare("SELECT COUNT(*) FROM transport_pool");
+    if(!query.exec()) {
+        throw Error(QStringLiteral("Failed to query transport pool: %1").arg(
+                        query.lastError().text()));
+    }
+
+    query.next();
+    return query.value(0).toInt();
+}
+
+int TransportPool::getSize() const
+{
+    return settings_.value("transportPoolSize", 2).toInt();
+}
+
+void TransportPool::scheduleRefill()
+{
+    // Any activity postpones the refill
+    idleTimer_.start(settings_.value("transportPoolIdleDelay", 15000).toInt());
+}
+
+void TransportPool::refill()
+{
+    if (!pending_.isNull() || !engine_.isOnline()) {
+        return;
+    }
+
+    if (count() >= getSize()) {
+        return;
+    }
+
+    pending_ = QUuid::createUuid();
+
+    LFLOG_DEBUG << "Requesting a new transport handle for the pool.";
+
+    try {
+        engine_.getProtocolMgr(ProtocolManager::Transport::TOR)
+                .createTransportHandle({"pool", pending_});
+    } catch (const std::exception& ex) {
+        LFLOG_DEBUG << "Failed to request transport handle for the pool: "
+                    << ex.what();
+        pending_ = {};
+        scheduleRefill();
+    }
+}
+
+QByteArray TransportPool::getKey()
+{
+    auto key = QByteArray::fromBase64(settings_.value("transportPoolKey").toByteArray());
+    if (key.size() != crypto_secretbox_KEYBYTES) {
+        key = crypto::Crypto::getRandomBytes(crypto_secretbox_KEYBYTES);
+        settings_.setValue("transportPoolKey", key.toBase64());
+
+        // Handles encrypted with a previous key are useless
+        QSqlQuery query;
+        if (!query.exec("DELETE FROM transport_pool")) {
+            throw Error(QStringLiteral("Failed to clear transport pool: %1").arg(
+                            query.lastError().text()));
+        }
+    }
+
+    return key;
+}
+
+QByteArray TransportPool::encrypt(const QByteArray &data)
+{
+    const auto key = getKey();
+
+    // [nonce | ciphertext]
+    auto buffer = crypto::Crypto::getRandomBytes(crypto_secretbox_NONCEBYTES);
+    buffer.resize(crypto_secretbox_NONCEBYTES + crypto_secretbox_MACBYTES + data.size());
+
+    auto nonce = reinterpret_cast<unsigned char *>(buffer.data());
+    crypto_secretbox_easy(nonce + crypto_secretbox_NONCEBYTES,
+                          reinterpret_cast<const unsigned char *>(data.constData()),
+                          static_cast<unsigned long long>(data.size()),
+                          nonce,
+                          reinterpret_cast<const unsigned char *>(key.constData()));
+    return buffer;
+}
+
+bool TransportPool::decrypt(const QByteArray &data, QByteArray &plaintext)
+{
+    if (data.size() < static_cast<int>(crypto_secretbox_NONCEBYTES + crypto_secretbox_MACBYTES)) {
+        return false;
+    }
+
+    const auto key = getKey();
+    auto nonce = reinterpret_cast<const unsigned char *>(data.constData());
+    const auto clen = data.size() - crypto_secretbox_NONCEBYTES;
+
+    plaintext.resize(static_cast<int>(clen - crypto_secretbox_MACBYTES));
+    return crypto_secretbox_open_easy(reinterpret_cast<unsigned char *>(plaintext.data()),
+                                      nonce + crypto_secretbox_NONCEBYTES,
+                                      static_cast<unsigned long long>(clen),
+                                      nonce,
+                                      reinterpret_cast<const unsigned char *>(key.constData())) == 0;
+}
+
+}} // namespaces
@@ -0,0 +1,156 @@
+
+#include <array>
+#include <cassert>
+
+#include <QSqlError>
+
+#include "ds/writebehind.h"
+#include "ds/errors.h"
+
+#include "logfault/logfault.h"
+
+namespace ds {
+namespace core {
+
+using namespace std;
+
+WriteBehind *WriteBehind::instance_;
+
+WriteBehind::WriteBehind(QSqlDatabase &db, StatementCache &statements, QSettings &settings)
+    : db_{db}, statements_{statements}
+    , delay_{settings.value("dbWriteBehindDelay", 0).toInt()}
+{
+    timer_.setSingleShot(true);
+    connect(&timer_, &QTimer::timeout, this, [this]() {
+        try {
+            flush();
+        } catch(const std::exception& ex) {
+            LFLOG_ERROR << "Failed to write pending updates to the database: " << ex.what();
+        }
+    });
+
+    assert(!instance_);
+    instance_ = this;
+}
+
+WriteBehind::~WriteBehind()
+{
+    try {
+        flush();
+    } catch(const std::exception& ex) {
+        LFLOG_ERROR << "Failed to write pending updates to the database: " << ex.what();
+    }
+
+    if (delay_ > 0) {
+        LFLOG_DEBUG << "Write-behind: " << updates_ << " updates written in "
+                    << transactions_ << " transactions.";
+    }
+
+    assert(instance_ == this);
+    instance_ = {};
+}
+
+void WriteBehind::update(const char *table, const int id, const char *column, const QVariant &value)
+{
+    key_t key{table, column, id};
+
+    if ((delay_ <= 0) || !isDeferrable(get<0>(key), get<1>(key))) {
+        if (pending_.empty()) {
+            write(key, value);
+            ++updates_;
+            ++transactions_;
+            return;
+        }
+
+        // Write it together with the pending updates
+        pending_[move(key)] = value;
+        flush();
+        return;
+    }
+
+    pending_[move(key)] = value;
+    if (!timer_.isActive()) {
+        timer_.start(delay_);
+    }
+}
+
+bool WriteBehind::isDeferrable(const QByteArray &table, const QByteArray &column)
+{
+    static const array<pair<const char *, const char *>, 5> deferrable = {{
+        {"contact", "last_seen"},
+        {"conversation", "updated"},
+        {"conversation", "unread"},
+        {"file", "bytes_transferred"},
+        {"message", "state"}
+    }};
+
+    for(const auto& d : deferrable) {
+        if ((table == d.first) && (column == d.second)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+WriteBehind &WriteBehind::instance()
+{
+    assert(instance_);
+    return *instance_;
+}
+
+void WriteBehind::flush()
+{
+    timer_.stop();
+
+    if (pending_.empty()) {
+        return;
+    }
+
+    // Take them, so a failure don't make us retry the same updates forever
+    decltype(pending_) updates;
+    updates.swap(pending_);
+
+    // If the caller has a transaction open, we are part of it
+    const bool transaction = db_.transaction();
+    try {
+        for(const auto& u : updates) {
+            write(u.first, u.second);
+        }
+    } catch(const std::exception&) {
+        if (transaction) {
+            db_.rollback();
+        }
+        throw;
+    }
+
+    if (transaction && !db_.commit()) {
+        throw Error(QStringLiteral("Failed to commit pending updates: %1").arg(
+                        db_.lastError().text()));
+    }
+
+    updates_ += updates.size();
+    ++transactions_;
+
+    LFLOG_TRACE << "Wrote " << updates.size() << " updates to the database in one transaction.";
+}
+
+void WriteBehind::write(const WriteBehind::key_t &key, const QVariant &value)
+{
+    QByteArray sql{"UPDATE "};
+    sql += get<0>(key);
+    sql += " SET ";
+    sql += get<1>(key);
+    sql += " =:value where id=:id";
+
+    // The SQL is the same for each table and column, so it's only compiled once
+    auto query = statements_.get(QString::fromLatin1(sql));
+    query->bindValue(":id", get<2>(key));
+    query->bindValue(":value", value);
+    if(!query->exec()) {
+        throw Error(QStringLiteral("SQL query failed: %1").arg(
+                        query->lastError().text()));
+    }
+}
+
+}} // namespaces
@@ -9,6 +9,9 @@ namespace crypto {
 QByteArray onion16decode(const QByteArray& src);
 QByteArray onion16encode(const QByteArray& src);
 
+// Encode the 35 bytes of a v3 onion address (key, checksum, version)
+QByteArray onion56encode(const QByteArray& src);
+
 }} // namespaces
 
 #endif // BASE32_H
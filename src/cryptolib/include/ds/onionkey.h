@@ -0,0 +1,27 @@
+#ifndef ONIONKEY_H
+#define ONIONKEY_H
+
+#include <QByteArray>
+
+namespace ds {
+namespace crypto {
+
+/*! A Tor v3 hidden service key, made without asking Tor.
+ *
+ * Tor only creates keys with ADD_ONION NEW, which also starts the
+ * service and uploads its descriptor. A key made here is not known
+ * to the Tor network until it is used with ADD_ONION.
+ */
+struct OnionKey {
+    QByteArray serviceId; // Onion address, without ".onion"
+    QByteArray keyType; // "ED25519-V3"
+    QByteArray key; // Base64 of the expanded secret key, as ADD_ONION wants it
+};
+
+OnionKey createOnionKey();
+
+QByteArray getSha3_256(const QByteArray& data);
+
+}} // namespaces
+
+#endif // ONIONKEY_H
@@ -2,6 +2,7 @@
 #include <array>
 #include <vector>
 #include <cassert>
+#include <stdexcept>
 #include <QByteArray>
 
 
@@ -95,4 +96,30 @@ QByteArray onion16encode(const QByteArray& src) {
 }
 
 
+QByteArray onion56encode(const QByteArray& src) {
+    static const char *alphabet = "abcdefghijklmnopqrstuvwxyz234567";
+
+    if (src.size() != 35) {
+        throw runtime_error("onion56encode: source size must be 35");
+    }
+
+    QByteArray dst;
+    dst.reserve(56);
+
+    // 35 bytes is 280 bits, exactly 56 characters of 5 bits
+    unsigned int buffer = 0;
+    int bits = 0;
+    for(const auto ch : src) {
+        buffer = (buffer << 8) | static_cast<uint8_t>(ch);
+        bits += 8;
+        while (bits >= 5) {
+            bits -= 5;
+            dst.append(alphabet[(buffer >> bits) & 31]);
+        }
+    }
+
+    assert(dst.size() == 56);
+    return dst;
+}
+
 }} //namespaces
@@ -0,0 +1,153 @@
+
+#include <array>
+#include <cassert>
+
+#include <sodium.h>
+
+#include "ds/onionkey.h"
+#include "ds/base32.h"
+
+namespace ds {
+namespace crypto {
+
+using namespace std;
+
+namespace {
+
+// Keccak-f[1600], as specified in FIPS 202. libsodium does not have SHA3,
+// and we only need it for the checksum in onion addresses.
+
+constexpr array<uint64_t, 24> round_constants = {
+    0x0000000000000001ULL, 0x0000000000008082ULL, 0x800000000000808aULL,
+    0x8000000080008000ULL, 0x000000000000808bULL, 0x0000000080000001ULL,
+    0x8000000080008081ULL, 0x8000000000008009ULL, 0x000000000000008aULL,
+    0x0000000000000088ULL, 0x0000000080008009ULL, 0x000000008000000aULL,
+    0x000000008000808bULL, 0x800000000000008bULL, 0x8000000000008089ULL,
+    0x8000000000008003ULL, 0x8000000000008002ULL, 0x8000000000000080ULL,
+    0x000000000000800aULL, 0x800000008000000aULL, 0x8000000080008081ULL,
+    0x8000000000008080ULL, 0x0000000080000001ULL, 0x8000000080008008ULL
+};
+
+constexpr array<int, 24> rotations = {
+    1,  3,  6,  10, 15, 21, 28, 36, 45, 55, 2,  14,
+    27, 41, 56, 8,  25, 43, 62, 18, 39, 61, 20, 44
+};
+
+constexpr array<int, 24> lanes = {
+    10, 7,  11, 17, 18, 3, 5,  16, 8,  21, 24, 4,
+    15, 23, 19, 13, 12, 2, 20, 14, 22, 9,  6,  1
+};
+
+uint64_t rotl(const uint64_t v, const int bits) {
+    return (v << bits) | (v >> (64 - bits));
+}
+
+void keccakF(array<uint64_t, 25>& st) {
+    array<uint64_t, 5> bc = {};
+
+    for(const auto rc : round_constants) {
+        // Theta
+        for(size_t i = 0; i < 5; ++i) {
+            bc[i] = st[i] ^ st[i + 5] ^ st[i + 10] ^ st[i + 15] ^ st[i + 20];
+        }
+        for(size_t i = 0; i < 5; ++i) {
+            const auto t = bc[(i + 4) % 5] ^ rotl(bc[(i + 1) % 5], 1);
+            for(size_t j = 0; j < 25; j += 5) {
+                st[j + i] ^= t;
+            }
+        }
+
+        // Rho and pi
+        auto t = st[1];
+        for(size_t i = 0; i < 24; ++i) {
+            const auto j = static_cast<size_t>(lanes[i]);
+            const auto tmp = st[j];
+            st[j] = rotl(t, rotations[i]);
+            t = tmp;
+        }
+
+        // Chi
+        for(size_t j = 0; j < 25; j += 5) {
+            for(size_t i = 0; i < 5; ++i) {
+                bc[i] = st[j + i];
+            }
+            for(size_t i = 0; i < 5; ++i) {
+                st[j + i] ^= (~bc[(i + 1) % 5]) & bc[(i + 2) % 5];
+            }
+        }
+
+        // Iota
+        st[0] ^= rc;
+    }
+}
+
+} // anonymous namespace
+
+QByteArray getSha3_256(const QByteArray &data)
+{
+    static constexpr size_t rate = 136; // 1600 - 2 * 256 bits
+    array<uint64_t, 25> st = {};
+
+    const auto absorb = [&st](const size_t offset, const uint8_t byte) {
+        st[offset / 8] ^= static_cast<uint64_t>(byte) << (8 * (offset % 8));
+    };
+
+    size_t offset = 0;
+    for(const auto ch : data) {
+        absorb(offset, static_cast<uint8_t>(ch));
+        if (++offset == rate) {
+            keccakF(st);
+            offset = 0;
+        }
+    }
+
+    // SHA3 padding
+    absorb(offset, 0x06);
+    absorb(rate - 1, 0x80);
+    keccakF(st);
+
+    QByteArray hash;
+    hash.resize(32);
+    for(size_t i = 0; i < 32; ++i) {
+        hash[static_cast<int>(i)] = static_cast<char>(st[i / 8] >> (8 * (i % 8)));
+    }
+
+    return hash;
+}
+
+// See "Encoding onion addresses" in Tor's rend-spec-v3.txt
+OnionKey createOnionKey()
+{
+    static constexpr char version = 0x03;
+
+    array<unsigned char, crypto_sign_SEEDBYTES> seed = {};
+    randombytes_buf(seed.data(), seed.size());
+
+    array<unsigned char, crypto_sign_PUBLICKEYBYTES> pk = {};
+    array<unsigned char, crypto_sign_SECRETKEYBYTES> sk = {};
+    crypto_sign_seed_keypair(pk.data(), sk.data(), seed.data());
+
+    // Tor wants the expanded key: The clamped scalar and the hash prefix
+    array<unsigned char, crypto_hash_sha512_BYTES> expanded = {};
+    crypto_hash_sha512(expanded.data(), seed.data(), seed.size());
+    expanded[0] &= 248;
+    expanded[31] &= 63;
+    expanded[31] |= 64;
+
+    const QByteArray pubkey{reinterpret_cast<const char *>(pk.data()), static_cast<int>(pk.size())};
+    const auto checksum = getSha3_256(QByteArray{".onion checksum"} + pubkey + version);
+
+    OnionKey key;
+    key.serviceId = onion56encode(pubkey + checksum.left(2) + version);
+    key.keyType = "ED25519-V3";
+    key.key = QByteArray{reinterpret_cast<const char *>(expanded.data()),
+                         static_cast<int>(expanded.size())}.toBase64();
+
+    sodium_memzero(seed.data(), seed.size());
+    sodium_memzero(sk.data(), sk.size());
+    sodium_memzero(expanded.data(), expanded.size());
+
+    return key;
+}
+
+}} // namespaces
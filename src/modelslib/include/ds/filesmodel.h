@@ -2,6 +2,7 @@
 #define FILESMODEL_H
 
 #include <deque>
+#include <vector>
 
 #include <QAbstractListModel>
 
@@ -16,6 +17,14 @@ class FilesModel : public QAbstractListModel
 {
     Q_OBJECT
 
+    // Transfers waiting for a slot in the TransferScheduler, and active transfers
+    Q_PROPERTY(int queuedTransfers READ getQueuedTransfers NOTIFY transferQueueChanged)
+    Q_PROPERTY(int activeTransfers READ getActiveTransfers NOTIFY transferQueueChanged)
+
+    enum Roles {
+        QUEUE_POSITION_ROLE = Qt::UserRole + 100
+    };
+
     struct Row {
         Row(const int dbId) : id{dbId} {}
         Row(Row&&) = default;
@@ -42,6 +51,12 @@ public:
     Q_INVOKABLE qlonglong getFileLength(const QString& path) const;
     Q_INVOKABLE QString getFileName(const QString& path) const;
 
+    int getQueuedTransfers() const;
+    int getActiveTransfers() const;
+
+signals:
+    void transferQueueChanged();
+
     // QAbstractItemModel interface
 public:
     int rowCount(const QModelIndex &parent) const override;
@@ -52,11 +67,19 @@ public:
 private slots:
     void onFileAdded(const core::File::ptr_t& file);
     void onFileDeleted(const int dbId);
+    void onTransferQueueChanged();
 
 private:
-    void queryRows(rows_t& rows);
+    // Reset the model, and load the rows in the DbExecutor
+    void queryRows();
+
+    // Load the file for row, and the files near it
+    void load(const size_t row) const;
 
     rows_t rows_;
+    int generation_ = 0; // Ignore results for a previous selection
+    bool loading_ = false;
+    std::vector<int> removedWhileLoading_;
     core::Conversation::ptr_t currentConversation_;
     core::Contact::ptr_t currentContact_;
     core::Identity *currentIdentity_ = {};
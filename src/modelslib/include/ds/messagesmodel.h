@@ -2,9 +2,13 @@
 #define MESSAGEMODEL_H
 
 #include <deque>
+#include <map>
+#include <set>
+#include <vector>
 
 #include <QSettings>
 #include <QAbstractListModel>
+#include <QSqlDatabase>
 
 #include "ds/identity.h"
 #include "ds/message.h"
@@ -45,6 +49,21 @@ private:
     enum Cols {
         H_ID = Qt::UserRole, H_CONTENT, H_COMPOSED, H_DIRECTION, H_RECEIVED, H_STATE, H_TYPE, H_FILE, H_STATE_NAME
     };
+
+    // A position in the (created, type, id) order of the rows
+    struct Cursor {
+        QVariant created;
+        Type type = MESSAGE;
+        int id = 0;
+    };
+
+    struct Page {
+        std::vector<Row> rows; // Oldest first
+        Cursor oldest;
+        bool more = false; // There are older rows
+    };
+
+    using content_map_t = std::map<int, std::shared_ptr<core::MessageContent>>;
 public:
 
     using rows_t = std::deque<Row>;
@@ -53,12 +72,22 @@ public:
 
     Q_INVOKABLE void setConversation(core::Conversation *conversation);
 
+    /*! Load the next page of older rows, if there are any.
+     *
+     * The older rows are inserted at the top. A view only calls
+     * fetchMore() when it reaches the bottom, so the view must call
+     * this when it is scrolled to the top.
+     */
+    Q_INVOKABLE void fetchOlder();
+
     // QAbstractItemModel interface
 public:
     QVariant data(const QModelIndex &index, int role) const override;
     int rowCount(const QModelIndex &parent = {}) const override;
     QHash<int, QByteArray> roleNames() const override;
     Qt::ItemFlags flags(const QModelIndex &index) const override;
+    bool canFetchMore(const QModelIndex &parent) const override;
+    void fetchMore(const QModelIndex &parent) override;
 
 signals:
     void dataChangedLater();
@@ -74,16 +103,36 @@ private slots:
     void onFileStateChanged(const core::File *file);
 
 private:
-    void queryRows(rows_t& rows);
+    // Start over with the newest page for the conversation
+    void queryRows();
+
+    // Load the page before oldest_ in the DbExecutor
+    void queryPage();
+
+    static Page fetchPage(QSqlDatabase& db, const int conversationId,
+                          const Cursor *before, const int limit);
+    static content_map_t fetchContent(QSqlDatabase& db, const std::vector<int>& ids);
     void load(Row& row) const;
+
+    // Load the content for the messages near row in one query
+    void hydrate(const size_t row) const;
     std::shared_ptr<core::MessageContent> loadData(const int id) const;
     std::shared_ptr<core::MessageContent> loadData(const core::Message& message) const;
+    static void useLiveState(const int id, core::MessageContent& data);
+    static void flushWriteBehind();
     void onMessageChanged(const core::Message::ptr_t& message, const int role);
     void onFileChanged(const core::File *file, const int role);
     QString getStateName(const Row& r) const;
 
     mutable rows_t rows_;
     core::Conversation::ptr_t conversation_;    
+    int generation_ = 0; // Ignore results for a previous conversation
+    bool loading_ = false;
+    bool hasMore_ = false;
+    Cursor oldest_;
+    const int pageSize_;
+    std::vector<std::pair<Type, int>> removedWhileLoading_;
+    std::set<std::pair<Type, int>> appended_; // Added after we selected the conversation
 };
 
 }} // namespaces
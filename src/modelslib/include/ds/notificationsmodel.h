@@ -1,6 +1,7 @@
 #ifndef NOTIFICATIONSMODEL_H
 #define NOTIFICATIONSMODEL_H
 
+#include <QSet>
 #include <QSettings>
 #include <QSqlQueryModel>
 
@@ -73,6 +74,8 @@ private:
     void deleteRow(const int row);
     bool isHashPresent(const QString& hash) const ;
 
+    // Notifications that are being added by the DbExecutor
+    QSet<QString> pendingHashes_;
 };
 
 }} // namespaces
@@ -0,0 +1,69 @@
+#ifndef SEARCHRESULTSMODEL_H
+#define SEARCHRESULTSMODEL_H
+
+#include <vector>
+
+#include <QAbstractListModel>
+
+#include "ds/conversation.h"
+#include "ds/messagemanager.h"
+
+namespace ds {
+namespace models {
+
+class SearchResultsModel : public QAbstractListModel
+{
+    Q_OBJECT
+
+    Q_PROPERTY(bool searching READ isSearching NOTIFY searchingChanged)
+    Q_PROPERTY(QString query READ getQuery NOTIFY queryChanged)
+
+    enum Roles {
+        MESSAGE_ID_ROLE = Qt::UserRole + 1,
+        CONVERSATION_ID_ROLE,
+        CONVERSATION_NAME_ROLE,
+        SNIPPET_ROLE,
+        COMPOSED_TIME_ROLE,
+        RANK_ROLE
+    };
+
+    using rows_t = std::vector<core::MessageManager::SearchHit>;
+public:
+    SearchResultsModel(QObject& parent);
+
+    // Search the message content. An empty text clears the results.
+    Q_INVOKABLE void search(const QString& text);
+
+    // Only search the conversations for this identity
+    Q_INVOKABLE void setIdentity(const QUuid& uuid);
+
+    // Limit the search to this conversation. nullptr searches all of them.
+    Q_INVOKABLE void setConversation(core::Conversation *conversation);
+
+    bool isSearching() const noexcept { return searching_; }
+    QString getQuery() const { return query_; }
+
+signals:
+    void searchingChanged();
+    void queryChanged();
+
+    // QAbstractItemModel interface
+public:
+    int rowCount(const QModelIndex &parent) const override;
+    QVariant data(const QModelIndex &index, int role) const override;
+    QHash<int, QByteArray> roleNames() const override;
+
+private:
+    void setSearching(bool searching);
+
+    rows_t rows_;
+    QString query_;
+    int identityId_ = 0; // Nothing is found until it is set
+    int conversationId_ = 0;
+    int generation_ = 0; // Ignore results for a previous query
+    bool searching_ = false;
+};
+
+}} // namespaces
+
+#endif // SEARCHRESULTSMODEL_H
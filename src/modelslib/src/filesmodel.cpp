@@ -3,8 +3,11 @@
 #include <QUrl>
 #include <QSqlError>
 
+#include <algorithm>
 #include <cassert>
+#include <iterator>
 
+#include "ds/dbexecutor.h"
 #include "ds/dsengine.h"
 #include "ds/errors.h"
 #include "ds/manager.h"
@@ -22,7 +25,8 @@ namespace models {
 FilesModel::FilesModel(QObject &parent)
     : QAbstractListModel(&parent)
 {
-
+    connect(DsEngine::instance().getTransferScheduler(), &TransferScheduler::queueChanged,
+            this, &FilesModel::onTransferQueueChanged);
 }
 
 void FilesModel::setConversation(Conversation *conversation)
@@ -31,7 +35,7 @@ void FilesModel::setConversation(Conversation *conversation)
     currentContact_ = conversation->getFirstParticipant()->shared_from_this();
     currentIdentity_ = currentContact_->getIdentity();
 
-    queryRows(rows_);
+    queryRows();
 }
 
 void FilesModel::setContact(Contact *contact)
@@ -40,7 +44,7 @@ void FilesModel::setContact(Contact *contact)
     currentContact_ = contact->shared_from_this();
     currentIdentity_ = currentContact_->getIdentity();
 
-    queryRows(rows_);
+    queryRows();
 }
 
 void FilesModel::setIdentity(Identity *identity)
@@ -49,7 +53,7 @@ void FilesModel::setIdentity(Identity *identity)
     currentContact_.reset();
     currentIdentity_ = identity;
 
-    queryRows(rows_);
+    queryRows();
 }
 
 qlonglong FilesModel::getFileLength(const QString &path) const
@@ -67,6 +71,16 @@ QString FilesModel::getFileName(const QString &path) const
     return QUrl(path).fileName();
 }
 
+int FilesModel::getQueuedTransfers() const
+{
+    return static_cast<int>(DsEngine::instance().getTransferScheduler()->getQueuedCount());
+}
+
+int FilesModel::getActiveTransfers() const
+{
+    return static_cast<int>(DsEngine::instance().getTransferScheduler()->getActiveCount());
+}
+
 int FilesModel::rowCount(const QModelIndex &) const
 {
     return static_cast<int>(rows_.size());
@@ -79,7 +93,7 @@ QVariant FilesModel::data(const QModelIndex &ix, int role) const
 
         // Lazy loading
         if (!r.file) {
-            r.file = DsEngine::instance().getFileManager()->getFile(r.id);
+            load(static_cast<size_t>(ix.row()));
         }
 
         assert(currentIdentity_ != nullptr);
@@ -87,6 +101,13 @@ QVariant FilesModel::data(const QModelIndex &ix, int role) const
         return QVariant::fromValue<ds::core::File *>(r.file.get());
     }
 
+    if (ix.isValid() && ix.column() == 0 && role == QUEUE_POSITION_ROLE) {
+        auto &r = rows_.at(static_cast<size_t>(ix.row()));
+
+        // Only loaded files can be in the queue
+        return r.file ? r.file->getQueuePosition() : 0;
+    }
+
     return {};
 }
 
@@ -94,6 +115,7 @@ QHash<int, QByteArray> FilesModel::roleNames() const
 {
     static const QHash<int, QByteArray> names = {
         {Qt::DisplayRole, "file"},
+        {QUEUE_POSITION_ROLE, "queuePosition"},
     };
 
     return names;
@@ -117,32 +139,28 @@ void FilesModel::onFileAdded(const File::ptr_t &file)
         return;
     }
 
-    rows_t r;
-    queryRows(r);
-
-    // Assume that the r == rows_, except for one added item
-    // Just find the insert point an add it
-
+    // The rows are ordered by id
     const auto key = file->getId();
-    int rowid = 0;
-    auto current_it = rows_.begin();
-    for(auto &row : r) {
-        if (row.id == key) {
+    const auto it = lower_bound(rows_.begin(), rows_.end(), key, [](const Row& row, const int id) {
+        return row.id < id;
+    });
 
-            beginInsertRows({}, rowid, rowid);
-
-            rows_.emplace(current_it, file->getId());
-
-            endInsertRows();
-            break;
-        }
-        ++rowid;
-        ++current_it;
+    if (it != rows_.end() && it->id == key) {
+        return; // Already there
     }
+
+    const auto rowid = static_cast<int>(distance(rows_.begin(), it));
+    beginInsertRows({}, rowid, rowid);
+    rows_.emplace(it, key);
+    endInsertRows();
 }
 
 void FilesModel::onFileDeleted(const int dbId)
 {
+    if (loading_) {
+        removedWhileLoading_.push_back(dbId);
+    }
+
     int rowid = 0;
     for(auto it = rows_.begin(); it != rows_.end(); ++it, ++rowid) {
         if (it->id == dbId) {
@@ -154,32 +172,122 @@ void FilesModel::onFileDeleted(const int dbId)
     }
 }
 
-void FilesModel::queryRows(FilesModel::rows_t &rows)
+void FilesModel::onTransferQueueChanged()
 {
+    if (!rows_.empty()) {
+        emit dataChanged(index(0), index(static_cast<int>(rows_.size()) - 1),
+                         {QUEUE_POSITION_ROLE});
+    }
+
+    emit transferQueueChanged();
+}
+
+void FilesModel::load(const size_t row) const
+{
+    static constexpr size_t window = 50;
+
+    // Get the file and its neighbours with one query
+    const auto first = (row > (window / 2)) ? row - (window / 2) : 0;
+    const auto last = min(first + window, rows_.size());
+
+    vector<int> ids;
+    for(auto i = first; i < last; ++i) {
+        if (!rows_[i].file) {
+            ids.push_back(rows_[i].id);
+        }
+    }
+
+    auto files = DsEngine::instance().getFileManager()->getFiles(ids);
+    auto file = files.begin();
+    for(auto i = first; (i < last) && (file != files.end()); ++i) {
+        if (!rows_[i].file && (rows_[i].id == (*file)->getId())) {
+            rows_[i].file = *file++;
+        }
+    }
+
+    if (!rows_[row].file) {
+        throw NotFoundError(QStringLiteral("File not found!"));
+    }
+}
+
+void FilesModel::queryRows()
+{
+    const auto generation = ++generation_;
+    loading_ = false;
+    removedWhileLoading_.clear();
+
+    beginResetModel();
+    rows_.clear();
+    endResetModel();
+
     if (!currentIdentity_) {
         return;
     }
 
+    loading_ = true;
+
     QString where = currentConversation_
             ? "conversation_id=:key"
             : currentContact_ ? "contact_id=:key"
             : "identity_id=:key";
-    QSqlQuery query;
-    query.prepare(QStringLiteral("SELECT id FROM file WHERE %1 ORDER BY %2").arg(where, "id"));
-    query.bindValue(":key", currentConversation_
-                    ? currentConversation_->getId()
-                    : currentContact_ ? currentContact_->getId()
-                    : currentIdentity_->getId());
-
-    if(!query.exec()) {
-        throw Error(QStringLiteral("Failed to query files: %1").arg(
-                        query.lastError().text()));
-    }
+    const auto key = currentConversation_
+            ? currentConversation_->getId()
+            : currentContact_ ? currentContact_->getId()
+            : currentIdentity_->getId();
+
+    DsEngine::instance().getDbExecutor().query([where, key](QSqlDatabase& db) {
+        QSqlQuery query(db);
+        query.prepare(QStringLiteral("SELECT id FROM file WHERE %1 ORDER BY %2").arg(where, "id"));
+        query.bindValue(":key", key);
+
+        if(!query.exec()) {
+            throw Error(QStringLiteral("Failed to query files: %1").arg(
+                            query.lastError().text()));
+        }
 
-    // Populate
-    while(query.next()) {
-        rows.emplace_back(query.value(0).toInt());
-    }
+        vector<int> ids;
+        while(query.next()) {
+            ids.push_back(query.value(0).toInt());
+        }
+        return ids;
+    }, this, [this, generation](vector<int> ids) {
+        if (generation != generation_) {
+            return;
+        }
+
+        loading_ = false;
+
+        // Merge with the files added while we were loading
+        for(const auto& row : rows_) {
+            ids.push_back(row.id);
+        }
+        for(const auto id : removedWhileLoading_) {
+            ids.erase(remove(ids.begin(), ids.end(), id), ids.end());
+        }
+        removedWhileLoading_.clear();
+        sort(ids.begin(), ids.end());
+        ids.erase(unique(ids.begin(), ids.end()), ids.end());
+
+        beginResetModel();
+        rows_t rows;
+        for(const auto id : ids) {
+            const auto it = find_if(rows_.begin(), rows_.end(), [id](const Row& row) {
+                return row.id == id;
+            });
+            if (it != rows_.end()) {
+                rows.push_back(move(*it));
+            } else {
+                rows.emplace_back(id);
+            }
+        }
+        rows_.swap(rows);
+        endResetModel();
+    }, [this, generation](const QString&) {
+        if (generation == generation_) {
+            loading_ = false;
+            removedWhileLoading_.clear();
+        }
+    });
 }
 
 
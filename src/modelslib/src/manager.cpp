@@ -52,6 +52,11 @@ FilesModel *Manager::filesModel()
     return filesModel_.get();
 }
 
+SearchResultsModel *Manager::searchResultsModel()
+{
+    return searchResults_.get();
+}
+
 void Manager::textToClipboard(const QString& text)
 {
     auto cb = QGuiApplication::clipboard();
@@ -183,6 +188,7 @@ Manager::Manager()
     conversationsModel_ = make_unique<ConversationsModel>(*this);
     messagesModel_ = make_unique<MessagesModel>(*this);
     filesModel_ = make_unique<FilesModel>(*this);
+    searchResults_ = make_unique<SearchResultsModel>(*this);
 
     instance_ = this;
 }
@@ -1,7 +1,14 @@
 
+#include <algorithm>
+#include <cassert>
+#include <iterator>
+
 #include "ds/messagesmodel.h"
 #include "ds/dsengine.h"
 #include "ds/dscert.h"
+#include "ds/dbexecutor.h"
+#include "ds/statementcache.h"
+#include "ds/writebehind.h"
 
 #include <QSqlQuery>
 #include <QSqlError>
@@ -23,6 +30,8 @@ namespace models {
 
 MessagesModel::MessagesModel(QObject &parent)
     : QAbstractListModel(&parent)
+    , pageSize_{clamp(DsEngine::instance().settings().value("messagesPageSize", 100).toInt(),
+                      1, static_cast<int>(max_in_list))}
 {
     auto mgr = DsEngine::instance().getMessageManager();
     auto fmgr = DsEngine::instance().getFileManager();
@@ -51,11 +60,10 @@ void MessagesModel::setConversation(Conversation *conversation)
     conversation_ = conversation ? conversation->shared_from_this() : nullptr;
 
     beginResetModel();
-
     rows_.clear();
-    queryRows(rows_);
-
     endResetModel();
+
+    queryRows();
 }
 
 int MessagesModel::rowCount(const QModelIndex &parent) const
@@ -74,7 +82,12 @@ QVariant MessagesModel::data(const QModelIndex &ix, int role) const
 
     // Lazy loading
     if (!r.loaded()) {
-        load(r);
+        if (r.type_ == MESSAGE) {
+            hydrate(static_cast<size_t>(ix.row()));
+        }
+        if (!r.loaded()) {
+            load(r);
+        }
     }
 
     switch(role) {
@@ -127,6 +140,23 @@ Qt::ItemFlags MessagesModel::flags(const QModelIndex&) const
     return Qt::ItemIsSelectable | Qt::ItemIsEnabled;
 }
 
+bool MessagesModel::canFetchMore(const QModelIndex &parent) const
+{
+    return !parent.isValid() && hasMore_ && !loading_;
+}
+
+void MessagesModel::fetchMore(const QModelIndex &parent)
+{
+    if (canFetchMore(parent)) {
+        queryPage();
+    }
+}
+
+void MessagesModel::fetchOlder()
+{
+    fetchMore({});
+}
+
 void MessagesModel::onMessageAdded(const Message::ptr_t &message)
 {
     if (!conversation_ || (conversation_->getId() != message->getConversationId())) {
@@ -135,6 +165,7 @@ void MessagesModel::onMessageAdded(const Message::ptr_t &message)
 
     // Always add at the end
     const int rowid = static_cast<int>(rows_.size());
+    appended_.emplace(MESSAGE, message->getId());
     beginInsertRows({}, rowid, rowid);
     rows_.push_back({message->getId(), loadData(*message)});
     endInsertRows();
@@ -147,6 +178,10 @@ void MessagesModel::onMessageDeleted(const Message::ptr_t &message)
     }
 
     const int messageId = message->getId();
+    if (loading_) {
+        removedWhileLoading_.emplace_back(MESSAGE, messageId);
+    }
+
     int rowid = 0;
     for(auto it = rows_.begin(); it != rows_.end(); ++it, ++rowid) {
         if (it->type_ == MESSAGE && it->id == messageId) {
@@ -176,6 +211,7 @@ void MessagesModel::onFileAdded(const File::ptr_t &file)
 
     // Always add at the end
     const int rowid = static_cast<int>(rows_.size());
+    appended_.emplace(FILE, file->getId());
 
     beginInsertRows({}, rowid, rowid);
     rows_.push_back({file->getId(), file});
@@ -188,6 +224,10 @@ void MessagesModel::onFileDeleted(const int dbId)
         return; // Irrelevant
     }
 
+    if (loading_) {
+        removedWhileLoading_.emplace_back(FILE, dbId);
+    }
+
     int rowid = 0;
     for(auto it = rows_.begin(); it != rows_.end(); ++it, ++rowid) {
         if (it->type_ == FILE && it->id == dbId) {
@@ -204,35 +244,206 @@ void MessagesModel::onFileStateChanged(const File *file)
      onFileChanged(file, H_STATE);
 }
 
-void MessagesModel::queryRows(MessagesModel::rows_t &rows)
+void MessagesModel::queryRows()
 {
-    if (!conversation_) {
-        return;
+    ++generation_;
+    loading_ = false;
+    hasMore_ = false;
+    oldest_ = {};
+    removedWhileLoading_.clear();
+    appended_.clear();
+
+    if (conversation_) {
+        queryPage();
     }
+}
 
-    QSqlQuery query;
-    //query.prepare("SELECT id FROM message WHERE conversation_id=:cid ORDER BY id");
-    query.prepare(
-        "SELECT 0 as type, id, composed_time AS created FROM message WHERE conversation_id=:cid "
+void MessagesModel::queryPage()
+{
+    assert(conversation_);
+    assert(!loading_);
+
+    loading_ = true;
+    const auto generation = generation_;
+
+    // The worker reads the database. Give it the updates that are held back.
+    flushWriteBehind();
+    const auto before = oldest_.created.isValid()
+            ? make_shared<Cursor>(oldest_) : shared_ptr<Cursor>{};
+
+    DsEngine::instance().getDbExecutor().query(
+                [cid=conversation_->getId(), before, limit=pageSize_](QSqlDatabase& db) {
+        return fetchPage(db, cid, before.get(), limit);
+    }, this, [this, generation](Page page) {
+        if (generation != generation_) {
+            return; // The user selected another conversation
+        }
+
+        loading_ = false;
+        hasMore_ = page.more;
+        if (!page.rows.empty()) {
+            oldest_ = page.oldest;
+        }
+
+        // Skip the rows we got from the signals while we were loading
+        rows_t rows;
+        for(auto& r : page.rows) {
+            const auto key = make_pair(r.type_, r.id);
+            if ((appended_.find(key) != appended_.end())
+                    || (find(removedWhileLoading_.begin(), removedWhileLoading_.end(), key)
+                        != removedWhileLoading_.end())) {
+                continue;
+            }
+            rows.push_back(move(r));
+        }
+        removedWhileLoading_.clear();
+
+        // File objects live in this thread. Get the ones in the page in one go.
+        vector<int> fileIds;
+        for(auto& r : rows) {
+            if (r.type_ == FILE) {
+                fileIds.push_back(r.id);
+            } else if (r.data_) {
+                useLiveState(r.id, *r.data_);
+            }
+        }
+        if (!fileIds.empty()) {
+            auto files = DsEngine::instance().getFileManager()->getFiles(fileIds);
+            auto file = files.begin();
+            for(auto& r : rows) {
+                if ((file != files.end()) && (r.type_ == FILE) && (r.id == (*file)->getId())) {
+                    r.file_ = *file++;
+                }
+            }
+        }
+
+        LFLOG_DEBUG << "Loaded " << rows.size() << " rows with messages and/or files";
+
+        if (rows.empty()) {
+            return;
+        }
+
+        // The page is older than anything we have
+        beginInsertRows({}, 0, static_cast<int>(rows.size()) - 1);
+        rows_.insert(rows_.begin(), make_move_iterator(rows.begin()), make_move_iterator(rows.end()));
+        endInsertRows();
+    }, [this, generation](const QString&) {
+        if (generation == generation_) {
+            loading_ = false;
+            hasMore_ = false;
+            removedWhileLoading_.clear();
+        }
+    });
+}
+
+MessagesModel::Page MessagesModel::fetchPage(QSqlDatabase &db, const int conversationId,
+                                             const MessagesModel::Cursor *before,
+                                             const int limit)
+{
+    // Keyset pagination, newest first. Each side of the union
+    // can use the (conversation_id, time, id) index.
+    QString sql = QStringLiteral(
+        "SELECT type, id, created FROM ("
+        "SELECT 0 AS type, id, composed_time AS created FROM message WHERE conversation_id=:cid %1 "
         "UNION ALL "
-        "SELECT 1 as type, id, created_time AS created FROM file WHERE conversation_id=:cid "
-        "ORDER BY created ");
-    query.bindValue(":cid", conversation_->getId());
+        "SELECT 1 AS type, id, created_time AS created FROM file WHERE conversation_id=:cid %2"
+        ") %3 ORDER BY created DESC, type DESC, id DESC LIMIT :limit")
+            .arg(before ? "AND composed_time <= :created" : "",
+                 before ? "AND created_time <= :created" : "",
+                 before ? "WHERE created < :created OR (created = :created AND "
+                          "(type < :type OR (type = :type AND id < :id)))" : "");
+
+    QSqlQuery query(db);
+    query.prepare(sql);
+    query.bindValue(":cid", conversationId);
+    if (before) {
+        query.bindValue(":created", before->created);
+        query.bindValue(":type", static_cast<int>(before->type));
+        query.bindValue(":id", before->id);
+    }
+
+    // One extra, to know if there are more
+    query.bindValue(":limit", limit + 1);
+
+    if(!query.exec()) {
+        throw Error(QStringLiteral("Failed to query messages: %1").arg(
+                        query.lastError().text()));
+    }
+
+    enum Fiels { type, id, created };
+
+    Page page;
+    vector<int> messages;
+    while(query.next()) {
+        if (static_cast<int>(page.rows.size()) == limit) {
+            page.more = true;
+            break;
+        }
+
+        page.oldest = {query.value(created),
+                       static_cast<Type>(query.value(type).toInt()),
+                       query.value(id).toInt()};
+        page.rows.emplace_back(page.oldest.id, page.oldest.type);
+        if (page.oldest.type == MESSAGE) {
+            messages.push_back(page.oldest.id);
+        }
+    }
+    query.finish();
+
+    // Hydrate the messages in the page with one query
+    const auto content = fetchContent(db, messages);
+    for(auto& r : page.rows) {
+        if (r.type_ == MESSAGE) {
+            const auto it = content.find(r.id);
+            if (it != content.end()) {
+                r.data_ = it->second;
+            }
+        }
+    }
+
+    reverse(page.rows.begin(), page.rows.end());
+    return page;
+}
+
+MessagesModel::content_map_t MessagesModel::fetchContent(QSqlDatabase &db, const std::vector<int> &ids)
+{
+    content_map_t content;
+    if (ids.empty()) {
+        return content;
+    }
+
+    // The ids are at most one page, so one query is enough
+    assert(ids.size() <= max_in_list);
+
+    QSqlQuery query(db);
+    query.prepare(QStringLiteral("SELECT id, state, direction, composed_time, received_time, content FROM message WHERE id IN (%1)")
+                  .arg(placeholders(ids.size())));
+    for(const auto id : ids) {
+        query.addBindValue(id);
+    }
 
     if(!query.exec()) {
-        throw Error(QStringLiteral("Failed to add Conversation: %1").arg(
+        throw Error(QStringLiteral("Failed to fetch Messages: %1").arg(
                         query.lastError().text()));
     }
 
-    enum Fiels { type, id };
+    enum Fields {
+        id, state, direction, composed_time, received_time, content_
+    };
 
-    // Populate
     while(query.next()) {
-        rows.emplace_back(query.value(id).toInt(),
-                          static_cast<Type>(query.value(type).toInt()));
+        auto ptr = make_shared<MessageContent>();
+
+        ptr->state = static_cast<Message::State>(query.value(state).toInt());
+        ptr->direction = static_cast<Message::Direction>(query.value(direction).toInt());
+        ptr->composedTime = query.value(composed_time).toDateTime();
+        ptr->sentReceivedTime = query.value(received_time).toDateTime();
+        ptr->content = query.value(content_).toString();
+
+        content[query.value(id).toInt()] = move(ptr);
     }
 
-    LFLOG_DEBUG << "Loaded " << rows.size() << " rows with messages and/or files";
+    return content;
 }
 
 void MessagesModel::load(MessagesModel::Row &row) const
@@ -244,9 +455,43 @@ void MessagesModel::load(MessagesModel::Row &row) const
     }
 }
 
+void MessagesModel::hydrate(const size_t row) const
+{
+    static constexpr size_t window = 50;
+
+    // Rows from the pages are loaded already. This is for the rest.
+    const auto first = (row > (window / 2)) ? row - (window / 2) : 0;
+    const auto last = min(first + window, rows_.size());
+
+    vector<int> ids;
+    for(auto i = first; i < last; ++i) {
+        if ((rows_[i].type_ == MESSAGE) && !rows_[i].loaded()) {
+            ids.push_back(rows_[i].id);
+        }
+    }
+
+    if (!ids.empty()) {
+        flushWriteBehind();
+    }
+
+    const auto content = fetchContent(DsEngine::instance().getDb(), ids);
+    for(auto i = first; i < last; ++i) {
+        auto& r = rows_[i];
+        if ((r.type_ == MESSAGE) && !r.loaded()) {
+            const auto it = content.find(r.id);
+            if (it != content.end()) {
+                r.data_ = it->second;
+                useLiveState(r.id, *r.data_);
+            }
+        }
+    }
+}
+
 std::shared_ptr<MessageContent> MessagesModel::loadData(const int id) const
 {
-    // TODO: Try to get it from the message cache
+    if (auto message = DsEngine::instance().getMessageManager()->findLoaded(id)) {
+        return loadData(*message);
+    }
 
     // Read from database
     QSqlQuery query;
@@ -291,6 +536,27 @@ std::shared_ptr<MessageContent> MessagesModel::loadData(const Message &message)
     return ptr;
 }
 
+/* The state of a message may not be in the database yet, if WriteBehind
+ * holds it. A Message object in memory is always up to date. We flush
+ * before we read, and use this for changes made while the query ran.
+ */
+void MessagesModel::flushWriteBehind()
+{
+    try {
+        WriteBehind::instance().flush();
+    } catch(const std::exception& ex) {
+        LFLOG_WARN << "Failed to write pending updates to the database: " << ex.what();
+    }
+}
+
+void MessagesModel::useLiveState(const int id, MessageContent &data)
+{
+    if (auto message = DsEngine::instance().getMessageManager()->findLoaded(id)) {
+        data.state = message->getState();
+        data.sentReceivedTime = message->getSentReceivedTime();
+    }
+}
+
 void MessagesModel::onMessageChanged(const Message::ptr_t &message, const int role)
 {
     if (!conversation_ || (conversation_->getId() != message->getConversationId())) {
@@ -1,8 +1,11 @@
 #include "include/ds/notificationsmodel.h"
 #include "ds/crypto.h"
+#include "ds/dbexecutor.h"
+#include "ds/errors.h"
 
 
 #include <QDateTime>
+#include <QSqlError>
 #include <QSqlQuery>
 
 namespace ds {
@@ -115,34 +118,46 @@ void NotificationsModel::addNotification(Identity *identity, const core::PeerAdd
     QString hash, identityId = QString::number(identity->getId());
     crypto::createHash(hash, {req.handle, req.address, identityId});
 
-    if (isHashPresent(hash)) {
+    if (pendingHashes_.contains(hash) || isHashPresent(hash)) {
         LFLOG_DEBUG << "Ignoring duplicate AddMe notification.";
         return;
     }
 
     QDateTime when = QDateTime::fromSecsSinceEpoch((QDateTime::currentSecsSinceEpoch() / 60) * 60 );
-    QSqlQuery query{core::DsEngine::instance().getDb()};
 
     QVariantMap data;
     data.insert("address", req.address);
     data.insert("handle", req.handle);
     data.insert("nickName", req.nickName);
 
-    query.prepare("INSERT INTO notification "
-                  "(status, priority, identity, type, timestamp, message, data, hash) "
-                  "VALUES "
-                  "(:status, :priority, :identity, :type, :timestamp, :message, :data, :hash)");
-    query.bindValue(":status", ACTIVE);
-    query.bindValue(":priority", NORMAL);
-    query.bindValue(":identity", identity->getId());
-    query.bindValue(":type", N_ADDME);
-    query.bindValue(":timestamp", when);
-    query.bindValue(":message", req.message);
-    query.bindValue(":data", core::DsEngine::toJson(data));
-    query.bindValue(":hash", hash);
-
-    query.exec();
-    refresh();
+    pendingHashes_.insert(hash);
+    DsEngine::instance().getDbExecutor().query(
+                [identity=identity->getId(), when, message=req.message,
+                data=core::DsEngine::toJson(data), hash](QSqlDatabase& db) {
+        QSqlQuery query{db};
+        query.prepare("INSERT INTO notification "
+                      "(status, priority, identity, type, timestamp, message, data, hash) "
+                      "VALUES "
+                      "(:status, :priority, :identity, :type, :timestamp, :message, :data, :hash)");
+        query.bindValue(":status", ACTIVE);
+        query.bindValue(":priority", NORMAL);
+        query.bindValue(":identity", identity);
+        query.bindValue(":type", N_ADDME);
+        query.bindValue(":timestamp", when);
+        query.bindValue(":message", message);
+        query.bindValue(":data", data);
+        query.bindValue(":hash", hash);
+
+        if (!query.exec()) {
+            throw Error(QStringLiteral("Failed to add notification: %1").arg(
+                            query.lastError().text()));
+        }
+    }, this, [this, hash]() {
+        pendingHashes_.remove(hash);
+        refresh();
+    }, [this, hash](const QString&) {
+        pendingHashes_.remove(hash);
+    });
 }
 
 void NotificationsModel::acceptContact(const int row, bool accept)
@@ -0,0 +1,143 @@
+
+#include "ds/dsengine.h"
+#include "ds/identitymanager.h"
+#include "ds/searchresultsmodel.h"
+
+#include "logfault/logfault.h"
+
+using namespace std;
+using namespace ds::core;
+
+
+namespace ds {
+namespace models {
+
+SearchResultsModel::SearchResultsModel(QObject &parent)
+    : QAbstractListModel(&parent)
+{
+}
+
+void SearchResultsModel::search(const QString &text)
+{
+    const auto generation = ++generation_;
+
+    if (query_ != text) {
+        query_ = text;
+        emit queryChanged();
+    }
+
+    beginResetModel();
+    rows_.clear();
+    endResetModel();
+
+    if (MessageManager::toMatchExpression(text).isEmpty()) {
+        setSearching(false);
+        return;
+    }
+
+    setSearching(true);
+
+    const auto limit = DsEngine::instance().settings().value("searchResultsLimit", 50).toInt();
+
+    DsEngine::instance().getMessageManager()->search(
+                text, identityId_, conversationId_, limit, this,
+                [this, generation](rows_t hits) {
+        if (generation != generation_) {
+            return;
+        }
+
+        beginResetModel();
+        rows_ = move(hits);
+        endResetModel();
+        setSearching(false);
+    }, [this, generation](const QString& reason) {
+        if (generation == generation_) {
+            LFLOG_WARN << "Search for \"" << query_ << "\" failed: " << reason;
+            setSearching(false);
+        }
+    });
+}
+
+void SearchResultsModel::setIdentity(const QUuid &uuid)
+{
+    const auto identity = DsEngine::instance().getIdentityManager()->identityFromUuid(uuid);
+    const auto id = identity ? identity->getId() : 0;
+    if (id == identityId_) {
+        return;
+    }
+
+    identityId_ = id;
+    conversationId_ = 0;
+    search(query_);
+}
+
+void SearchResultsModel::setConversation(Conversation *conversation)
+{
+    const auto id = conversation ? conversation->getId() : 0;
+    const auto identityId = conversation ? conversation->getIdentityId() : identityId_;
+    if ((id == conversationId_) && (identityId == identityId_)) {
+        return;
+    }
+
+    conversationId_ = id;
+    identityId_ = identityId;
+    search(query_);
+}
+
+int SearchResultsModel::rowCount(const QModelIndex &) const
+{
+    return static_cast<int>(rows_.size());
+}
+
+QVariant SearchResultsModel::data(const QModelIndex &ix, int role) const
+{
+    if (!ix.isValid() || ix.column() != 0
+            || ix.row() < 0 || static_cast<size_t>(ix.row()) >= rows_.size()) {
+        return {};
+    }
+
+    const auto& r = rows_[static_cast<size_t>(ix.row())];
+
+    switch(role) {
+    case Qt::DisplayRole:
+    case SNIPPET_ROLE:
+        return r.snippet;
+    case MESSAGE_ID_ROLE:
+        return r.messageId;
+    case CONVERSATION_ID_ROLE:
+        return r.conversationId;
+    case CONVERSATION_NAME_ROLE:
+        return r.conversationName;
+    case COMPOSED_TIME_ROLE:
+        return r.composedTime;
+    case RANK_ROLE:
+        return r.rank;
+    }
+
+    return {};
+}
+
+QHash<int, QByteArray> SearchResultsModel::roleNames() const
+{
+    static const QHash<int, QByteArray> names = {
+        {Qt::DisplayRole, "display"},
+        {MESSAGE_ID_ROLE, "messageId"},
+        {CONVERSATION_ID_ROLE, "conversationId"},
+        {CONVERSATION_NAME_ROLE, "conversationName"},
+        {SNIPPET_ROLE, "snippet"},
+        {COMPOSED_TIME_ROLE, "composedTime"},
+        {RANK_ROLE, "rank"},
+    };
+
+    return names;
+}
+
+void SearchResultsModel::setSearching(const bool searching)
+{
+    if (searching_ != searching) {
+        searching_ = searching;
+        emit searchingChanged();
+    }
+}
+
+}}
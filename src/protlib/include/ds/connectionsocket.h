@@ -1,9 +1,12 @@
 #ifndef CONNECTIONSOCKET_H
 #define CONNECTIONSOCKET_H
 
+#include <array>
+#include <limits>
 #include <memory>
 
 #include <QTcpSocket>
+#include <QTimer>
 #include <QUuid>
 
 #include "ds/memoryview.h"
@@ -19,6 +22,58 @@ public:
     using ptr_t = std::shared_ptr<ConnectionSocket>;
     using data_t = crypto::MemoryView<uint8_t>;
 
+    // Payload size of a Tor RELAY cell
+    static constexpr qint64 cell_payload_bytes = 498;
+
+    // Max time we hold back small frames
+    static constexpr int max_coalesce_delay_ms = 9;
+
+    // Read buffer limits
+    static constexpr qint64 default_min_read_buffer = 1024 * 8;
+    static constexpr qint64 default_max_read_buffer = 1024 * 1024;
+
+    // Covers the largest frame in the protocol until the owner tells us
+    static constexpr qint64 default_max_frame_bytes = 1024 * 72;
+
+    // How often we adjust the buffers to the throughput
+    static constexpr int buffer_adapt_interval_ms = 1000;
+
+    // Bytes of bulk data we allow in our buffers by default
+    static constexpr qint64 default_bulk_lane_depth = 1024 * 32;
+
+    // Default size of the kernel's send buffer (SO_SNDBUF)
+    static constexpr qint64 default_send_buffer = 1024 * 32;
+
+    /*! Priority of a frame.
+     *
+     * Interactive frames (requests, acks, chat messages) are always
+     * written immediately. Bulk frames (file data) are only produced
+     * when the bulk lane has room, so that the interactive frames never
+     * have to wait for more than a few bulk frames to drain.
+     *
+     * All the frames are encrypted in one stream, so they can not be
+     * re-ordered once written. The lanes are enforced by the producers
+     * of bulk data, who must check isBulkLaneOpen() before they encrypt
+     * and write the next frame.
+     *
+     * Once written to the socket, the frames queue in the kernel before
+     * Tor reads them. setSendBufferLimit() keeps that queue short too.
+     */
+    enum class Lane {
+        INTERACTIVE,
+        BULK
+    };
+
+    struct CoalesceStats {
+        quint64 frames = {};
+
+        // Cells needed if each frame was flushed by itself
+        quint64 framedCells = {};
+
+        // Cells needed for what we actually flushed
+        quint64 sentCells = {};
+    };
+
     ConnectionSocket(QByteArray host = {}, quint16 port = {}, const QUuid& uuid = {});
     ~ConnectionSocket();
 
@@ -26,16 +81,68 @@ public:
         return uuid;
     }
 
+    // Write one frame
     template <typename T>
-    void write(const T& data) {
+    void write(const T& data, const Lane lane = Lane::INTERACTIVE) {
         const char *p = reinterpret_cast<const char *>(data.data());
         const qint64 bytes = data.size();
-        outData.append(p, bytes);
-        sendMore();
+        writeFrame(p, bytes, lane);
+    }
+
+    // Bytes written by us that are not yet handed over to the OS
+    qint64 getBytesQueued() const noexcept {
+        return outData.size() + bytesToWrite();
+    }
+
+    // True if there is room for another bulk frame
+    bool isBulkLaneOpen() const noexcept {
+        return getBytesQueued() < bulkLaneDepth_;
+    }
+
+    /*! Limit the kernel's send buffer for this socket.
+     *
+     * By default the OS grows it to several megabytes, which is
+     * all in front of the next interactive frame. Applied when the
+     * socket is connected. 0 leaves it to the OS.
+     */
+    void setSendBufferLimit(qint64 bytes);
+
+    /*! Max bytes in our buffers before we stop accepting bulk frames.
+     *
+     * 0 disables the limit.
+     */
+    void setBulkLaneDepth(qint64 bytes) {
+        bulkLaneDepth_ = bytes > 0 ? bytes : std::numeric_limits<qint64>::max();
     }
 
+    /*! Hold small frames for up to delayMs milliseconds, and send
+     * the output in multiples of the Tor cell payload size.
+     *
+     * 0 disables the coalescing.
+     */
+    void setCoalesceDelay(int delayMs);
+
+    const CoalesceStats& getCoalesceStats() const noexcept { return stats_; }
+
+    // Stats for all the connections
+    static const CoalesceStats& getTotalCoalesceStats() noexcept { return totalStats_; }
+
     void wantBytes(size_t bytesRequested);
 
+    /*! Set the range for the read buffer.
+     *
+     * The buffer starts at minBytes. It grows when the connection
+     * receives data faster than the buffer can hold, and shrinks
+     * again when the connection is idle.
+     */
+    void setReadBufferLimits(qint64 minBytes, qint64 maxBytes);
+
+    /*! The largest frame the owner will ask for with wantBytes().
+     *
+     * Used to limit the data we accept in the incoming buffer.
+     */
+    void setMaxFrameSize(qint64 bytes);
+
     void connectToDefaultHost();
     const QByteArray& getDefaultHost() const noexcept { return host_; }
     quint16 getDefaultPort() const noexcept { return port_; }
@@ -54,15 +161,34 @@ private slots:
 
 private:
     void processInput();
+    void readSome();
+    void writeFrame(const char *data, const qint64 bytes, const Lane lane);
     void sendMore();
+    void sendMore(const qint64 bytes);
+    void adaptBuffers();
+    void applySendBufferLimit();
+    size_t getMaxInDataSize() const noexcept;
 
     QUuid uuid;
     QByteArray outData;
     QByteArray inData;
     size_t bytesWanted_ = {};
-    size_t maxInDataSize = 1024 * 265;
+    qint64 minReadBuffer_ = default_min_read_buffer;
+    qint64 maxReadBuffer_ = default_max_read_buffer;
+    qint64 maxFrameBytes_ = default_max_frame_bytes;
+    quint64 bytesRead_ = {};
+    quint64 lastBytesRead_ = {};
+    bool readBufferFull_ = false; // Reads were limited by the buffer since last adapt
+    QTimer adaptTimer_; // Only runs while we read, and until the buffer is back at minimum
     const QByteArray host_;
     const quint16 port_;
+    qint64 bulkLaneDepth_ = default_bulk_lane_depth;
+    qint64 sendBufferLimit_ = {};
+    int coalesceDelay_ = 0;
+    QTimer coalesceTimer_;
+    CoalesceStats stats_;
+    std::array<quint64, 2> laneBytes_ = {}; // Bytes written in each lane
+    static CoalesceStats totalStats_;
 };
 
 }} // namespaces
@@ -1,6 +1,8 @@
 #ifndef DSCLIENT_H
 #define DSCLIENT_H
 
+#include <functional>
+
 #include "ds/peer.h"
 
 namespace ds {
@@ -15,6 +17,9 @@ class DsClient : public Peer
 public:
     using ptr_t = std::shared_ptr<DsClient>;
 
+    // Returns false if a reconnect is known to be futile right now
+    using retry_gate_t = std::function<bool ()>;
+
     enum class State {
         CONNECTED,
         GET_OLLEH,
@@ -23,6 +28,8 @@ public:
 
     DsClient(ConnectionSocket::ptr_t connection, core::ConnectData connectionData);
 
+    void setRetryGate(retry_gate_t gate) { retryGate_ = std::move(gate); }
+
 private slots:
     void advance();
     void advance(const data_t& data);
@@ -31,13 +38,15 @@ private slots:
 private:
     void sayHello();
     void getHelloReply(const data_t& data);
-    void startConnectRetryTimer();
+    // countAttempt is false when we only wait for the retry gate
+    void startConnectRetryTimer(const bool countAttempt = true);
     void initConnections();
 
     State state_ = State::CONNECTED;
     size_t maxReconnects_ = 20;
     size_t numReconnects_ = {};
     size_t reconnectDelayMilliseconds_ = 20000;
+    retry_gate_t retryGate_;
 
     // PeerConnection interface
 public:
@@ -1,6 +1,9 @@
 #ifndef DSSERVER_H
 #define DSSERVER_H
 
+#include <functional>
+#include <vector>
+
 #include "ds/peer.h"
 
 
@@ -19,8 +22,17 @@ public:
         UNAUTHORIZED
     };
 
+    using identities_fn_t = std::function<std::vector<core::ConnectData> ()>;
+
     DsServer(ConnectionSocket::ptr_t connection, core::ConnectData connectionData);
 
+    /*! Server for a listener that is shared by several identities.
+     *
+     * The identity is resolved from the Hello message by trying the
+     * decryption keys of the identities returned by the functor.
+     */
+    DsServer(ConnectionSocket::ptr_t connection, identities_fn_t identities);
+
 public slots:
     virtual void authorize(bool authorize) override;
 
@@ -29,8 +41,10 @@ private slots:
 
 private:
     void getHello(const data_t& data);
+    bool decryptHello(Hello& hello, const data_t& data);
 
     State state_ = State::CONNECTED;
+    identities_fn_t identities_;
 
     // PeerConnection interface
 public:
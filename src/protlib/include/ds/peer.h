@@ -3,11 +3,16 @@
 
 #include <array>
 #include <cassert>
+#include <functional>
+
+#include <QElapsedTimer>
+#include <QTimer>
 
 #include "ds/protocolmanager.h"
 #include "ds/connectionsocket.h"
 #include "ds/peerconnection.h"
 #include "ds/file.h"
+#include "ds/ratelimiter.h"
 
 namespace ds {
 namespace prot {
@@ -76,16 +81,28 @@ public:
         mview_t signature;
     };
 
+    // Offset for chunks that are not part of a striped transfer
+    static constexpr qint64 no_offset = -1;
+
     class Channel {
     public:
         using ptr_t = std::shared_ptr<Channel>;
 
         virtual ~Channel() = default;
-        virtual void onIncoming(Peer& peer, const quint64 id,
+
+        // offset is no_offset for sequential data
+        virtual void onIncoming(Peer& peer, const quint64 id, const qint64 offset,
                                 const mview_t& data, const bool final) = 0;
 
-        // Return 0 on EOF
+        // Return 0 on EOF, or if there is nothing to send right now
         virtual uint64_t onOutgoing(Peer& peer) = 0;
+
+        // The peer acknowledged ranges of a striped transfer
+        virtual void onAck(Peer& /*peer*/, const QByteArray& /*offsets*/) {}
+
+        // A connection that carried ranges of a striped transfer is lost.
+        // Return true if some ranges must be sent again.
+        virtual bool onDisconnected(const QUuid& /*connection*/) { return false; }
     };
 
     Peer(ConnectionSocket::ptr_t connection,
@@ -110,6 +127,20 @@ public:
         return connectionData_;
     }
 
+    /*! True if this is an auxiliary connection that only carries
+     * file data for a transfer on a primary connection.
+     */
+    bool isDataConnection() const noexcept {
+        return dataConnection_;
+    }
+
+    /*! True if we have offered the peer to stripe a transfer
+     * over data connections, and wait for them to connect.
+     */
+    bool expectsDataConnections() const noexcept {
+        return !stripeTokens_.empty();
+    }
+
 public slots:
     virtual void authorize(bool /*authorize*/) override {}
 
@@ -120,6 +151,10 @@ public slots:
     // Final is true for the last block of a file-transfer to indicate EOF.
     uint64_t send(const void *data, const size_t bytes, const quint32 channel, const bool final = false);
 
+    // Send a block of a striped file-transfer, starting at offset in the file
+    uint64_t sendRange(const void *data, const size_t bytes, const quint32 channel,
+                       const qint64 offset, const bool final = false);
+
 signals:
     void incomingPeer(const std::shared_ptr<PeerConnection>& peer);
     void closeLater();
@@ -129,8 +164,21 @@ private slots:
     void onCloseLater();
 
 protected:
-    void onReceivedData(const quint32 channel, const quint64 id,
+    uint64_t sendChunk(const void *data, const size_t bytes, const quint32 channel,
+                       const qint64 offset, const bool final);
+    void onReceivedData(const quint32 channel, const quint64 id, const qint64 offset,
                         const mview_t& data, const bool final);
+    void onReceivedBind(const mview_t& data);
+    quint32 bindDataConnection(const QByteArray& token);
+    void pumpDataConnection(const ptr_t& dataConnection);
+    void onDataConnectionLost(const Peer& dataConnection);
+    void closeDataConnections(const core::File::Direction direction, const quint32 channel);
+    void closeDataConnections();
+    bool isThrottled(const RateLimiter::Direction direction, std::function<void ()> resume);
+    QByteArray getRateLimitKey() const;
+    void startProbing();
+    void probe();
+    void onPong(const quint64 seq);
     void onReceivedJson(const quint64 id, const mview_t& data);
     void enableEncryptedStream();
     void wantChunkSize();
@@ -140,7 +188,7 @@ protected:
     void prepareDecryption(stream_state_t& state, const mview_t& header, const mview_t& key);
     void decrypt(mview_t& data, const mview_t& ciphertext, bool& final);
     QByteArray safePayload(const mview_t& data);
-    quint32 createChannel(const core::File& file);
+    quint32 createChannel(const core::File& file, const bool ranged = false);
     uint64_t startReceive(core::File& file);
     uint64_t startSend(core::File& file);
     void useConnection(ConnectionSocket *cc);
@@ -156,6 +204,37 @@ protected:
     std::map<quint32, Channel::ptr_t> inChannels_;
     bool notificationsDisabled_ = false;
 
+    // Striped transfers
+    struct StripeOffer {
+        int stripes = {};
+        QByteArray token;
+    };
+
+    bool dataConnection_ = false;
+    std::weak_ptr<Peer> primary_; // For data connections
+    quint32 boundChannel_ = {}; // For data connections
+    std::vector<ptr_t> dataConnections_;
+    std::map<QByteArray, quint32> stripeTokens_; // Offered by us, for incoming channels
+    std::map<quint32, StripeOffer> stripeOffers_; // Offered by the peer, for outgoing channels
+    std::map<QUuid, quint32> stripedTransfers_; // Outgoing channels we want data connections for
+
+    std::array<bool, 2> throttled_ = {}; // Waiting for the rate limiter, for each direction
+
+    // RTT and throughput probing
+    QTimer probeTimer_;
+    QElapsedTimer clock_;
+    quint64 nextPing_ = {};
+    std::map<quint64, qint64> pendingPings_; // seq, sent time
+    bool pongReceived_ = false; // Older peers don't know Ping, and never answer
+    double srtt_ = -1.0;
+    quint64 bytesSent_ = {};
+    quint64 bytesReceived_ = {};
+    quint64 lastBytesSent_ = {};
+    quint64 lastBytesReceived_ = {};
+    qint64 lastProbe_ = {};
+    qint64 sendRate_ = {};
+    qint64 receiveRate_ = {};
+
     // PeerConnection interface
 public:
     const QUuid uuid_;
@@ -173,6 +252,8 @@ public:
     uint64_t startTransfer(core::File& file) override;
     uint64_t sendSome(core::File& file) override;
     void disableNotifications() override;
+    void addDataConnection(const core::PeerConnection::ptr_t& peer) override;
+    core::ConnectionStats getStats() const override;
 };
 
 }} // namespaces
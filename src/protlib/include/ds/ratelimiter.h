@@ -0,0 +1,79 @@
+#ifndef RATELIMITER_H
+#define RATELIMITER_H
+
+#include <array>
+#include <map>
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QUuid>
+
+namespace ds {
+namespace prot {
+
+/*! Hierarchical token-bucket bandwidth limiter for file transfers.
+ *
+ * A transfer must have tokens at all the levels it belongs to:
+ * globally, for its identity and for its contact, in each direction.
+ *
+ * The limits are read from the settings (bytes per second, 0 is unlimited),
+ * and changes take effect within a second:
+ *   - rateLimitUp / rateLimitDown: All transfers
+ *   - rateLimitIdentityUp / rateLimitIdentityDown: Each identity
+ *   - rateLimitContactUp / rateLimitContactDown: Each contact
+ */
+class RateLimiter
+{
+public:
+    enum class Direction {
+        UP,
+        DOWN
+    };
+
+    static RateLimiter& instance();
+
+    /*! Milliseconds to wait before the next block can be transferred.
+     *
+     * 0 means go ahead. The returned wait is added to the throttled time.
+     */
+    int getDelay(const Direction direction, const QUuid& identity,
+                 const QByteArray& contact);
+
+    /*! Account for bytes that were transferred */
+    void consume(const Direction direction, const QUuid& identity,
+                 const QByteArray& contact, const qint64 bytes);
+
+    /*! Total time in milliseconds that transfers were held back */
+    qint64 getThrottledTime(const Direction direction) const;
+    qint64 getThrottledTime(const Direction direction, const QByteArray& contact) const;
+
+private:
+    struct Bucket {
+        qint64 rate = 0; // Bytes per second. 0 is unlimited.
+        double tokens = 0;
+        qint64 lastRefill = -1;
+        qint64 throttledMs = 0;
+
+        void refill(const qint64 now, const qint64 newRate);
+        int getDelay() const;
+        void consume(const qint64 bytes);
+    };
+
+    using buckets_t = std::array<Bucket, 2>; // One for each direction
+
+    RateLimiter();
+    void reloadConfig();
+    qint64 getRate(const Direction direction, const int level) const;
+
+    QElapsedTimer clock_;
+    qint64 lastConfig_ = -1;
+    std::array<qint64, 6> rates_ = {}; // level * 2 + direction
+    std::array<qint64, 2> throttledMs_ = {}; // By any level
+    buckets_t global_;
+    std::map<QUuid, buckets_t> identities_;
+    std::map<QByteArray, buckets_t> contacts_;
+};
+
+}} // namespaces
+
+#endif // RATELIMITER_H
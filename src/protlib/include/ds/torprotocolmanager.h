@@ -1,6 +1,8 @@
 #ifndef TORPROTOCOLMANAGER_H
 #define TORPROTOCOLMANAGER_H
 
+#include <QDateTime>
+
 #include "ds/protocolmanager.h"
 #include "ds/tormgr.h"
 #include "ds/torserviceinterface.h"
@@ -34,6 +36,14 @@ protected:
     void setState(State state);
     ds::tor::TorConfig getConfig() const;
     TorServiceInterface& getService(const QUuid& service);
+    bool useSharedListener() const;
+    uint16_t getSharedListenerPort();
+    void onNewSharedConnection(const ConnectionSocket::ptr_t& connection);
+    void flushPendingStarts();
+    void flushPendingStops();
+    bool isDescriptorAvailable(const QByteArray& address) const;
+    QNetworkProxy getProxy(const core::ConnectData& cd);
+    static core::TransportHandle toTransportHandle(const ds::tor::ServiceProperties& service);
 
     std::unique_ptr<::ds::tor::TorMgr> tor_;
     QSettings& settings_;
@@ -41,6 +51,37 @@ protected:
 
     std::map<QUuid, TorServiceInterface::ptr_t> services_;
 
+    // Optional listener used by all the services, to avoid one
+    // listening socket and port per Identity.
+    std::shared_ptr<TorSocketListener> sharedListener_;
+
+    // Incoming connections on the shared listener that are not yet
+    // routed to a service.
+    std::map<QUuid, Peer::ptr_t> unroutedPeers_;
+
+    // Services requested in the same event-loop iteration are
+    // started as one pipelined batch.
+    QList<ds::tor::ServiceProperties> pendingStarts_;
+
+    // Same for services to stop, like when all the Identities go offline.
+    QList<QUuid> pendingStops_;
+
+    // Onion addresses (without ".onion") that Tor recently failed to find
+    // a descriptor for, and when.
+    QMap<QByteArray, QDateTime> missingDescriptors_;
+
+    // Where Tor listens for SOCKS connections. Reported by Tor
+    // after we connect to the control port.
+    QString socksHost_;
+    quint16 socksPort_ = 0;
+
+    // Used as the SOCKS password, so that the isolation is not
+    // shared with other applications or previous sessions.
+    const QByteArray socksNonce_;
+
+    // Counter to give each data connection its own circuits
+    quint64 dataConnections_ = 0;
+
     // ProtocolManager interface
 public slots:
     uint64_t sendAddme(const core::AddmeReq& req) override;
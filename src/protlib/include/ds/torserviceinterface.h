@@ -5,6 +5,7 @@
 
 #include <QObject>
 #include <QTcpSocket>
+#include <QNetworkProxy>
 #include <QUuid>
 
 #include "ds/protocolmanager.h"
@@ -12,6 +13,7 @@
 #include "ds/connectionsocket.h"
 #include "ds/dscert.h"
 #include "ds/peer.h"
+#include "ds/dsclient.h"
 
 namespace ds {
 namespace prot {
@@ -53,13 +55,25 @@ public:
      */
     StartServiceResult startService();
 
+    /*! Start a service that use a listener shared with other services.
+     * Any existing, private listener will be terminated.
+     */
+    StartServiceResult startSharedService(const uint16_t port);
+
+    /*! Take ownership of an incoming connection that was accepted
+     *  and identified by a shared listener.
+     */
+    void adoptIncomingPeer(const Peer::ptr_t& peer);
+
     /*! Stop the service if it is running */
     StopServiceResult stopService();
 
     /*! Connect to a Tor hidden service */
     core::PeerConnection::ptr_t connectToService(
             const QByteArray& host, const std::uint16_t port,
-            core::ConnectData cd);
+            core::ConnectData cd,
+            const QNetworkProxy& proxy,
+            DsClient::retry_gate_t retryGate = {});
 
     /*! Close / destroy the socket to a hidden service.
      *
@@ -73,6 +87,7 @@ public:
     ConnectionSocket& getSocket(const QUuid& uuid);
     ConnectionSocket::ptr_t getSocketPtr(const QUuid& uuid);
     const QString& getAddress() const noexcept { return address_; }
+    const crypto::DsCert::ptr_t& getCert() const noexcept { return cert_; }
     Peer::ptr_t getPeer(const QUuid& uuid) const;
 
 signals:
@@ -86,10 +101,12 @@ public slots:
 private slots:
     void onNewIncomingConnection(const ConnectionSocket::ptr_t& connection);
 
-
 private:
-    static QNetworkProxy& getTorProxy();
+    void routeIncomingPeer(const Peer::ptr_t& peer);
+    void adoptDataConnection(const Peer::ptr_t& peer);
+
 
+private:
     crypto::DsCert::ptr_t cert_;
     std::shared_ptr<TorSocketListener> server_;
     std::map<QUuid, Peer::ptr_t> peers_;
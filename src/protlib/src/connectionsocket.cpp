@@ -7,11 +7,22 @@ using namespace std;
 namespace ds {
 namespace prot {
 
+namespace {
+
+quint64 toCells(const qint64 bytes) {
+    return static_cast<quint64>((bytes + ConnectionSocket::cell_payload_bytes - 1)
+                                / ConnectionSocket::cell_payload_bytes);
+}
+
+} // anonymous namespace
+
+ConnectionSocket::CoalesceStats ConnectionSocket::totalStats_;
+
 ConnectionSocket::ConnectionSocket(QByteArray host,
                                    quint16 port, const QUuid &uuid)
     : host_{move(host)}, port_{port}
 {
-    setReadBufferSize(1024 * 64);
+    setReadBufferSize(minReadBuffer_);
 
     if (uuid.isNull()) {
         this->uuid = QUuid::createUuid();
@@ -28,9 +39,14 @@ ConnectionSocket::ConnectionSocket(QByteArray host,
 //    connect(this, SIGNAL(error(SocketError)),
 //            this, SLOT(onSocketFailed(SocketError)));
 
+    // We only read from the socket when the consumer wants more bytes.
+    // When it pauses, the data stays in the socket, so the sender will
+    // be slowed down.
     connect(this, &ConnectionSocket::readyRead, this, [this]() {
-        inData += readAll();
-        processInput();
+        if (bytesWanted_) {
+            readSome();
+            processInput();
+        }
     });
 
     connect(this, &ConnectionSocket::bytesWritten,
@@ -38,27 +54,198 @@ ConnectionSocket::ConnectionSocket(QByteArray host,
 
         Q_UNUSED(bytes)
 
-        if (outData.isEmpty()) {
+        // Frames we hold back for coalescing don't keep the producers waiting
+        if (outData.isEmpty() || coalesceTimer_.isActive()) {
             emit outputBufferEmptied();
         } else {
             sendMore();
         }
     });
 
+    coalesceTimer_.setSingleShot(true);
+    connect(&coalesceTimer_, &QTimer::timeout, this, [this]() {
+        sendMore();
+    });
+
+    // Started by readSome(), so idle connections don't have a running timer
+    adaptTimer_.setInterval(buffer_adapt_interval_ms);
+    connect(&adaptTimer_, &QTimer::timeout, this, &ConnectionSocket::adaptBuffers);
+
+    // Don't lose frames we hold back
+    connect(this, &ConnectionSocket::aboutToClose, this, [this]() {
+        coalesceTimer_.stop();
+        sendMore();
+    });
+
     LFLOG_TRACE << "Socket is constructed: " << uuid.toString();
 }
 
 ConnectionSocket::~ConnectionSocket()
 {
     LFLOG_TRACE << "Socket is destructed: " << uuid.toString();
+
+    if (coalesceDelay_ && stats_.frames) {
+        LFLOG_DEBUG << "Connection " << uuid.toString()
+                    << " sent " << stats_.frames << " frames in "
+                    << stats_.sentCells << " cells ("
+                    << stats_.framedCells << " cells without coalescing).";
+    }
+
+    if (laneBytes_[static_cast<size_t>(Lane::BULK)]) {
+        LFLOG_DEBUG << "Connection " << uuid.toString()
+                    << " wrote " << laneBytes_[static_cast<size_t>(Lane::INTERACTIVE)]
+                    << " interactive and " << laneBytes_[static_cast<size_t>(Lane::BULK)]
+                    << " bulk bytes.";
+    }
+}
+
+void ConnectionSocket::setCoalesceDelay(int delayMs)
+{
+    coalesceDelay_ = std::max(0, std::min(delayMs, max_coalesce_delay_ms));
+    if (!coalesceDelay_ && coalesceTimer_.isActive()) {
+        coalesceTimer_.stop();
+        sendMore();
+    }
+}
+
+void ConnectionSocket::setSendBufferLimit(qint64 bytes)
+{
+    sendBufferLimit_ = std::max<qint64>(0, bytes);
+
+    // Incoming sockets are connected when we get them
+    if (state() == ConnectedState) {
+        applySendBufferLimit();
+    }
+}
+
+void ConnectionSocket::applySendBufferLimit()
+{
+    if (sendBufferLimit_) {
+        setSocketOption(SendBufferSizeSocketOption, sendBufferLimit_);
+    }
+}
+
+void ConnectionSocket::writeFrame(const char *data, const qint64 bytes, const Lane lane)
+{
+    outData.append(data, static_cast<int>(bytes));
+    laneBytes_[static_cast<size_t>(lane)] += static_cast<quint64>(bytes);
+
+    ++stats_.frames;
+    ++totalStats_.frames;
+    stats_.framedCells += toCells(bytes);
+    totalStats_.framedCells += toCells(bytes);
+
+    if (!coalesceDelay_) {
+        sendMore();
+        return;
+    }
+
+    // Send the whole cells now, and hold the remainder
+    // until it fills a cell, or the delay expires.
+    const auto cells = outData.size() / cell_payload_bytes;
+    if (cells) {
+        sendMore(cells * cell_payload_bytes);
+    }
+
+    if (outData.isEmpty()) {
+        coalesceTimer_.stop();
+    } else if (!coalesceTimer_.isActive()) {
+        coalesceTimer_.start(coalesceDelay_);
+    }
 }
 
 void ConnectionSocket::wantBytes(size_t bytesRequested)
 {
     bytesWanted_ = bytesRequested;
+    if (bytesWanted_ && (static_cast<size_t>(inData.size()) < bytesWanted_)
+            && bytesAvailable()) {
+        readSome();
+    }
     processInput();
 }
 
+void ConnectionSocket::setReadBufferLimits(qint64 minBytes, qint64 maxBytes)
+{
+    minReadBuffer_ = std::max<qint64>(1024, minBytes);
+    maxReadBuffer_ = std::max(minReadBuffer_, maxBytes);
+    setReadBufferSize(std::max(minReadBuffer_, std::min(readBufferSize(), maxReadBuffer_)));
+}
+
+void ConnectionSocket::setMaxFrameSize(qint64 bytes)
+{
+    maxFrameBytes_ = bytes;
+}
+
+void ConnectionSocket::readSome()
+{
+    // If the buffer was full, Qt stopped reading from the OS
+    if (bytesAvailable() >= readBufferSize()) {
+        readBufferFull_ = true;
+    }
+
+    const auto data = readAll();
+    bytesRead_ += static_cast<quint64>(data.size());
+    inData += data;
+
+    if (!data.isEmpty() && !adaptTimer_.isActive()) {
+        adaptTimer_.start();
+    }
+}
+
+void ConnectionSocket::adaptBuffers()
+{
+    const auto bytes = static_cast<qint64>(bytesRead_ - lastBytesRead_);
+    lastBytesRead_ = bytesRead_;
+
+    const auto current = readBufferSize();
+
+    // Room for about 1/8 second of data at the current rate
+    auto wanted = minReadBuffer_;
+    while ((wanted < maxReadBuffer_)
+           && (wanted < (bytes * 1000 / buffer_adapt_interval_ms / 8))) {
+        wanted *= 2;
+    }
+
+    if (readBufferFull_) {
+        wanted = std::max(wanted, current * 2);
+        readBufferFull_ = false;
+    }
+
+    // Grow at once, shrink gradually
+    if (wanted < current) {
+        wanted = std::max(wanted, current / 2);
+    }
+
+    wanted = std::max(minReadBuffer_, std::min(wanted, maxReadBuffer_));
+    if (wanted != current) {
+        LFLOG_TRACE << "Changing the read buffer on connection " << uuid.toString()
+                    << " from " << current << " to " << wanted << " bytes.";
+        setReadBufferSize(wanted);
+    }
+
+    // Release the memory used by idle connections
+    if (!bytes) {
+        if (inData.isEmpty()) {
+            inData.squeeze();
+        }
+        if (outData.isEmpty()) {
+            outData.squeeze();
+        }
+
+        // Nothing more to adapt until we read again
+        if (wanted == minReadBuffer_) {
+            adaptTimer_.stop();
+        }
+    }
+}
+
+size_t ConnectionSocket::getMaxInDataSize() const noexcept
+{
+    // We only read when we have less than the frame we want,
+    // and each read is limited by the read buffer.
+    return static_cast<size_t>(maxReadBuffer_ + maxFrameBytes_);
+}
+
 void ConnectionSocket::connectToDefaultHost()
 {
     connectToHost(host_, port_);
@@ -68,6 +255,7 @@ void ConnectionSocket::onConnected()
 {
     LFLOG_DEBUG << "Socket on connection " << uuid.toString()
                 << " is connected.";
+    applySendBufferLimit();
     emit connectedToHost(uuid);
 }
 
@@ -76,6 +264,8 @@ void ConnectionSocket::onDisconnected()
     LFLOG_DEBUG << "Socket on connection " << uuid.toString()
                 << " was disconnected.";
 
+    adaptTimer_.stop();
+
     emit disconnectedFromHost(uuid);
 }
 
@@ -108,7 +298,7 @@ void ConnectionSocket::processInput()
     }
 
     // This should never happen, but just in case...
-    if (static_cast<size_t>(inData.size()) > maxInDataSize) {
+    if (static_cast<size_t>(inData.size()) > getMaxInDataSize()) {
         LFLOG_ERROR << "To much data ("
                    << inData.size()
                    << ") in incoming buffer on " << getUuid().toString();
@@ -118,12 +308,20 @@ void ConnectionSocket::processInput()
 
 void ConnectionSocket::sendMore()
 {
-    if (outData.isEmpty()) {
+    sendMore(outData.size());
+}
+
+void ConnectionSocket::sendMore(const qint64 bytes)
+{
+    if (outData.isEmpty() || !bytes) {
         return;
     }
 
-    auto written = QTcpSocket::write(outData);
+    auto written = QTcpSocket::write(outData.constData(), bytes);
     if (written > 0) {
+        stats_.sentCells += toCells(written);
+        totalStats_.sentCells += toCells(written);
+
         if (written == outData.size()) {
             outData.clear();
         } else {
@@ -22,6 +22,11 @@ DsClient::DsClient(ConnectionSocket::ptr_t connection,
 
 void DsClient::advance()
 {
+    if (inState_ == InState::CLOSING) {
+        // The dial was cancelled. Don't spend a handshake on it.
+        return;
+    }
+
     switch(state_) {
         case State::CONNECTED:
             LFLOG_DEBUG << "Connected to " << connectionData_.address
@@ -37,6 +42,10 @@ void DsClient::advance()
 
 void DsClient::advance(const Peer::data_t &data)
 {
+    if (inState_ == InState::CLOSING) {
+        return;
+    }
+
     switch(state_) {
     case State::ENCRYPTED_STREAM:
             processStream(data);
@@ -62,7 +71,8 @@ void DsClient::sayHello()
     }
 
     Hello hello;
-    hello.version.at(0) = '\1'; // Version of the hello structure
+    // Version of the hello structure. Version 2 announces a data connection.
+    hello.version.at(0) = dataConnection_ ? '\2' : '\1';
 
     prepareEncryption(stateOut, hello.header, hello.key);
 
@@ -130,17 +140,28 @@ void DsClient::getHelloReply(const Peer::data_t &data)
     emit connectedToPeer(shared_from_this());
 }
 
-void DsClient::startConnectRetryTimer()
+void DsClient::startConnectRetryTimer(const bool countAttempt)
 {
-    if (++numReconnects_ > maxReconnects_) {
+    if (countAttempt && (++numReconnects_ > maxReconnects_)) {
         LFLOG_DEBUG << "Unable to connect on connection " << getConnectionId().toString();
         emit closeLater();
         return;
     }
     QTimer::singleShot(reconnectDelayMilliseconds_, this, [this]() {
         if (!notificationsDisabled_
+                && (inState_ != InState::CLOSING)
                 && ((connection_->state() == QAbstractSocket::ConnectingState)
                  || (connection_->state() == QAbstractSocket::UnconnectedState))) {
+
+            if (retryGate_ && !retryGate_()) {
+                LFLOG_DEBUG << "Skipping reconnect on connection " << getConnectionId().toString()
+                            << ". The hidden service is not published.";
+
+                // We did not dial, so this does not use up a retry
+                startConnectRetryTimer(false);
+                return;
+            }
+
             LFLOG_DEBUG << "Retrying connect on connection " << getConnectionId().toString();
 
             auto connection = make_shared<ConnectionSocket>(
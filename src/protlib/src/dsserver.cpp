@@ -27,6 +27,13 @@ DsServer::DsServer(ds::prot::ConnectionSocket::ptr_t
     // TODO: Set up a timer so we time out if things don't progress
 }
 
+DsServer::DsServer(ConnectionSocket::ptr_t connection,
+                   DsServer::identities_fn_t identities)
+    : DsServer{move(connection), core::ConnectData{}}
+{
+    identities_ = move(identities);
+}
+
 void DsServer::authorize(bool authorize)
 {
     if (!authorize) {
@@ -95,14 +102,14 @@ void DsServer::getHello(const data_t& data)
     Hello hello;
     assert(hello.buffer.size() == data.size() - crypto_box_SEALBYTES);
 
-    if (!connectionData_.identitysCert->decrypt(hello.buffer, data)) {
+    if (!decryptHello(hello, data)) {
         LFLOG_ERROR << "Failed to decrypt hello payload from " << connection_->getUuid().toString();
         connection_->close();
         return;
     }
     
-    // Check version
-    if (hello.version.at(0) != 1) {
+    // Check version. Version 2 is a data connection for a striped transfer.
+    if (hello.version.at(0) != 1 && hello.version.at(0) != 2) {
         LFLOG_ERROR << "Unsupported Hello version "
                     << static_cast<unsigned int>(hello.version.at(0))
                     << " from " << connection_->getUuid().toString();
@@ -122,6 +129,7 @@ void DsServer::getHello(const data_t& data)
     }
 
     connectionData_.contactsCert = crypto::DsCert::createFromPubkey(hello.pubkey.toByteArray());
+    dataConnection_ = (hello.version.at(0) == 2);
 
     // At this point, any further inbound data is assumed to be encrypted
     prepareDecryption(stateIn, hello.header, hello.key);
@@ -138,4 +146,25 @@ void DsServer::getHello(const data_t& data)
     emit incomingPeer(shared_from_this());
 }
 
+bool DsServer::decryptHello(Hello& hello, const data_t& data)
+{
+    if (!identities_) {
+        return connectionData_.identitysCert->decrypt(hello.buffer, data);
+    }
+
+    // Shared listener. The first identity that can open the payload owns the connection.
+    for(const auto& cd : identities_()) {
+        if (cd.identitysCert && cd.identitysCert->decrypt(hello.buffer, data)) {
+            connectionData_.identitysCert = cd.identitysCert;
+            connectionData_.service = cd.service;
+
+            LFLOG_TRACE << "Connection " << connection_->getUuid().toString()
+                        << " was routed to service " << cd.service.toString();
+            return true;
+        }
+    }
+
+    return false;
+}
+
 }} // namespaces
@@ -1,8 +1,14 @@
 #include <array>
+#include <atomic>
 #include <algorithm>
+#include <iterator>
+#include <map>
+#include <set>
 #include <vector>
 #include <cassert>
 #include <regex>
+#include <cerrno>
+#include <cstring>
 
 #include <sodium.h>
 
@@ -10,6 +16,11 @@
 #include <QJsonObject>
 #include <QtEndian>
 
+#ifdef Q_OS_UNIX
+#   include <fcntl.h>
+#   include <unistd.h>
+#endif
+
 #include "ds/peer.h"
 #include "ds/message.h"
 #include "ds/errors.h"
@@ -17,6 +28,8 @@
 #include "ds/dsengine.h"
 #include "ds/imageutil.h"
 #include "ds/bytes.h"
+#include "ds/crypto.h"
+#include "ds/task.h"
 
 #include "logfault/logfault.h"
 
@@ -35,6 +48,18 @@ const std::map<QString, Message::Encoding>  encoding_lookup = {
 
 class IncomingFileChannel : public Peer::Channel {
 public:
+    // Writes are done in multiples of this size
+    static constexpr qint64 write_alignment = 1024 * 64;
+
+    // Ranges of a striped transfer to acknowledge in one message
+    static constexpr size_t acks_per_message = 32;
+
+    enum class SyncPolicy {
+        NONE,       // Leave it to the OS
+        COMPLETE,   // Sync when the file is complete
+        INTERVAL    // Sync for every syncInterval_ bytes, and when complete
+    };
+
     IncomingFileChannel(const core::File::ptr_t& file)
         : io_{file->getDownloadPath()}
         , file_{file}
@@ -46,33 +71,142 @@ public:
             throw Error("Failed to open file");
         }
 
+        auto& settings = DsEngine::instance().settings();
+        writeBehind_ = max(write_alignment,
+                           settings.value("fileWriteBehind", 1024 * 1024).toLongLong()
+                           / write_alignment * write_alignment);
+
+        const auto policy = settings.value("fileSyncPolicy", "complete").toString();
+        if (policy == "none") {
+            syncPolicy_ = SyncPolicy::NONE;
+        } else if (policy == "interval") {
+            syncPolicy_ = SyncPolicy::INTERVAL;
+            syncInterval_ = max<qint64>(1, settings.value("fileSyncIntervalMb", 64).toLongLong())
+                    * 1024 * 1024;
+        }
+
+        preallocate();
+
         file->setBytesTransferred(0);
+        clock_.start();
 
         LFLOG_DEBUG << "Opened file #" << file->getId()
                     << " with path \"" << file->getDownloadPath()
                     << " for WRITE for incoming transfer";
     }
 
+    ~IncomingFileChannel() override {
+        if (io_.isOpen()) {
+            // The transfer was aborted. Keep what we got.
+            try {
+                flush(true);
+            } catch(const std::exception& ex) {
+                LFLOG_WARN << "Failed to flush \"" << file_->getDownloadPath()
+                           << "\": " << ex.what();
+            }
+        }
+    }
+
     // Channel interface
 public:
-    void onIncoming(Peer &peer, const quint64 id,
+    void onIncoming(Peer &peer, const quint64 id, const qint64 offset,
                     const Peer::mview_t& data,
                     const bool final) override {
         Q_UNUSED(peer);
-        if (io_.write(reinterpret_cast<const char *>(data.cdata()),
-                      static_cast<qint64>(data.size())) != static_cast<qint64>(data.size())) {
-            LFLOG_ERROR << "Failed to write chunk "
-                        << id << " to \"" << file_->getDownloadPath()
-                        << "\" for write: " << io_.errorString();
-            throw Error("Failed to write to file");
+
+        qint64 pos = nextOffset_;
+        if (offset != Peer::no_offset) {
+            // Striped transfer. The ranges may arrive in any order,
+            // over any of the connections.
+            if ((offset < 0)
+                    || ((offset + static_cast<qint64>(data.size())) > file_->getSize())) {
+                LFLOG_ERROR << "Chunk " << id << " for \"" << file_->getDownloadPath()
+                            << "\" is outside the file. offset=" << offset;
+                throw Error("Invalid range");
+            }
+
+            if (!ranged_ && nextOffset_) {
+                throw Error("Range after sequential data");
+            }
+
+            const auto end = offset + static_cast<qint64>(data.size());
+            if (!addReceived(offset, end)) {
+                if (isReceived(offset, end)) {
+                    // Sent again after a data connection was lost, before our ack arrived
+                    LFLOG_DEBUG << "Ignoring chunk " << id << " for \"" << file_->getDownloadPath()
+                                << "\" that we already have. offset=" << offset;
+                    acks_.push_back(offset);
+                    sendAcks(peer);
+                    return;
+                }
+
+                LFLOG_ERROR << "Chunk " << id << " for \"" << file_->getDownloadPath()
+                            << "\" overlaps data we already have. offset=" << offset;
+                throw Error("Overlapping range");
+            }
+
+            acks_.push_back(offset);
+
+            ranged_ = true;
+            pos = offset;
+        } else if (ranged_) {
+            throw Error("Sequential data in a striped transfer");
+        }
+
+        // Coalesce contiguous chunks into large writes. The stripes
+        // interleave, so we keep one run for each gap-free range.
+        buffer(pos, reinterpret_cast<const char *>(data.cdata()),
+               static_cast<int>(data.size()));
+        nextOffset_ = pos + static_cast<qint64>(data.size());
+
+        if (pendingBytes_ >= writeBehind_) {
+            flush(false);
+
+            // Many short runs. Don't let them grow without limit.
+            if (pendingBytes_ >= writeBehind_) {
+                flush(true);
+            }
         }
 
         file_->addBytesTransferred(data.size());
 
-        if (final) {
-            io_.flush();
-            io_.close();
-            file_->validateHash();
+        const bool done = ranged_
+                ? (file_->getBytesTransferred() >= file_->getSize())
+                : final;
+
+        // The sender keeps the ranges until we ack them
+        if (done || (acks_.size() >= acks_per_message)) {
+            sendAcks(peer);
+        }
+
+        if (done) {
+            flush(true);
+
+            // Check the hash when the data is on the disk
+            auto validate = [file = file_](const bool synced) {
+                if (file->getState() != File::FS_TRANSFERRING) {
+                    return; // Cancelled while we synced
+                }
+                if (synced) {
+                    file->validateHash();
+                } else {
+                    file->transferFailed("Failed to sync file");
+                }
+            };
+
+            if (syncPolicy_ != SyncPolicy::NONE) {
+                sync(move(validate));
+                io_.close();
+            } else {
+                io_.close();
+                validate(true);
+            }
+
+            const auto elapsed = max<qint64>(1, clock_.elapsed());
+            LFLOG_DEBUG << "Received " << bytesWritten_ << " bytes for \""
+                        << file_->getDownloadPath() << "\" in " << writes_
+                        << " writes and " << syncs_ << " syncs at "
+                        << (bytesWritten_ * 1000 / elapsed / 1024) << " KB/s.";
         }
     }
 
@@ -83,15 +217,260 @@ public:
     }
 
 private:
+    // Tell the sender which ranges we have, so it can forget them
+    void sendAcks(Peer& peer) {
+        if (acks_.empty()) {
+            return;
+        }
+
+        QByteArray offsets;
+        offsets.reserve(static_cast<int>(acks_.size() * 8));
+        for(const auto offset : acks_) {
+            const auto value = qToBigEndian(static_cast<quint64>(offset));
+            offsets.append(reinterpret_cast<const char *>(&value), sizeof(value));
+        }
+        acks_.clear();
+
+        peer.send(QJsonDocument{
+                      QJsonObject{
+                          {"type", "RangeAck"},
+                          {"channel", QString::number(file_->getChannel())},
+                          {"offsets", QString{offsets.toBase64()}}
+                      }
+                  });
+    }
+
+    // True if [begin, end) is inside one of the ranges we have received
+    bool isReceived(const qint64 begin, const qint64 end) const {
+        auto it = received_.upper_bound(begin);
+        if (it == received_.begin()) {
+            return false;
+        }
+        --it;
+        return (it->first <= begin) && (it->second >= end);
+    }
+
+    // Reserve the disk-space, so the file is not fragmented by the random writes
+    void preallocate() {
+#ifdef Q_OS_LINUX
+        if (file_->getSize() <= 0) {
+            return;
+        }
+
+        const auto err = posix_fallocate(io_.handle(), 0, static_cast<off_t>(file_->getSize()));
+        if (err) {
+            // Not supported by all file-systems. We can still write the file.
+            LFLOG_DEBUG << "Failed to preallocate " << file_->getSize()
+                        << " bytes for \"" << file_->getDownloadPath()
+                        << "\": " << strerror(err);
+        }
+#endif
+    }
+
+    // Add [begin, end) to the ranges we have received.
+    // Returns false if it intersects any of them.
+    bool addReceived(const qint64 begin, const qint64 end) {
+        auto next = received_.upper_bound(begin);
+        if ((next != received_.end()) && (next->first < end)) {
+            return false;
+        }
+
+        if (next != received_.begin()) {
+            const auto prev = std::prev(next);
+            if (prev->second > begin) {
+                return false;
+            }
+
+            if (prev->second == begin) {
+                // Extend the previous range, and join it with the next if the gap is gone
+                prev->second = end;
+                if ((next != received_.end()) && (next->first == end)) {
+                    prev->second = next->second;
+                    received_.erase(next);
+                }
+                return true;
+            }
+        }
+
+        if ((next != received_.end()) && (next->first == end)) {
+            const auto nextEnd = next->second;
+            received_.erase(next);
+            received_.emplace(begin, nextEnd);
+            return true;
+        }
+
+        received_.emplace(begin, end);
+        return true;
+    }
+
+    // Append to the run that ends at pos, or start a new run.
+    // The range must not overlap any data we have.
+    void buffer(const qint64 pos, const char *data, const int size) {
+        auto next = pending_.lower_bound(pos);
+        assert((next == pending_.end()) || (next->first >= (pos + size)));
+
+        auto run = pending_.end();
+        if (next != pending_.begin()) {
+            const auto prev = std::prev(next);
+            if ((prev->first + prev->second.size()) == pos) {
+                run = prev;
+            }
+        }
+
+        if (run == pending_.end()) {
+            run = pending_.emplace_hint(next, pos, QByteArray{});
+        }
+
+        run->second.append(data, size);
+        pendingBytes_ += size;
+
+        // The gap to the next run may now be filled
+        if ((next != pending_.end())
+                && (next->first == (run->first + run->second.size()))) {
+            run->second.append(next->second);
+            pending_.erase(next);
+        }
+    }
+
+    // If all is false, we only write whole blocks, and keep the rest.
+    void flush(const bool all) {
+        for(auto it = pending_.begin(); it != pending_.end();) {
+            const auto size = static_cast<qint64>(it->second.size());
+            const auto bytes = all ? size : size / write_alignment * write_alignment;
+
+            if (!bytes) {
+                ++it;
+                continue;
+            }
+
+            write(it->first, it->second.constData(), bytes);
+
+            if (bytes == size) {
+                it = pending_.erase(it);
+                continue;
+            }
+
+            // Keep the rest, at its new offset
+            const auto offset = it->first + bytes;
+            auto rest = it->second.mid(static_cast<int>(bytes));
+            it = pending_.erase(it);
+            it = pending_.emplace_hint(it, offset, move(rest));
+            ++it;
+        }
+    }
+
+    void write(const qint64 offset, const char *data, const qint64 bytes) {
+        QElapsedTimer timer;
+        timer.start();
+
+        if (!io_.seek(offset)) {
+            LFLOG_ERROR << "Failed to seek to " << offset
+                        << " in \"" << file_->getDownloadPath()
+                        << "\": " << io_.errorString();
+            throw Error("Failed to seek in file");
+        }
+
+        if (io_.write(data, bytes) != bytes) {
+            LFLOG_ERROR << "Failed to write " << bytes << " bytes at offset "
+                        << offset << " to \"" << file_->getDownloadPath()
+                        << "\": " << io_.errorString();
+            throw Error("Failed to write to file");
+        }
+
+        DsEngine::instance().getTransferScheduler()->reportDiskIo(timer.nsecsElapsed() / 1000);
+
+        ++writes_;
+        bytesWritten_ += bytes;
+        pendingBytes_ -= bytes;
+
+        if (syncState_->failed) {
+            throw Error("Failed to sync file");
+        }
+
+        // If the last sync is still running, the next write tries again
+        if ((syncPolicy_ == SyncPolicy::INTERVAL)
+                && ((bytesWritten_ - lastSync_) >= syncInterval_)
+                && !syncState_->running) {
+            sync();
+        }
+    }
+
+    /* fsync() may block for seconds on a busy disk. It runs in the thread
+     * pool, on a duplicate of the file handle, so we can go on receiving,
+     * or close the file. done is called on the GUI thread when the sync
+     * is finished, with false if it failed.
+     */
+    void sync(std::function<void (bool synced)> done = {}) {
+        if (!io_.flush()) {
+            LFLOG_ERROR << "Failed to flush \"" << file_->getDownloadPath()
+                        << "\": " << io_.errorString();
+            throw Error("Failed to write to file");
+        }
+
+        lastSync_ = bytesWritten_;
+        ++syncs_;
+
+#ifdef Q_OS_UNIX
+        const auto fd = dup(io_.handle());
+        if (fd < 0) {
+            LFLOG_ERROR << "Failed to sync \"" << file_->getDownloadPath()
+                        << "\": " << strerror(errno);
+            throw Error("Failed to sync file");
+        }
+
+        syncState_->running = true;
+        Task::schedule([fd, state = syncState_, file = file_, done = move(done)] {
+            const bool synced = fsync(fd) == 0;
+            if (!synced) {
+                LFLOG_ERROR << "Failed to sync \"" << file->getDownloadPath()
+                            << "\": " << strerror(errno);
+                state->failed = true;
+            }
+            ::close(fd);
+            state->running = false;
+
+            if (done) {
+                QMetaObject::invokeMethod(file.get(), [done, synced] {
+                    done(synced);
+                }, Qt::QueuedConnection);
+            }
+        });
+#else
+        if (done) {
+            done(true);
+        }
+#endif
+    }
+
     QFile io_;
     File::ptr_t file_;
+    bool ranged_ = false;
+    std::map<qint64, QByteArray> pending_; // Gap-free runs, by file offset
+    std::map<qint64, qint64> received_; // Ranges received in a striped transfer, begin -> end
+    std::vector<qint64> acks_; // Offsets of received ranges we have not acknowledged
+    qint64 pendingBytes_ = {};
+    qint64 nextOffset_ = {}; // For sequential data
+    qint64 writeBehind_ = {};
+    SyncPolicy syncPolicy_ = SyncPolicy::COMPLETE;
+    qint64 syncInterval_ = {};
+    qint64 lastSync_ = {};
+    struct SyncState {
+        std::atomic_bool running{false};
+        std::atomic_bool failed{false};
+    };
+    std::shared_ptr<SyncState> syncState_ = std::make_shared<SyncState>();
+    QElapsedTimer clock_;
+    qint64 bytesWritten_ = {};
+    quint64 writes_ = {};
+    quint64 syncs_ = {};
 };
 
 class OutgoingFileChannel : public Peer::Channel {
 public:
-    OutgoingFileChannel(const core::File::ptr_t& file)
+    OutgoingFileChannel(const core::File::ptr_t& file, const bool ranged)
         : io_{file->getPath()}
         , file_{file}
+        , ranged_{ranged}
     {
         assert(file->getDirection() == File::OUTGOING);
         if (!io_.open(QIODevice::ReadOnly)) {
@@ -109,18 +488,32 @@ public:
 
     // Channel interface
 public:
-    void onIncoming(Peer &peer, const quint64 id, const Peer::mview_t &data,
-                    const bool final) override {
+    void onIncoming(Peer &peer, const quint64 id, const qint64 offset,
+                    const Peer::mview_t &data, const bool final) override {
         Q_UNUSED(peer);
         Q_UNUSED(id)
+        Q_UNUSED(offset)
         Q_UNUSED(data)
         Q_UNUSED(final)
         assert(false);
     }
 
+    // For striped transfers, peer may be any of the connections
+    // to the contact. Each call sends the next range of the file.
     uint64_t onOutgoing(Peer &peer) override {
 
+        if (done_) {
+            return {};
+        }
+
+        if (ranged_) {
+            return sendNextRange(peer);
+        }
+
+        QElapsedTimer timer;
+        timer.start();
         auto bytesRead = io_.read(buffer_.data(), static_cast<int>(buffer_.size()));
+        DsEngine::instance().getTransferScheduler()->reportDiskIo(timer.nsecsElapsed() / 1000);
         if (bytesRead < 0) {
             LFLOG_ERROR << "Failed to read chunk from file \"" << file_->getPath()
                         << "\": " << io_.errorString();
@@ -130,23 +523,122 @@ public:
 
         const bool finished = io_.atEnd();
 
-        auto rval = peer.send(buffer_.data(),
-                  static_cast<size_t>(bytesRead),
-                  file_->getChannel(), finished);
+        auto rval = peer.send(buffer_.data(), static_cast<size_t>(bytesRead),
+                              file_->getChannel(), finished);
 
         file_->addBytesTransferred(static_cast<size_t>(bytesRead));
 
         if (finished) {
+            done_ = true;
             file_->transferComplete();
         }
 
         return rval;
     }
 
+    void onAck(Peer &peer, const QByteArray &offsets) override {
+        Q_UNUSED(peer)
+
+        if (!ranged_ || done_) {
+            return;
+        }
+
+        for(int i = 0; (i + 8) <= offsets.size(); i += 8) {
+            quint64 value = {};
+            memcpy(&value, offsets.constData() + i, sizeof(value));
+            const auto offset = static_cast<qint64>(qFromBigEndian(value));
+
+            // A range may be acked after we decided to send it again
+            if (!inFlight_.erase(offset) && !retry_.erase(offset)) {
+                continue; // Already acked
+            }
+
+            const auto bytes = rangeSize(offset);
+            acked_ += bytes;
+            file_->addBytesTransferred(static_cast<size_t>(bytes));
+        }
+
+        if (acked_ >= file_->getSize()) {
+            done_ = true;
+            file_->transferComplete();
+        }
+    }
+
+    bool onDisconnected(const QUuid &connection) override {
+        bool lost = false;
+        for(auto it = inFlight_.begin(); it != inFlight_.end();) {
+            if (it->second == connection) {
+                retry_.insert(it->first);
+                it = inFlight_.erase(it);
+                lost = true;
+            } else {
+                ++it;
+            }
+        }
+
+        if (lost) {
+            LFLOG_DEBUG << "Will send " << retry_.size() << " ranges of \""
+                        << file_->getPath() << "\" again. A data connection was lost.";
+        }
+
+        return lost;
+    }
+
 private:
+    qint64 rangeSize(const qint64 offset) const {
+        return min<qint64>(static_cast<qint64>(buffer_.size()), file_->getSize() - offset);
+    }
+
+    // Ranges lost with a connection go first. The transfer is complete
+    // when the receiver has acked all the ranges.
+    uint64_t sendNextRange(Peer& peer) {
+        const bool retry = !retry_.empty();
+        qint64 offset = {};
+        if (retry) {
+            offset = *retry_.begin();
+        } else if (nextOffset_ < file_->getSize()) {
+            offset = nextOffset_;
+        } else {
+            return {}; // Waiting for acks
+        }
+
+        const auto bytes = rangeSize(offset);
+        QElapsedTimer timer;
+        timer.start();
+        const bool ok = io_.seek(offset) && (io_.read(buffer_.data(), bytes) == bytes);
+        DsEngine::instance().getTransferScheduler()->reportDiskIo(timer.nsecsElapsed() / 1000);
+        if (!ok) {
+            LFLOG_ERROR << "Failed to read chunk from file \"" << file_->getPath()
+                        << "\": " << io_.errorString();
+            file_->transferFailed("Disk Read Error");
+            return {};
+        }
+
+        const auto rval = peer.sendRange(buffer_.data(), static_cast<size_t>(bytes),
+                                         file_->getChannel(), offset,
+                                         (offset + bytes) == file_->getSize());
+
+        if (retry) {
+            retry_.erase(retry_.begin());
+        } else {
+            nextOffset_ += bytes;
+        }
+        inFlight_[offset] = peer.getConnectionId();
+
+        return rval;
+    }
+
     QFile io_;
     File::ptr_t file_;
+    const bool ranged_;
+    bool done_ = false;
     std::array<char, 1024 * 8> buffer_ = {};
+
+    // Striped transfers
+    qint64 nextOffset_ = {}; // Next range we have not sent
+    qint64 acked_ = {};
+    std::map<qint64, QUuid> inFlight_; // Sent, but not acked. offset -> connection
+    std::set<qint64> retry_; // Lost with a connection. Must be sent again
 };
 
 
@@ -163,6 +655,7 @@ Message::Encoding toEncoding(const QString& name) {
 Peer::Peer(ConnectionSocket::ptr_t connection,
            core::ConnectData connectionData)
     : connection_{move(connection)}, connectionData_{move(connectionData)}
+    , dataConnection_{!connectionData_.transfer.isNull()}
     , uuid_{connection_->getUuid()}
 {
     useConnection(connection.get());
@@ -170,6 +663,12 @@ Peer::Peer(ConnectionSocket::ptr_t connection,
             this, &Peer::onCloseLater,
             Qt::QueuedConnection);
 
+    clock_.start();
+    connect(&probeTimer_, &QTimer::timeout, this, &Peer::probe);
+    connect(this, &PeerConnection::connectedToPeer, this, [this]() {
+        startProbing();
+    });
+
     connect(this, &Peer::removeTransfer,
             this, [this](core::File::Direction direction, const quint32 id){
 
@@ -181,6 +680,8 @@ Peer::Peer(ConnectionSocket::ptr_t connection,
         } else {
             outChannels_.erase(id);
         }
+
+        closeDataConnections(direction, id);
     }, Qt::QueuedConnection);
 }
 
@@ -204,6 +705,19 @@ uint64_t Peer::send(const QJsonDocument &json)
 
 uint64_t Peer::send(const void *data, const size_t bytes,
                     const quint32 ch, const bool eof )
+{
+    return sendChunk(data, bytes, ch, no_offset, eof);
+}
+
+uint64_t Peer::sendRange(const void *data, const size_t bytes, const quint32 ch,
+                         const qint64 offset, const bool eof)
+{
+    assert(offset >= 0);
+    return sendChunk(data, bytes, ch, offset, eof);
+}
+
+uint64_t Peer::sendChunk(const void *data, const size_t bytes,
+                         const quint32 ch, const qint64 offset, const bool eof)
 {
     const unsigned char tag = eof
             ? crypto_secretstream_xchacha20poly1305_TAG_PUSH
@@ -215,23 +729,33 @@ uint64_t Peer::send(const void *data, const size_t bytes,
 
     // Data format:
     // Two bytes length | one byte version | four bytes channel | 8 bytes id | data
+    //
+    // Version 2 (ranges of striped transfers):
+    // Two bytes length | one byte version | four bytes channel | 8 bytes id | 8 bytes offset | data
 
     // The length is encrypted individually to allow the peer to read it before
     // fetching the payload.
 
-    const size_t len = 1 + 4 + 8 + static_cast<size_t>(bytes);
+    const bool ranged = (offset != no_offset);
+    const size_t offset_len = ranged ? 8 : 0;
+    const size_t len = 1 + 4 + 8 + offset_len + static_cast<size_t>(bytes);
+
+    // The encrypted length and payload are written as one frame
     vector<uint8_t> payload_len(2),
             buffer(len),
-            cipherlen(2 + crypt_bytes),
-            ciphertext(len + crypt_bytes);
+            frame(2 + crypt_bytes + len + crypt_bytes);
+    mview_t cipherlen{frame.data(), 2 + crypt_bytes};
+    mview_t ciphertext{cipherlen.end(), len + crypt_bytes};
     mview_t version{buffer.data(), 1};
     mview_t channel{version.end(), 4};
     mview_t id{channel.end(), 8};
-    mview_t payload{id.end(), bytes};
+    mview_t range{id.end(), offset_len};
+    mview_t payload{range.end(), bytes};
 
     assert(buffer.size() == (+ version.size()
                              + channel.size()
                              + id.size()
+                             + range.size()
                              + payload.size()));
 
     static_assert(sizeof(decltype(qToBigEndian(static_cast<quint16>(len)))) == sizeof(quint16),
@@ -239,10 +763,13 @@ uint64_t Peer::send(const void *data, const size_t bytes,
 
     valueToBytes(qToBigEndian(static_cast<quint16>(len)), payload_len);
 
-    version.at(0) = '\1';
+    version.at(0) = ranged ? '\2' : '\1';
 
     valueToBytes(qToBigEndian(static_cast<quint32>(ch)), channel);
     valueToBytes(qToBigEndian(static_cast<quint64>(++request_id_)), id);
+    if (ranged) {
+        valueToBytes(qToBigEndian(static_cast<quint64>(offset)), range);
+    }
 
     assert(bytes == payload.size());
     memcpy(payload.data(), data, payload.size());
@@ -257,8 +784,6 @@ uint64_t Peer::send(const void *data, const size_t bytes,
         throw runtime_error("Stream encryption failed");
     }
 
-    connection_->write(cipherlen);
-
     LFLOG_TRACE << "Sending chunk #"
                 << request_id_
                 << " with payload of "
@@ -275,13 +800,43 @@ uint64_t Peer::send(const void *data, const size_t bytes,
         throw runtime_error("Stream encryption failed");
     }
 
-    connection_->write(ciphertext);
+    // File data goes in the bulk lane, so it can't delay the requests
+    connection_->write(frame, ch ? ConnectionSocket::Lane::BULK
+                                 : ConnectionSocket::Lane::INTERACTIVE);
+
+    if (ch) {
+        RateLimiter::instance().consume(RateLimiter::Direction::UP, getIdentityId(),
+                                        getRateLimitKey(), static_cast<qint64>(bytes));
+    }
+
     return request_id_;
 }
 
-void Peer::onReceivedData(const quint32 channel, const quint64 id,
+void Peer::onReceivedData(const quint32 channel, const quint64 id, const qint64 offset,
                           const Peer::mview_t& data, const bool final)
 {
+    if (dataConnection_) {
+        if (channel == 0) {
+            onReceivedBind(data);
+            return;
+        }
+
+        if (!boundChannel_ || (channel != boundChannel_)) {
+            LFLOG_WARN << "Data connection " << getConnectionId().toString()
+                       << " sent data to channel #" << channel
+                       << " that it is not bound to.";
+            throw Error("Data to unbound channel");
+        }
+
+        auto primary = primary_.lock();
+        if (!primary) {
+            throw Error("The primary connection is gone");
+        }
+
+        primary->onReceivedData(channel, id, offset, data, final);
+        return;
+    }
+
     if (channel == 0) {
         onReceivedJson(channel, data);
     } else {
@@ -301,7 +856,7 @@ void Peer::onReceivedData(const quint32 channel, const quint64 id,
             channelInstance = it->second;
         }
 
-        it->second->onIncoming(*this, id, data, final);
+        it->second->onIncoming(*this, id, offset, data, final);
 
         if (final) {
             LFLOG_TRACE << "Transfer om channel #" << channel
@@ -354,6 +909,15 @@ void Peer::onReceivedJson(const quint64 id, const Peer::mview_t& data)
                     json.object().value("status").toString().toUtf8(),
                     params};
 
+        if ((ack.what == "IncomingFile") && (ack.status == "Proceed")
+                && params.contains("stripe-token")) {
+            // The peer can receive ranges of the file over data connections
+            StripeOffer offer;
+            offer.stripes = params.value("stripes").toInt();
+            offer.token = params.value("stripe-token").toByteArray();
+            stripeOffers_[params.value("channel").toUInt()] = offer;
+        }
+
         LFLOG_TRACE << "Emitting Ack";
         emit receivedAck(ack);
     } else if (type == "Message") {
@@ -386,6 +950,24 @@ void Peer::onReceivedJson(const quint64 id, const Peer::mview_t& data)
 
         LFLOG_TRACE << "Emitting PeerSetAvatarReq";
         emit receivedAvatar(avatar);
+    } else if (type == "Ping") {
+        send(QJsonDocument{
+                 QJsonObject{
+                     {"type", "Pong"},
+                     {"seq", json.object().value("seq").toString()}
+                 }
+             });
+    } else if (type == "Pong") {
+        onPong(json.object().value("seq").toString().toULongLong());
+    } else if (type == "RangeAck") {
+        const auto channel = json.object().value("channel").toString().toUInt();
+        const auto it = outChannels_.find(channel);
+        if (it != outChannels_.end()) {
+            // Keep the channel alive if the transfer completes
+            auto instance = it->second;
+            instance->onAck(*this, QByteArray::fromBase64(
+                                json.object().value("offsets").toString().toUtf8()));
+        }
     } else if (type == "UserInfo") {
         PeerUserInfo uinfo{shared_from_this(), getConnectionId(), id,
                     json.object().value("nick-name").toString()};
@@ -448,6 +1030,8 @@ void Peer::processStream(const Peer::data_t &ciphertext)
         return;
     }
 
+    bytesReceived_ += ciphertext.size();
+
     bool final = {};
     if (inState_ == InState::CHUNK_SIZE) {
         array<uint8_t, 2> bytes = {};
@@ -464,31 +1048,39 @@ void Peer::processStream(const Peer::data_t &ciphertext)
         mview_t channel{version.end(), 4};
         mview_t id{channel.end(), 8};
 
+        decrypt(buffer_view, ciphertext, final);
+
+        if (version.at(0) != '\1' && version.at(0) != '\2') {
+            LFLOG_WARN << "Unknown chunk version" << static_cast<unsigned int>(version.at(0));
+            throw runtime_error("Unknown chunk version");
+        }
+
+        // Version 2 chunks carry the offset of a range in a striped transfer
+        mview_t range{id.end(), (version.at(0) == '\2') ? 8u : 0u};
+
         const int payload_size = static_cast<int>(buffer.size())
                 - static_cast<int>(version.size())
                 - static_cast<int>(channel.size())
-                - static_cast<int>(id.size());
+                - static_cast<int>(id.size())
+                - static_cast<int>(range.size());
 
         if (payload_size < 0) {
             throw runtime_error("Payload size underflow");
         }
 
-        mview_t payload{id.end(), static_cast<size_t>(payload_size)};
+        mview_t payload{range.end(), static_cast<size_t>(payload_size)};
 
         assert(buffer.size() == (+ version.size()
                                  + channel.size()
                                  + id.size()
+                                 + range.size()
                                  + payload.size()));
 
-        decrypt(buffer_view, ciphertext, final);
-
-        if (version.at(0) != '\1') {
-            LFLOG_WARN << "Unknown chunk version" << static_cast<unsigned int>(version.at(0));
-            throw runtime_error("Unknown chunk version");
-        }
-
         const auto channel_id = qFromBigEndian(bytesToValue<quint32>(channel));
         const auto chunk_id = qFromBigEndian(bytesToValue<quint64>(id));
+        const auto offset = range.empty()
+                ? no_offset
+                : static_cast<qint64>(qFromBigEndian(bytesToValue<quint64>(range)));
 
         LFLOG_TRACE << "Received chunk on "
                     << connection_->getUuid().toString()
@@ -498,7 +1090,7 @@ void Peer::processStream(const Peer::data_t &ciphertext)
                     << ", payload=" << (channel_id ? binary : safePayload(payload));
 
         try {
-            onReceivedData(channel_id, chunk_id, payload, final);
+            onReceivedData(channel_id, chunk_id, offset, payload, final);
         } catch (const std::exception& ex) {
             LFLOG_ERROR << "Caught exception while processing incoming message on connection "
                         << getConnectionId().toString()
@@ -508,6 +1100,18 @@ void Peer::processStream(const Peer::data_t &ciphertext)
             return;
         }
 
+        if (channel_id) {
+            // Stop reading while we are over the download limit. Tor will
+            // eventually stop sending when the socket buffers are full.
+            RateLimiter::instance().consume(RateLimiter::Direction::DOWN, getIdentityId(),
+                                            getRateLimitKey(), static_cast<qint64>(payload.size()));
+            if (isThrottled(RateLimiter::Direction::DOWN, [this]() {
+                            wantChunkSize();
+                        })) {
+                return;
+            }
+        }
+
         wantChunkSize();
     } else {
         throw runtime_error("Unexpected InState");
@@ -574,7 +1178,7 @@ QByteArray Peer::safePayload(const Peer::mview_t &data)
     return "*** NOT Json ***";
 }
 
-quint32 Peer::createChannel(const File &file)
+quint32 Peer::createChannel(const File &file, const bool ranged)
 {
     quint32 channelId = 0;
     auto filePtr = core::DsEngine::instance().getFileManager()->getFile(file.getId());
@@ -589,7 +1193,7 @@ quint32 Peer::createChannel(const File &file)
         channelId = file.getChannel();
         assert(channelId > 0);
         assert(outChannels_.find(channelId) == outChannels_.end());
-        ch = make_shared<OutgoingFileChannel>(filePtr);
+        ch = make_shared<OutgoingFileChannel>(filePtr, ranged);
         outChannels_[channelId] = ch;
     }
 
@@ -620,12 +1224,23 @@ uint64_t Peer::startReceive(File &file)
                 << " with channel #"
                 << channelId;
 
-    const auto params = QVariantMap {
+    auto params = QVariantMap {
             {"rest", QString::number(0)},
             {"data", QString{file.getFileId().toBase64()}},
             {"channel", channelId}
     };
 
+    // Offer to receive large files over several connections in parallel
+    auto& settings = DsEngine::instance().settings();
+    const auto stripes = settings.value("transferStripes", 3).toInt();
+    if ((stripes > 0)
+            && (file.getSize() >= settings.value("transferStripeMinSize", 32 * 1024 * 1024).toLongLong())) {
+        const auto token = crypto::Crypto::getRandomBytes(16).toBase64();
+        stripeTokens_[token] = channelId;
+        params.insert("stripes", stripes);
+        params.insert("stripe-token", QString{token});
+    }
+
     LFLOG_DEBUG << "Requesting File : " << file.getId()
                 << " with channel #" << channelId
                 << " over connection " << getConnectionId().toString();
@@ -639,15 +1254,65 @@ uint64_t Peer::startReceive(File &file)
 
 uint64_t Peer::startSend(File &file)
 {
-    auto channelId = createChannel(file);
+    // Stripe the file over data connections if the peer offered it
+    int stripes = 0;
+    const auto offer = stripeOffers_.find(file.getChannel());
+    if (offer != stripeOffers_.end()) {
+        auto& settings = DsEngine::instance().settings();
+        if (file.getSize() >= settings.value("transferStripeMinSize", 32 * 1024 * 1024).toLongLong()) {
+            stripes = min(offer->second.stripes, settings.value("transferStripes", 3).toInt());
+        }
+    }
+
+    auto channelId = createChannel(file, stripes > 0);
     file.clearBytesTransferred();
     file.setState(File::FS_TRANSFERRING);
+
+    if (stripes > 0) {
+        const auto transfer = QUuid::createUuid();
+        stripedTransfers_[transfer] = channelId;
+
+        LFLOG_DEBUG << "Striping file #" << file.getId()
+                    << " on channel #" << channelId
+                    << " over " << stripes << " data connections.";
+
+        emit dataConnectionsWanted(transfer, stripes);
+    }
+
     return outChannels_.at(channelId)->onOutgoing(*this);
 }
 
 void Peer::useConnection(ConnectionSocket *cc)
 {
     Q_UNUSED(cc);
+
+    // Pack small frames into whole Tor cells
+    connection_->setCoalesceDelay(DsEngine::instance().settings().value(
+                                      "frameCoalesceDelay", 0).toInt());
+
+    // Keep the file data we buffer shallow, so chat messages are sent promptly
+    connection_->setBulkLaneDepth(DsEngine::instance().settings().value(
+                                      "bulkLaneDepth",
+                                      ConnectionSocket::default_bulk_lane_depth).toLongLong());
+    connection_->setSendBufferLimit(DsEngine::instance().settings().value(
+                                        "socketSendBuffer",
+                                        ConnectionSocket::default_send_buffer).toLongLong());
+
+    // The read buffer follows the throughput within these limits
+    connection_->setReadBufferLimits(
+                DsEngine::instance().settings().value(
+                    "socketReadBufferMin", ConnectionSocket::default_min_read_buffer).toLongLong(),
+                DsEngine::instance().settings().value(
+                    "socketReadBufferMax", ConnectionSocket::default_max_read_buffer).toLongLong());
+
+    // The largest chunk we will ask the socket for
+    connection_->setMaxFrameSize(static_cast<qint64>(
+                                     std::numeric_limits<quint16>::max() + crypt_bytes));
+
+    connect(connection_.get(), &ConnectionSocket::bytesWritten,
+            this, [this](qint64 bytes) {
+        bytesSent_ += static_cast<quint64>(bytes);
+    });
     connect(connection_.get(), &ConnectionSocket::connected,
             this, [this]() {
 
@@ -661,6 +1326,9 @@ void Peer::useConnection(ConnectionSocket *cc)
         LFLOG_DEBUG << "Peer " << getConnectionId().toString()
                     << " is disconnected";
 
+        probeTimer_.stop();
+        closeDataConnections();
+
         if (!notificationsDisabled_) {
             emit disconnectedFromPeer(shared_from_this());
         }
@@ -688,6 +1356,8 @@ crypto::DsCert::ptr_t Peer::getPeerCert() const noexcept
 void Peer::close()
 {
    inState_ = InState::CLOSING;
+   probeTimer_.stop();
+   closeDataConnections();
    emit closeLater();
 }
 
@@ -824,6 +1494,17 @@ uint64_t Peer::sendSome(File &file)
         return {};
     }
 
+    // We will get another outputBufferEmptied() when the socket has drained
+    if (!connection_->isBulkLaneOpen()) {
+        return {};
+    }
+
+    if (isThrottled(RateLimiter::Direction::UP, [this]() {
+                    emit outputBufferEmptied();
+                })) {
+        return {};
+    }
+
     auto instance = it->second;
     return instance->onOutgoing(*this);
 }
@@ -833,6 +1514,335 @@ void Peer::disableNotifications()
     notificationsDisabled_ = true;
 }
 
+void Peer::addDataConnection(const PeerConnection::ptr_t &peer)
+{
+    auto dc = dynamic_pointer_cast<Peer>(peer);
+    assert(dc);
+
+    dc->dataConnection_ = true;
+    dc->primary_ = static_pointer_cast<Peer>(shared_from_this());
+
+    if (dc->getDirection() == OUTGOING) {
+        // We are sending. Bind the connection to the transfer at the peer.
+        const auto transfer = stripedTransfers_.find(dc->getConnectData().transfer);
+        if ((transfer == stripedTransfers_.end())
+                || (outChannels_.find(transfer->second) == outChannels_.end())) {
+            LFLOG_DEBUG << "The transfer for data connection "
+                        << dc->getConnectionId().toString() << " is gone. Closing.";
+            dc->close();
+            return;
+        }
+
+        dc->boundChannel_ = transfer->second;
+        dc->send(QJsonDocument{
+                     QJsonObject{
+                         {"type", "Bind"},
+                         {"token", QString{stripeOffers_.at(transfer->second).token}}
+                     }
+                 });
+
+        connect(dc.get(), &PeerConnection::outputBufferEmptied,
+                this, [this, wdc = weak_ptr<Peer>(dc)]() {
+            if (auto dc = wdc.lock()) {
+                pumpDataConnection(dc);
+            }
+        });
+    }
+
+    LFLOG_DEBUG << "Added data connection " << dc->getConnectionId().toString()
+                << " to connection " << getConnectionId().toString();
+
+    connect(dc.get(), &PeerConnection::disconnectedFromPeer,
+            this, [this](const std::shared_ptr<PeerConnection>& peer) {
+        dataConnections_.erase(remove(dataConnections_.begin(), dataConnections_.end(), peer),
+                               dataConnections_.end());
+        onDataConnectionLost(static_cast<const Peer&>(*peer));
+    }, Qt::QueuedConnection);
+
+    dataConnections_.push_back(dc);
+
+    if (dc->boundChannel_) {
+        pumpDataConnection(dc);
+    }
+}
+
+// Data connection. The first message binds it to one of the transfers on the primary
+void Peer::onReceivedBind(const mview_t &data)
+{
+    const auto json = QJsonDocument::fromJson(data.toByteArray());
+    if (boundChannel_ || (json.object().value("type") != "Bind")) {
+        throw Error("Unexpected request on data connection");
+    }
+
+    auto primary = primary_.lock();
+    if (!primary) {
+        throw Error("The primary connection is gone");
+    }
+
+    boundChannel_ = primary->bindDataConnection(
+                json.object().value("token").toString().toUtf8());
+    if (!boundChannel_) {
+        throw Error("Invalid stripe-token");
+    }
+
+    LFLOG_DEBUG << "Data connection " << getConnectionId().toString()
+                << " is bound to channel #" << boundChannel_
+                << " on connection " << primary->getConnectionId().toString();
+}
+
+quint32 Peer::bindDataConnection(const QByteArray &token)
+{
+    const auto it = stripeTokens_.find(token);
+    if (it == stripeTokens_.end()
+            || (inChannels_.find(it->second) == inChannels_.end())) {
+        return {};
+    }
+
+    return it->second;
+}
+
+void Peer::pumpDataConnection(const Peer::ptr_t &dataConnection)
+{
+    auto it = outChannels_.find(dataConnection->boundChannel_);
+    if (it == outChannels_.end()) {
+        return;
+    }
+
+    if (!dataConnection->getConnection().isBulkLaneOpen()) {
+        return;
+    }
+
+    if (dataConnection->isThrottled(RateLimiter::Direction::UP,
+                                    [this, wdc = weak_ptr<Peer>(dataConnection)]() {
+                                        if (auto dc = wdc.lock()) {
+                                            pumpDataConnection(dc);
+                                        }
+                                    })) {
+        return;
+    }
+
+    // Keep the channel alive if the transfer completes
+    auto channel = it->second;
+    try {
+        channel->onOutgoing(*dataConnection);
+    } catch(const std::exception& ex) {
+        LFLOG_WARN << "Failed to send on data connection "
+                   << dataConnection->getConnectionId().toString()
+                   << ": " << ex.what();
+        dataConnection->close();
+    }
+}
+
+// Send the ranges that were in flight on the lost connection over the others
+void Peer::onDataConnectionLost(const Peer &dataConnection)
+{
+    if (dataConnection.getDirection() != OUTGOING) {
+        return; // We only send on the data connections we dialed
+    }
+
+    const auto it = outChannels_.find(dataConnection.boundChannel_);
+    if (it == outChannels_.end()) {
+        return;
+    }
+
+    if (!it->second->onDisconnected(dataConnection.getConnectionId())) {
+        return;
+    }
+
+    // The remaining connections may be idle, waiting for acks
+    const auto connections = dataConnections_;
+    for(const auto& dc : connections) {
+        if ((dc->boundChannel_ == dataConnection.boundChannel_)
+                && (dc->getDirection() == OUTGOING)) {
+            pumpDataConnection(dc);
+        }
+    }
+
+    if (!notificationsDisabled_) {
+        emit outputBufferEmptied();
+    }
+}
+
+void Peer::closeDataConnections(const File::Direction direction, const quint32 channel)
+{
+    // Our data connections for outgoing transfers are the ones we dialed
+    const auto dir = (direction == File::OUTGOING) ? OUTGOING : INCOMING;
+
+    if (direction == File::INCOMING) {
+        for(auto it = stripeTokens_.begin(); it != stripeTokens_.end();) {
+            if (it->second == channel) {
+                it = stripeTokens_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    } else {
+        stripeOffers_.erase(channel);
+        for(auto it = stripedTransfers_.begin(); it != stripedTransfers_.end();) {
+            if (it->second == channel) {
+                it = stripedTransfers_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    for(const auto& dc : dataConnections_) {
+        if ((dc->boundChannel_ == channel) && (dc->getDirection() == dir)) {
+            dc->close();
+        }
+    }
+}
+
+/* Ask the rate limiter if we can transfer more file data now.
+ *
+ * If not, resume is called when we can. Only one resume is
+ * pending at any time.
+ */
+bool Peer::isThrottled(const RateLimiter::Direction direction, std::function<void ()> resume)
+{
+    auto& throttled = throttled_.at(static_cast<size_t>(direction));
+    if (throttled) {
+        return true;
+    }
+
+    const auto delay = RateLimiter::instance().getDelay(direction, getIdentityId(),
+                                                        getRateLimitKey());
+    if (!delay) {
+        return false;
+    }
+
+    throttled = true;
+    QTimer::singleShot(delay, this, [this, direction, resume]() {
+        throttled_.at(static_cast<size_t>(direction)) = false;
+        if (inState_ != InState::CLOSING) {
+            resume();
+        }
+    });
+
+    return true;
+}
+
+QByteArray Peer::getRateLimitKey() const
+{
+    if (const auto& cert = getPeerCert()) {
+        return cert->getHash().toByteArray();
+    }
+
+    return {};
+}
+
+core::ConnectionStats Peer::getStats() const
+{
+    core::ConnectionStats stats;
+    stats.rtt = (srtt_ < 0) ? -1 : static_cast<int>(srtt_ + 0.5);
+    stats.sendRate = sendRate_;
+    stats.receiveRate = receiveRate_;
+    stats.bytesSent = bytesSent_;
+    stats.bytesReceived = bytesReceived_;
+    return stats;
+}
+
+void Peer::startProbing()
+{
+    // Data connections only carry file data
+    if (dataConnection_) {
+        return;
+    }
+
+    const auto interval = DsEngine::instance().settings().value("probeInterval", 15000).toInt();
+    if (interval <= 0) {
+        return;
+    }
+
+    lastProbe_ = clock_.elapsed();
+    lastBytesSent_ = bytesSent_;
+    lastBytesReceived_ = bytesReceived_;
+
+    probeTimer_.start(interval);
+    probe();
+}
+
+/* Send a ping to measure the round-trip time, and update the
+ * throughput for the time since the last probe.
+ */
+void Peer::probe()
+{
+    if (!isConnected() || (inState_ == InState::CLOSING)) {
+        probeTimer_.stop();
+        return;
+    }
+
+    const auto now = clock_.elapsed();
+    const auto elapsed = now - lastProbe_;
+    if (elapsed > 0) {
+        sendRate_ = static_cast<qint64>((bytesSent_ - lastBytesSent_) * 1000 / static_cast<quint64>(elapsed));
+        receiveRate_ = static_cast<qint64>((bytesReceived_ - lastBytesReceived_) * 1000 / static_cast<quint64>(elapsed));
+        lastProbe_ = now;
+        lastBytesSent_ = bytesSent_;
+        lastBytesReceived_ = bytesReceived_;
+        emit statsChanged();
+    }
+
+    // A peer that doesn't understand Ping logs a warning for each of them.
+    // If it never answered, stop pinging it, but keep the throughput stats.
+    static constexpr quint64 max_unanswered_pings = 3;
+    if (!pongReceived_ && (nextPing_ >= max_unanswered_pings)) {
+        if (!pendingPings_.empty()) {
+            LFLOG_DEBUG << "No Pong on connection " << getConnectionId().toString()
+                        << ". The peer does not support Ping. Not measuring RTT.";
+            pendingPings_.clear();
+        }
+        return;
+    }
+
+    // Pongs that never came are not coming
+    pendingPings_.erase(pendingPings_.begin(), pendingPings_.lower_bound(nextPing_ > 4 ? nextPing_ - 4 : 0));
+
+    const auto seq = ++nextPing_;
+    pendingPings_[seq] = now;
+
+    try {
+        send(QJsonDocument{
+                 QJsonObject{
+                     {"type", "Ping"},
+                     {"seq", QString::number(seq)}
+                 }
+             });
+    } catch(const std::exception& ex) {
+        LFLOG_DEBUG << "Failed to send ping on connection "
+                    << getConnectionId().toString() << ": " << ex.what();
+    }
+}
+
+void Peer::onPong(const quint64 seq)
+{
+    pongReceived_ = true;
+
+    const auto it = pendingPings_.find(seq);
+    if (it == pendingPings_.end()) {
+        return;
+    }
+
+    const auto sample = static_cast<double>(clock_.elapsed() - it->second);
+    pendingPings_.erase(it);
+
+    // Same smoothing as TCP (RFC 6298)
+    srtt_ = (srtt_ < 0) ? sample : (srtt_ + ((sample - srtt_) / 8));
+
+    LFLOG_TRACE << "RTT on connection " << getConnectionId().toString()
+                << " is " << sample << " ms, smoothed " << srtt_ << " ms.";
+
+    emit statsChanged();
+}
+
+void Peer::closeDataConnections()
+{
+    for(const auto& dc : dataConnections_) {
+        dc->close();
+    }
+}
+
 
 }} // namespace
 
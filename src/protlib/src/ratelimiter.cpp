@@ -0,0 +1,160 @@
+#include <algorithm>
+#include <cmath>
+
+#include "ds/ratelimiter.h"
+#include "ds/dsengine.h"
+
+#include "logfault/logfault.h"
+
+namespace ds {
+namespace prot {
+
+using namespace std;
+
+namespace {
+
+enum Level {
+    GLOBAL,
+    IDENTITY,
+    CONTACT
+};
+
+// Settings for each level, as up, down
+const std::array<const char *, 6> rate_settings = {
+    "rateLimitUp", "rateLimitDown",
+    "rateLimitIdentityUp", "rateLimitIdentityDown",
+    "rateLimitContactUp", "rateLimitContactDown"
+};
+
+// How often we re-read the settings
+constexpr qint64 config_interval_ms = 1000;
+
+size_t toIndex(const RateLimiter::Direction direction) {
+    return static_cast<size_t>(direction);
+}
+
+} // anonymous namespace
+
+RateLimiter &RateLimiter::instance()
+{
+    static RateLimiter limiter;
+    return limiter;
+}
+
+RateLimiter::RateLimiter()
+{
+    clock_.start();
+}
+
+int RateLimiter::getDelay(const RateLimiter::Direction direction,
+                          const QUuid &identity, const QByteArray &contact)
+{
+    reloadConfig();
+
+    const auto now = clock_.elapsed();
+    const auto dir = toIndex(direction);
+
+    array<Bucket *, 3> levels = {&global_[dir],
+                                 &identities_[identity][dir],
+                                 &contacts_[contact][dir]};
+    int delay = 0;
+    for(size_t level = GLOBAL; level <= CONTACT; ++level) {
+        auto& bucket = *levels[level];
+        bucket.refill(now, getRate(direction, static_cast<int>(level)));
+
+        const auto wait = bucket.getDelay();
+        if (wait) {
+            bucket.throttledMs += wait;
+            delay = max(delay, wait);
+        }
+    }
+
+    throttledMs_[dir] += delay;
+    return delay;
+}
+
+void RateLimiter::consume(const RateLimiter::Direction direction,
+                          const QUuid &identity, const QByteArray &contact,
+                          const qint64 bytes)
+{
+    const auto dir = toIndex(direction);
+    global_[dir].consume(bytes);
+    identities_[identity][dir].consume(bytes);
+    contacts_[contact][dir].consume(bytes);
+}
+
+qint64 RateLimiter::getThrottledTime(const RateLimiter::Direction direction) const
+{
+    return throttledMs_[toIndex(direction)];
+}
+
+qint64 RateLimiter::getThrottledTime(const RateLimiter::Direction direction,
+                                     const QByteArray &contact) const
+{
+    const auto it = contacts_.find(contact);
+    if (it == contacts_.end()) {
+        return 0;
+    }
+
+    return it->second[toIndex(direction)].throttledMs;
+}
+
+void RateLimiter::reloadConfig()
+{
+    const auto now = clock_.elapsed();
+    if ((lastConfig_ >= 0) && ((now - lastConfig_) < config_interval_ms)) {
+        return;
+    }
+
+    lastConfig_ = now;
+    auto& settings = core::DsEngine::instance().settings();
+    for(size_t i = 0; i < rates_.size(); ++i) {
+        rates_[i] = max<qint64>(0, settings.value(rate_settings[i], 0).toLongLong());
+    }
+}
+
+qint64 RateLimiter::getRate(const RateLimiter::Direction direction, const int level) const
+{
+    return rates_.at(static_cast<size_t>(level) * 2 + toIndex(direction));
+}
+
+void RateLimiter::Bucket::refill(const qint64 now, const qint64 newRate)
+{
+    if (newRate != rate) {
+        // Start over with a full bucket
+        rate = newRate;
+        lastRefill = -1;
+    }
+
+    if (!rate) {
+        tokens = 0;
+        return;
+    }
+
+    // Allow bursts of up to one second of traffic
+    const auto burst = static_cast<double>(rate);
+    if (lastRefill < 0) {
+        tokens = burst;
+    } else {
+        tokens = min(burst, tokens + (static_cast<double>(now - lastRefill) * rate / 1000.0));
+    }
+    lastRefill = now;
+}
+
+int RateLimiter::Bucket::getDelay() const
+{
+    if (!rate || (tokens >= 0)) {
+        return 0;
+    }
+
+    return static_cast<int>(ceil(-tokens * 1000.0 / static_cast<double>(rate)));
+}
+
+void RateLimiter::Bucket::consume(const qint64 bytes)
+{
+    if (rate) {
+        tokens -= static_cast<double>(bytes);
+    }
+}
+
+}} // namespaces
@@ -4,9 +4,15 @@
 
 #include <QJsonObject>
 #include <QJsonDocument>
+#include <QTimer>
+
+#include <sodium.h>
 
 #include "ds/torprotocolmanager.h"
+#include "ds/dsserver.h"
 #include "ds/errors.h"
+#include "ds/crypto.h"
+#include "ds/onionkey.h"
 #include "logfault/logfault.h"
 
 using namespace std;
@@ -19,6 +25,7 @@ namespace prot {
 
 TorProtocolManager::TorProtocolManager(QSettings &settings)
     : settings_{settings}
+    , socksNonce_{crypto::Crypto::getRandomBytes(8).toHex()}
 {
     tor_ = make_unique<TorMgr>(getConfig());
 
@@ -38,6 +45,40 @@ TorProtocolManager::TorProtocolManager(QSettings &settings)
         emit transportHandleError({"", service, reason});
     });
 
+    connect(tor_.get(), &TorMgr::batchCompleted, this, [](const ServiceBatchResult& result) {
+        if (result.failed.isEmpty()) {
+            return;
+        }
+
+        LFLOG_WARN << result.failed.size() << " of "
+                   << (result.failed.size() + result.succeeded.size())
+                   << " hidden services in a batch failed.";
+        for(auto it = result.failed.cbegin(); it != result.failed.cend(); ++it) {
+            LFLOG_DEBUG << "Service " << it.key().toString()
+                        << " failed: " << it.value().constData();
+        }
+    });
+
+    connect(tor_.get(), &TorMgr::servicePublished, this, [this](const QUuid& service,
+            const bool published) {
+        emit servicePublished(service, published);
+    });
+
+    connect(tor_.get(), &TorMgr::descriptorAvailable, this, [this](const QByteArray& address,
+            const bool available) {
+        if (available) {
+            missingDescriptors_.remove(address);
+        } else {
+            missingDescriptors_[address] = QDateTime::currentDateTime();
+        }
+    });
+
+    connect(tor_.get(), &TorMgr::socksListener, this, [this](const QString& host,
+            const quint16 port) {
+        socksHost_ = host;
+        socksPort_ = port;
+    });
+
     connect(tor_.get(), &TorMgr::started, this, [this](){
         setState(State::CONNECTED);
     });
@@ -159,6 +200,83 @@ TorServiceInterface& TorProtocolManager::getService(const QUuid& service)
     return *it->second;
 }
 
+bool TorProtocolManager::useSharedListener() const
+{
+    return settings_.value(QStringLiteral("torSharedListener"), false).toBool();
+}
+
+uint16_t TorProtocolManager::getSharedListenerPort()
+{
+    if (!sharedListener_) {
+        auto listener = make_shared<TorSocketListener>(
+                    [this](const ConnectionSocket::ptr_t& connection) {
+            onNewSharedConnection(connection);
+        });
+
+        if (!listener->listen(QHostAddress::LocalHost)) {
+            LFLOG_ERROR << "Failed to start shared listener: "
+                        << listener->errorString();
+            throw runtime_error("Failed to start shared listener");
+        }
+
+        LFLOG_NOTICE << "Started shared listener on " << listener->serverAddress()
+                     << ":" << listener->serverPort();
+
+        sharedListener_ = move(listener);
+    }
+
+    return sharedListener_->serverPort();
+}
+
+void TorProtocolManager::onNewSharedConnection(const ConnectionSocket::ptr_t &connection)
+{
+    LFLOG_DEBUG << "Plugging in a new incoming connection on the shared listener: "
+                << connection->getUuid().toString();
+
+    const auto uuid = connection->getUuid();
+    auto server = make_shared<DsServer>(connection, [this]() {
+        vector<ConnectData> identities;
+        identities.reserve(services_.size());
+        for(const auto& it : services_) {
+            ConnectData cd;
+            cd.identitysCert = it.second->getCert();
+            cd.service = it.first;
+            identities.push_back(move(cd));
+        }
+        return identities;
+    });
+
+    connect(server.get(), &Peer::incomingPeer,
+            this, [this, uuid](const std::shared_ptr<PeerConnection>& peer) {
+        auto it = unroutedPeers_.find(uuid);
+        if (it == unroutedPeers_.end()) {
+            return;
+        }
+
+        auto server = move(it->second);
+        unroutedPeers_.erase(it);
+
+        auto service = services_.find(peer->getIdentityId());
+        if (service == services_.end()) {
+            LFLOG_WARN << "Service " << peer->getIdentityId().toString()
+                       << " for connection " << uuid.toString()
+                       << " is gone. Closing.";
+            peer->close();
+            return;
+        }
+
+        service->second->adoptIncomingPeer(server);
+    });
+
+    // Failed handshakes are closed by the server itself
+    connect(server.get(), &PeerConnection::disconnectedFromPeer,
+            this, [this, uuid](const std::shared_ptr<PeerConnection>&) {
+        unroutedPeers_.erase(uuid);
+    }, Qt::QueuedConnection);
+
+    unroutedPeers_[uuid] = server;
+}
+
 uint64_t TorProtocolManager::sendAddme(const AddmeReq& req)
 {
     auto json = QJsonDocument{
@@ -204,19 +322,51 @@ void TorProtocolManager::start()
 void TorProtocolManager::stop()
 {
     services_.clear();
+    pendingStarts_.clear();
+    pendingStops_.clear();
+    unroutedPeers_.clear();
+    if (sharedListener_) {
+        sharedListener_->close();
+        sharedListener_.reset();
+    }
     tor_->stop();
     setState(State::SHUTTINGDOWN);
 }
 
 void TorProtocolManager::createTransportHandle(const TransportHandleReq &req)
 {
-    tor_->createService(req.uuid);
+    // Make the key here rather than with ADD_ONION NEW, so that Tor
+    // does not publish a descriptor for it before an Identity starts it.
+    const auto config = getConfig();
+    const auto key = crypto::createOnionKey();
+
+    ServiceProperties service;
+    service.uuid = req.uuid;
+    service.name = req.identityName;
+    service.service_id = key.serviceId;
+    service.key_type = key.keyType;
+    service.key = key.key;
+    service.service_port = static_cast<uint16_t>(config.service_from_port
+        + randombytes_uniform(config.service_to_port - config.service_from_port + 1u));
+
+    LFLOG_DEBUG << "Created Tor hidden service key: " << service.service_id
+                << " with id " << service.uuid.toString();
+
+    // Callers expect the handle to arrive asynchronously
+    QTimer::singleShot(0, this, [this, service] {
+        emit transportHandleReady(toTransportHandle(service));
+    });
 }
 
 void TorProtocolManager::startService(const QUuid& serviceId,
                                       const crypto::DsCert::ptr_t& cert,
                                       const QVariantMap& data)
 {
+    // The start itself is deferred. Fail now, so the caller gets the exception.
+    if (!tor_->isConnected()) {
+        throw TorMgr::OfflineError("Tor is offline");
+    }
+
     ServiceProperties sp;
     sp.uuid = serviceId;
     sp.key = data["key"].toByteArray();
@@ -227,7 +377,9 @@ void TorProtocolManager::startService(const QUuid& serviceId,
     auto service = make_shared<TorServiceInterface>(cert, data["address"].toByteArray(), serviceId);
 
     // Add listening port
-    auto properties = service->startService();
+    auto properties = useSharedListener()
+            ? service->startSharedService(getSharedListenerPort())
+            : service->startService();
     sp.app_port = properties.port;
     assert(properties.port);
 
@@ -265,12 +417,77 @@ void TorProtocolManager::startService(const QUuid& serviceId,
 //        emit receivedData(serviceId, connectionId, channel, id, data);
 //    });
 
-    tor_->startService(sp);
+    // Keep the order of the requests. A deferred stop must reach Tor before the start.
+    if (!pendingStops_.isEmpty()) {
+        flushPendingStops();
+    }
+
+    if (pendingStarts_.isEmpty()) {
+        QTimer::singleShot(0, this, [this]() {
+            flushPendingStarts();
+        });
+    }
+
+    pendingStarts_.append(sp);
+}
+
+void TorProtocolManager::flushPendingStarts()
+{
+    if (pendingStarts_.isEmpty()) {
+        return; // Already flushed by stopService()
+    }
+
+    const auto services = move(pendingStarts_);
+    pendingStarts_.clear();
+
+    try {
+        tor_->startServices(services);
+    } catch(const std::exception& ex) {
+        LFLOG_WARN << "Failed to start " << services.size()
+                   << " hidden services: " << ex.what();
+
+        for(const auto& sp : services) {
+            emit serviceFailed(sp.uuid, ex.what());
+        }
+    }
 }
 
 void TorProtocolManager::stopService(const QUuid& uuid)
 {
-    tor_->stopService(uuid);
+    // Keep the order of the requests. A deferred start must reach Tor before the stop.
+    if (!pendingStarts_.isEmpty()) {
+        flushPendingStarts();
+    }
+
+    if (pendingStops_.isEmpty()) {
+        QTimer::singleShot(0, this, [this]() {
+            flushPendingStops();
+        });
+    }
+
+    pendingStops_.append(uuid);
+}
+
+void TorProtocolManager::flushPendingStops()
+{
+    if (pendingStops_.isEmpty()) {
+        return; // Already flushed by startService()
+    }
+
+    const auto services = move(pendingStops_);
+    pendingStops_.clear();
+
+    try {
+        tor_->stopServices(services);
+    } catch(const std::exception& ex) {
+        LFLOG_WARN << "Failed to stop " << services.size()
+                   << " hidden services: " << ex.what();
+
+        // Tor removes our services when the control connection goes away
+        for(const auto& service : services) {
+            emit serviceStopped(service);
+        }
+    }
 }
 
 core::PeerConnection::ptr_t TorProtocolManager::connectTo(core::ConnectData cd)
@@ -282,12 +499,88 @@ core::PeerConnection::ptr_t TorProtocolManager::connectTo(core::ConnectData cd)
     }
 
     const auto port = static_cast<uint16_t>(parts.at(parts.size() -1).toUInt());
-    const auto host = parts.at(parts.size() - 2) + ".onion";
+    const auto address = parts.at(parts.size() - 2);
+    const auto host = address + ".onion";
     auto service = cd.service;
-    return getService(service).connectToService(host, port, move(cd));
+    const auto proxy = getProxy(cd);
+    return getService(service).connectToService(host, port, move(cd), proxy,
+                                                [this, address]() {
+        return isDescriptorAvailable(address);
+    });
+}
+
+/* Tor use different circuits for SOCKS connections with different
+ * username/password (IsolateSOCKSAuth is enabled by default), so
+ * one congested circuit does not slow down all our contacts.
+ *
+ * The "torSocksIsolation" setting decides the granularity:
+ *   - "contact" (default): One circuit per contact for each identity
+ *   - "identity": All the contacts of an identity share circuits
+ *   - "none": Let Tor decide.
+ *
+ * Data connections for a striped transfer (ConnectData::transfer is set)
+ * each get their own circuits, unless the setting is "none". Striping
+ * over one circuit would gain nothing.
+ */
+QNetworkProxy TorProtocolManager::getProxy(const ConnectData &cd)
+{
+    const auto host = socksHost_.isEmpty()
+            ? settings_.value(QStringLiteral("torSocksHost"), "127.0.0.1").toString()
+            : socksHost_;
+    const auto port = socksPort_ ? socksPort_ : static_cast<quint16>(
+            settings_.value(QStringLiteral("torSocksPort"), 9050).toUInt());
+
+    QNetworkProxy proxy{QNetworkProxy::Socks5Proxy, host, port};
+
+    const auto isolation = settings_.value(QStringLiteral("torSocksIsolation"),
+                                           QStringLiteral("contact")).toString();
+    QString user;
+    if (isolation == QStringLiteral("identity")) {
+        user = cd.service.toString();
+    } else if (isolation == QStringLiteral("contact")) {
+        user = cd.service.toString() + ':' + QString::fromLatin1(cd.address);
+    }
+
+    if (!user.isEmpty() && !cd.transfer.isNull()) {
+        user += ':' + cd.transfer.toString() + ':' + QString::number(++dataConnections_);
+    }
+
+    if (!user.isEmpty()) {
+        proxy.setUser(user);
+        proxy.setPassword(socksNonce_);
+    }
+
+    return proxy;
+}
+
+bool TorProtocolManager::isDescriptorAvailable(const QByteArray &address) const
+{
+    const auto it = missingDescriptors_.find(address);
+    if (it == missingDescriptors_.end()) {
+        return true;
+    }
+
+    // Tor caches the failure for a while. Don't bother asking again before it expires.
+    const auto holdoff = settings_.value(QStringLiteral("torMissingDescriptorHoldoff"), 120).toInt();
+    return it.value().secsTo(QDateTime::currentDateTime()) >= holdoff;
 }
 
 void TorProtocolManager::onServiceCreated(const ServiceProperties &service)
+{
+    const auto th = toTransportHandle(service);
+
+    // Stop the service. We require explicit start request to make it available.
+    try {
+        tor_->stopService(service.uuid);
+    } catch(const std::exception& ex) {
+        LFLOG_WARN << "Failed to request hidden service " << th.handle
+                   << " to stop: " << ex.what();
+    }
+
+    emit transportHandleReady(th);
+}
+
+TransportHandle TorProtocolManager::toTransportHandle(const ServiceProperties &service)
 {
     // Convert the service data to a transport-handle
     TransportHandle th;
@@ -303,15 +596,7 @@ void TorProtocolManager::onServiceCreated(const ServiceProperties &service)
     th.data["port"] = service.service_port;
     th.data["address"] = QString("onion:") + th.handle;
 
-    // Stop the service. We require explicit start request to make it available.
-    try {
-        tor_->stopService(service.uuid);
-    } catch(const std::exception& ex) {
-        LFLOG_WARN << "Failed to request hidden service " << th.handle
-                   << " to stop: " << ex.what();
-    }
-
-    emit transportHandleReady(th);
+    return th;
 }
 
 }} // namespaces
@@ -1,6 +1,4 @@
 
-#include <QNetworkProxy>
-
 #include "ds/torserviceinterface.h"
 #include "ds/dsserver.h"
 #include "ds/dsclient.h"
@@ -45,6 +43,31 @@ StartServiceResult TorServiceInterface::startService()
     return r;
 }
 
+StartServiceResult TorServiceInterface::startSharedService(const uint16_t port)
+{
+    StartServiceResult r;
+
+    r.stopped = stopService();
+    r.port = port;
+
+    LFLOG_NOTICE << "Service " << identityId_.toString()
+                 << " use the shared listener on port " << port;
+
+    emit serviceStarted(r);
+
+    return r;
+}
+
+void TorServiceInterface::adoptIncomingPeer(const Peer::ptr_t &peer)
+{
+    LFLOG_DEBUG << "Adopting incoming connection "
+                << peer->getConnectionId().toString()
+                << " from the shared listener.";
+
+    peers_[peer->getConnectionId()] = peer;
+    routeIncomingPeer(peer);
+}
+
 StopServiceResult TorServiceInterface::stopService()
 {
     StopServiceResult r;
@@ -66,7 +89,9 @@ StopServiceResult TorServiceInterface::stopService()
 
 core::PeerConnection::ptr_t
 TorServiceInterface::connectToService(const QByteArray &host, const uint16_t port,
-                                      core::ConnectData cd)
+                                      core::ConnectData cd,
+                                      const QNetworkProxy& proxy,
+                                      DsClient::retry_gate_t retryGate)
 {
     auto connection = make_shared<ConnectionSocket>(host, port);
 
@@ -75,13 +100,14 @@ TorServiceInterface::connectToService(const QByteArray &host, const uint16_t por
                 << " with connection-id " << connection->getUuid().toString();
 
     auto client = make_shared<DsClient>(connection, move(cd));
+    client->setRetryGate(move(retryGate));
 
     connect(client.get(), &core::PeerConnection::disconnectedFromPeer,
             this, [this](const std::shared_ptr<core::PeerConnection>& peer) {
         peers_.erase(peer->getConnectionId());
     }, Qt::QueuedConnection);
 
-    connection->setProxy(getTorProxy());
+    connection->setProxy(proxy);
     connection->connectToDefaultHost();
 
     peers_[connection->getUuid()] = client;
@@ -118,12 +144,56 @@ void TorServiceInterface::onNewIncomingConnection(
 
     connect(server.get(), &Peer::incomingPeer,
             this, [this](const std::shared_ptr<core::PeerConnection>& peer) {
-        emit incomingPeer(peer);
+        routeIncomingPeer(dynamic_pointer_cast<Peer>(peer));
     });
 
     peers_[connection->getUuid()] = server;
 }
 
+void TorServiceInterface::routeIncomingPeer(const Peer::ptr_t &peer)
+{
+    if (peer->isDataConnection()) {
+        adoptDataConnection(peer);
+        return;
+    }
+
+    emit incomingPeer(peer);
+}
+
+/* Data connections are only accepted from a contact that is already
+ * connected, and that we have offered to stripe a transfer with.
+ * They are bound to a transfer when the peer presents the
+ * stripe-token we gave it over the primary connection.
+ */
+void TorServiceInterface::adoptDataConnection(const Peer::ptr_t &peer)
+{
+    const auto hash = peer->getPeerCert()->getHash().toString();
+
+    for(const auto& it : peers_) {
+        const auto& primary = it.second;
+        if ((primary != peer)
+                && !primary->isDataConnection()
+                && primary->isConnected()
+                && primary->expectsDataConnections()
+                && primary->getPeerCert()
+                && (primary->getPeerCert()->getHash().toString() == hash)) {
+
+            connect(peer.get(), &core::PeerConnection::disconnectedFromPeer,
+                    this, [this](const std::shared_ptr<core::PeerConnection>& peer) {
+                peers_.erase(peer->getConnectionId());
+            }, Qt::QueuedConnection);
+
+            primary->addDataConnection(peer);
+            peer->authorize(true);
+            return;
+        }
+    }
+
+    LFLOG_DEBUG << "Rejecting data connection " << peer->getConnectionId().toString()
+                << ". No transfer is expecting it.";
+    peer->authorize(false);
+}
+
 void TorServiceInterface::autorizeConnection(const QUuid &connection, const bool allow)
 {
     if (auto peer = getPeer(connection)) {
@@ -134,16 +204,6 @@ void TorServiceInterface::autorizeConnection(const QUuid &connection, const bool
 }
 
 
-QNetworkProxy &TorServiceInterface::getTorProxy()
-{
-    // TODO: Get the actual host/port used by our tor server,
-    //       preferably from the control connection.
-    static QNetworkProxy proxy{QNetworkProxy::Socks5Proxy,
-                "127.0.0.1", 9050};
-
-    return proxy;
-}
-
 Peer::ptr_t TorServiceInterface::getPeer(const QUuid &uuid) const
 {
     auto it = peers_.find(uuid);
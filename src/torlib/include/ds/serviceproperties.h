@@ -3,6 +3,8 @@
 
 #include <QMetaType>
 #include <QByteArray>
+#include <QList>
+#include <QMap>
 #include <QString>
 #include <QUuid>
 
@@ -21,8 +23,15 @@ struct ServiceProperties {
     uint16_t app_port = {}; // Local port for Tor to forward connections to
 };
 
+/*! Per-service outcome of a batch of ADD_ONION or DEL_ONION commands */
+struct ServiceBatchResult {
+    QList<QUuid> succeeded;
+    QMap<QUuid, QByteArray> failed; // Service -> reason
+};
+
 }} // namespaces
 
 Q_DECLARE_METATYPE(ds::tor::ServiceProperties);
+Q_DECLARE_METATYPE(ds::tor::ServiceBatchResult);
 
 #endif // SERVICEPROPERTIES_H
@@ -34,6 +34,19 @@ public:
         READY
     };
 
+    enum class PublicationState {
+        UNPUBLISHED,
+        PUBLISHING, // Uploading the descriptor
+        PUBLISHED // At least one directory has the descriptor
+    };
+
+    // Counters from CIRC and STREAM events
+    struct CircuitStats {
+        uint64_t built = {};
+        uint64_t failed = {};
+        uint64_t failedStreams = {};
+    };
+
     struct SecurityError : public std::runtime_error
     {
         SecurityError(const char *what) : std::runtime_error(what) {}
@@ -73,6 +86,8 @@ public:
 
     CtlState getCtlState() const;
     TorState getTorState() const;
+    PublicationState getPublicationState(const QUuid& service) const;
+    const CircuitStats& getCircuitStats() const noexcept { return circuit_stats_; }
     bool isConnected() const {
         const auto state = getCtlState();
         return (state == CtlState::CONNECTED)
@@ -90,6 +105,19 @@ signals:
     void serviceStarted(const QUuid& service, const bool newService);
     void serviceStopped(const QUuid& service);
 
+    // Emitted when one of our services is reachable (or no longer reachable)
+    void servicePublished(const QUuid& service, const bool published);
+
+    // Emitted when Tor received, or failed to find, the descriptor for
+    // a hidden service we try to connect to. address is without ".onion"
+    void descriptorAvailable(const QByteArray& address, const bool available);
+
+    // Emitted when we know where Tor listens for SOCKS connections
+    void socksListener(const QString& host, const quint16 port);
+
+    // Emitted when all the replies to a startServices() or stopServices() batch are received.
+    void batchCompleted(const ServiceBatchResult& result);
+
     // Emitted when we are authenticated and Tor is connected.
     void ready();
 
@@ -130,6 +158,30 @@ public slots:
      */
     void stopService(const QUuid& service);
 
+    /*! Start many hidden services
+     *
+     * All the ADD_ONION commands are pipelined in one write.
+     *
+     * Signals:
+     *  - serviceStarted or serviceFailed for each service
+     *  - batchCompleted when all the services have replied. If the
+     *    connection is lost first, the rest fail with serviceFailed.
+     */
+    void startServices(const QList<ServiceProperties>& services);
+
+    /*! Stop many hidden services
+     *
+     * All the DEL_ONION commands are pipelined in one write.
+     *
+     * Signals:
+     *  - serviceStopped or serviceFailed for each service. Unknown
+     *    services are reported as stopped.
+     *  - batchCompleted when all the services have replied. If the
+     *    connection is lost first, the rest are reported as stopped,
+     *    as Tor removes our services with the connection.
+     */
+    void stopServices(const QList<QUuid>& services);
+
 
 private slots:
     void startAuth();
@@ -143,10 +195,28 @@ protected:
     void DoAuthentcate(const TorCtlReply& reply);
     void Authenticate(const QByteArray& data);
     void OnAuthReply(const TorCtlReply& reply);
+    void querySocksListener();
     QByteArray GetCookie(const QString& path);
     QByteArray ComputeHmac(const QByteArray& key, const QByteArray& serverNonce);
 
 private:
+    struct Batch {
+        QList<QUuid> waiting; // Services we have not got a reply for
+        bool stop = false; // DEL_ONION batch
+        ServiceBatchResult result;
+    };
+
+    TorCtlSocket::command_t makeStartCommand(const ServiceProperties& sp,
+                                             const std::shared_ptr<Batch>& batch);
+    TorCtlSocket::command_t makeStopCommand(const QUuid& service,
+                                            const std::shared_ptr<Batch>& batch);
+    void onBatchReply(const std::shared_ptr<Batch>& batch,
+                      const QUuid& service, const QByteArray& failure);
+    void completeBatch(const std::shared_ptr<Batch>& batch);
+    void failBatches(const QByteArray& reason);
+    void onHsDescEvent(const QList<QByteArray>& words);
+    void setPublicationState(const QUuid& service, PublicationState state);
+
     CtlState ctl_state_ = CtlState::DISCONNECTED;
     TorState tor_state_ = TorState::UNKNOWN;
     std::unique_ptr<TorCtlSocket> ctl_;
@@ -157,6 +227,11 @@ private:
     static const QByteArray tor_safe_clientkey_;
     std::mt19937 rnd_eng_;
     QMap<QUuid, QByteArray> service_map_;
+    QMap<QUuid, PublicationState> publication_;
+
+    // Batches that still wait for replies. Failed if the connection is lost.
+    std::vector<std::shared_ptr<Batch>> batches_;
+    CircuitStats circuit_stats_;
 };
 
 }} // namespaces
@@ -1,8 +1,12 @@
 #ifndef TORCTLSOCKET_H
 #define TORCTLSOCKET_H
 
+#include <array>
 #include <functional>
 #include <deque>
+#include <vector>
+#include <string>
+#include <string_view>
 #include <locale>
 #include <string.h>
 #include <algorithm>
@@ -43,6 +47,7 @@ struct TorCtlReply {
 
     // Try to parse a line into a key/value map. Return false if this is not a key/value set
     bool parse(const std::string& data, map_t& kv) const;
+    bool parse(const std::string_view data, map_t& kv) const;
 
     // Unescape escaped (double quoted) section(s) of a string
     static std::string unescape(const std::string& escaped);
@@ -53,6 +58,20 @@ struct TorCtlReply {
     static std::string unescape(const std::string::const_iterator start,
                                 const std::string::const_iterator end,
                                 size_t *used = nullptr);
+
+    // Same as above, working on a view of the input
+    static std::string unescape(const std::string_view in, size_t *used);
+
+private:
+    // Views into one reply-line: [level_key=level ]key[ value]
+    struct LineParts {
+        std::string_view level_key;
+        std::string_view level;
+        std::string_view key;
+        std::string_view value;
+    };
+
+    static bool splitLine(const std::string_view line, LineParts& parts) noexcept;
 };
 
 
@@ -73,6 +92,7 @@ public:
     };
 
     using handler_t = std::function<void (const TorCtlReply&)>;
+    using command_t = std::pair<QByteArray, handler_t>;
 
     explicit TorCtlSocket();
 
@@ -84,6 +104,15 @@ public:
     */
     void sendCommand(QByteArray command, const handler_t& handler);
 
+    /*! Pipeline several commands in one write
+     *
+     * Tor replies in the same order as the commands were sent, so
+     * each handler is called with the reply to its own command.
+     *
+     * \exception IoError is write fails.
+    */
+    void sendCommands(const std::vector<command_t>& commands);
+
 signals:
     // If triggered, the connection is dead
     void error(const QString &message);
@@ -97,17 +126,20 @@ protected slots:
 protected:
     virtual bool canReadLine_() const { return canReadLine(); }
     virtual qint64 write_(const QByteArray& data) { return write(data); }
-    virtual QByteArray readLine_(qint64 maxLen) {return readLine(maxLen); }
+    virtual qint64 readLine_(char *data, qint64 maxLen) {return readLine(data, maxLen); }
 
 private:
     void setError(const QString& error);
 
     QQueue<handler_t> pending_;
     constexpr static size_t max_buffer_len_ = 1024 * 5;
+    // Reused for each line. readLine() adds a terminating zero.
+    std::array<char, max_buffer_len_ + 1> line_buffer_ = {};
     constexpr static size_t max_reply_lines_ = 32;
     constexpr static int max_data_in_one_reply_line_ = 1024 * 16;
     TorCtlReply current_reply_;
     State state_ = State::READY;
+    bool first_data_line_ = false;
 };
 
 }} // namespaces
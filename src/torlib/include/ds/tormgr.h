@@ -29,6 +29,9 @@ public:
 
     TorController *getController();
 
+    // True if we can send commands to Tor
+    bool isConnected() const;
+
 signals:
     // Connected to the Tor control channel
     void started();
@@ -49,6 +52,10 @@ signals:
     void serviceFailed(const QUuid& service, const QByteArray& reason);
     void serviceStarted(const QUuid& service, const bool newService);
     void serviceStopped(const QUuid& service);
+    void batchCompleted(const ServiceBatchResult& result);
+    void servicePublished(const QUuid& service, const bool published);
+    void descriptorAvailable(const QByteArray& address, const bool available);
+    void socksListener(const QString& host, const quint16 port);
     void torStateUpdate(TorController::TorState state, int progress, const QString& summary);
     void stateUpdate(TorController::CtlState state);
 
@@ -95,6 +102,22 @@ public slots:
      */
     void stopService(const QUuid& service);
 
+    /*! Start many hidden services with pipelined ADD_ONION commands
+     *
+     * Signals:
+     *  - serviceStarted or serviceFailed for each service
+     *  - batchCompleted with the per-service results
+     */
+    void startServices(const QList<ServiceProperties>& services);
+
+    /*! Stop many hidden services with pipelined DEL_ONION commands
+     *
+     * Signals:
+     *  - serviceStopped or serviceFailed for each service
+     *  - batchCompleted with the per-service results
+     */
+    void stopServices(const QList<QUuid>& services);
+
 private slots:
     void onTorStateUpdate(TorController::TorState state, int progress, const QString& summary);
     void onStateUpdate(TorController::CtlState state);
@@ -102,6 +125,7 @@ private slots:
     void onServiceFailed(const QUuid& service, const QByteArray& reason);
     void onServiceStarted(const QUuid& service, const bool newService);
     void onServiceStopped(const QUuid& service);
+    void onBatchCompleted(const ServiceBatchResult& result);
 
 private:
     void startUseSystemInstance();
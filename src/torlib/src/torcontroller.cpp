@@ -1,6 +1,7 @@
 
 #include <QFile>
 #include <QFileInfo>
+#include <algorithm>
 #include <cassert>
 
 #include "include/ds/torcontroller.h"
@@ -12,6 +13,27 @@
 namespace ds {
 namespace tor {
 
+namespace {
+
+// Return word number index from a space separated line, or an empty view
+std::string_view getWord(std::string_view line, int index)
+{
+    while(!line.empty()) {
+        const auto end = line.find(' ');
+        if (index-- == 0) {
+            return line.substr(0, end);
+        }
+        if (end == std::string_view::npos) {
+            break;
+        }
+        line.remove_prefix(end + 1);
+    }
+
+    return {};
+}
+
+} // anonymous namespace
+
 const QByteArray TorController::tor_safe_serverkey_
     = "Tor safe cookie authentication server-to-controller hash";
 const QByteArray TorController::tor_safe_clientkey_
@@ -25,6 +47,7 @@ TorController::TorController(const TorConfig &config)
         registered = true;
         qRegisterMetaType<ds::tor::ServiceProperties>("ServiceProperties");
         qRegisterMetaType<ds::tor::ServiceProperties>("::ds::tor::ServiceProperties");
+        qRegisterMetaType<ds::tor::ServiceBatchResult>("ServiceBatchResult");
     }
 }
 
@@ -56,6 +79,8 @@ void TorController::stop()
         ctl_.reset();
     }
     service_map_.clear();
+    publication_.clear();
+    failBatches("Stopped");
 }
 
 void TorController::createService(const QUuid& serviceId)
@@ -107,6 +132,80 @@ void TorController::startService(const ServiceProperties &sp)
 {
     assert(ctl_);
 
+    const auto cmd = makeStartCommand(sp, {});
+    ctl_->sendCommand(cmd.first, cmd.second);
+}
+
+void TorController::stopService(const QUuid& service)
+{
+    assert(ctl_);
+
+    const auto cmd = makeStopCommand(service, {});
+    ctl_->sendCommand(cmd.first, cmd.second);
+}
+
+void TorController::startServices(const QList<ServiceProperties> &services)
+{
+    assert(ctl_);
+
+    if (services.isEmpty()) {
+        return;
+    }
+
+    auto batch = std::make_shared<Batch>();
+    std::vector<TorCtlSocket::command_t> commands;
+    commands.reserve(static_cast<size_t>(services.size()));
+
+    for(const auto& sp : services) {
+        commands.push_back(makeStartCommand(sp, batch));
+        batch->waiting.append(sp.uuid);
+    }
+
+    LFLOG_DEBUG << "Starting " << services.size() << " hidden services in one batch.";
+
+    ctl_->sendCommands(commands);
+    batches_.push_back(batch);
+}
+
+void TorController::stopServices(const QList<QUuid> &services)
+{
+    assert(ctl_);
+
+    if (services.isEmpty()) {
+        return;
+    }
+
+    auto batch = std::make_shared<Batch>();
+    batch->stop = true;
+    std::vector<TorCtlSocket::command_t> commands;
+    commands.reserve(static_cast<size_t>(services.size()));
+
+    for(const auto& service : services) {
+        if (service_map_.value(service).isEmpty()) {
+            // Same as for a single service in TorMgr::stopService()
+            LFLOG_WARN << "Cannot stop non-existing service with id " << service.toString();
+            batch->result.failed[service] = "No such service";
+            emit serviceStopped(service);
+            continue;
+        }
+        commands.push_back(makeStopCommand(service, batch));
+        batch->waiting.append(service);
+    }
+
+    if (commands.empty()) {
+        emit batchCompleted(batch->result);
+        return;
+    }
+
+    LFLOG_DEBUG << "Stopping " << commands.size() << " hidden services in one batch.";
+
+    ctl_->sendCommands(commands);
+    batches_.push_back(batch);
+}
+
+TorCtlSocket::command_t TorController::makeStartCommand(const ServiceProperties &sp,
+                                                        const std::shared_ptr<Batch>& batch)
+{
     LFLOG_DEBUG << "Starting hidden service for id "
                 << sp.uuid.toString()
                 << " as " << sp.service_id
@@ -123,10 +222,11 @@ void TorController::startService(const ServiceProperties &sp)
                 .toLocal8Bit();
 
     service_map_[sp.uuid] = sp.service_id.toLatin1();
+    publication_.remove(sp.uuid); // A new descriptor must be uploaded
     const auto uuid = sp.uuid;
     const auto service_id = sp.service_id;
 
-    ctl_->sendCommand(cmd, [this, uuid, service_id](const TorCtlReply& reply){
+    return {cmd, [this, uuid, service_id, batch](const TorCtlReply& reply){
 
         if (reply.status == 250) {
 
@@ -134,36 +234,99 @@ void TorController::startService(const ServiceProperties &sp)
                      << " with id " << uuid.toString();
 
             emit serviceStarted(uuid, false);
+            onBatchReply(batch, uuid, {});
         } else {
             auto msg = std::to_string(reply.status) + ' ' + reply.lines.front();
             emit serviceFailed(uuid, msg.c_str());
+            onBatchReply(batch, uuid, msg.c_str());
         }
-    });
+    }};
 }
 
-void TorController::stopService(const QUuid& service)
+TorCtlSocket::command_t TorController::makeStopCommand(const QUuid &service,
+                                                       const std::shared_ptr<Batch>& batch)
 {
-    assert(ctl_);
-
     const auto service_id = service_map_.value(service);
     if (service_id.isEmpty()) {
         auto err = service.toString().toUtf8().toStdString();
         throw NoSuchServiceError(err.c_str());
     }
 
-    ctl_->sendCommand(QStringLiteral("DEL_ONION %1").arg(QLatin1String{service_id}).toLocal8Bit(),
-                      [this, service, service_id](const TorCtlReply& reply){
+    return {QStringLiteral("DEL_ONION %1").arg(QLatin1String{service_id}).toLocal8Bit(),
+            [this, service, service_id, batch](const TorCtlReply& reply){
         if (reply.status == 250) {
 
             LFLOG_DEBUG << "Stopped Tor hidden service: " << service_id
                      << " with id " << service.toString();
 
+            setPublicationState(service, PublicationState::UNPUBLISHED);
             emit serviceStopped(service);
+            onBatchReply(batch, service, {});
         } else {
             auto msg = std::to_string(reply.status) + ' ' + reply.lines.front();
             emit serviceFailed(service, msg.c_str());
+            onBatchReply(batch, service, msg.c_str());
         }
-    });
+    }};
+}
+
+void TorController::onBatchReply(const std::shared_ptr<Batch>& batch,
+                                 const QUuid &service, const QByteArray &failure)
+{
+    if (!batch) {
+        return; // Not part of a batch
+    }
+
+    if (!batch->waiting.removeOne(service)) {
+        return; // Already failed by failBatches()
+    }
+
+    if (failure.isEmpty()) {
+        batch->result.succeeded.append(service);
+    } else {
+        batch->result.failed[service] = failure;
+    }
+
+    if (batch->waiting.isEmpty()) {
+        completeBatch(batch);
+    }
+}
+
+void TorController::completeBatch(const std::shared_ptr<Batch>& batch)
+{
+    batches_.erase(std::remove(batches_.begin(), batches_.end(), batch), batches_.end());
+
+    LFLOG_DEBUG << "Batch of Tor commands completed. "
+                << batch->result.succeeded.size() << " succeeded, "
+                << batch->result.failed.size() << " failed.";
+    emit batchCompleted(batch->result);
+}
+
+void TorController::failBatches(const QByteArray &reason)
+{
+    // The replies will never arrive
+    const auto batches = std::move(batches_);
+    batches_.clear();
+
+    for(const auto& batch : batches) {
+        const auto waiting = std::move(batch->waiting);
+        batch->waiting.clear();
+
+        LFLOG_WARN << "Failing " << waiting.size()
+                   << " hidden service commands in batch: " << reason.constData();
+
+        for(const auto& service : waiting) {
+            batch->result.failed[service] = reason;
+            if (batch->stop) {
+                // Tor removes the services when the control connection closes
+                emit serviceStopped(service);
+            } else {
+                emit serviceFailed(service, reason);
+            }
+        }
+
+        emit batchCompleted(batch->result);
+    }
 }
 
 void TorController::startAuth()
@@ -200,6 +363,7 @@ void TorController::close()
 void TorController::clear()
 {
     LFLOG_DEBUG << "Torctl connection was closed";
+    failBatches("Disconnected from Tor");
     setState(CtlState::STOPPED);
     setState(TorState::UNKNOWN);
     emit stopped();
@@ -207,7 +371,106 @@ void TorController::clear()
 
 void TorController::torEvent(const TorCtlReply &reply)
 {
-    LFLOG_DEBUG << "Received tor event: " << reply.lines.front().c_str();
+    LFLOG_TRACE << "Received tor event: " << reply.lines.front().c_str();
+
+    // CIRC and STREAM events are frequent, so we look at them in place
+    const std::string_view line{reply.lines.front()};
+    const auto event = getWord(line, 0);
+    if (event == "HS_DESC") {
+        onHsDescEvent(QByteArray::fromStdString(reply.lines.front()).split(' '));
+    } else if (event == "CIRC") {
+        // CIRC <id> <status> ...
+        const auto status = getWord(line, 2);
+        if (status == "BUILT") {
+            ++circuit_stats_.built;
+        } else if (status == "FAILED") {
+            ++circuit_stats_.failed;
+        }
+    } else if (event == "STREAM") {
+        // STREAM <id> <status> <circuit> <target> ...
+        const auto target = getWord(line, 4);
+        if (!target.empty() && getWord(line, 2) == "FAILED") {
+            ++circuit_stats_.failedStreams;
+            LFLOG_DEBUG << "Tor stream to " << std::string{target} << " failed.";
+        }
+    } else {
+        LFLOG_DEBUG << "Received tor event: " << reply.lines.front().c_str();
+    }
+}
+
+void TorController::onHsDescEvent(const QList<QByteArray> &words)
+{
+    // HS_DESC <action> <address> <auth-type> <hs-dir> [<descriptor-id>] [REASON=...]
+    if (words.size() < 3) {
+        return;
+    }
+
+    const auto& action = words.at(1);
+    const auto& address = words.at(2);
+    const auto service = service_map_.key(address);
+
+    if (!service.isNull()) {
+        // One of our own services
+        if (action == "UPLOAD") {
+            if (getPublicationState(service) == PublicationState::UNPUBLISHED) {
+                setPublicationState(service, PublicationState::PUBLISHING);
+            }
+        } else if (action == "UPLOADED") {
+            setPublicationState(service, PublicationState::PUBLISHED);
+        } else if (action == "FAILED") {
+            LFLOG_DEBUG << "Failed to upload a descriptor for " << address
+                        << " to " << (words.size() > 4 ? words.at(4) : QByteArray{});
+        }
+        return;
+    }
+
+    // A service we are trying to connect to
+    if (action == "RECEIVED") {
+        emit descriptorAvailable(address, true);
+    } else if (action == "FAILED") {
+        QByteArray reason;
+        for(const auto& w : words) {
+            if (w.startsWith("REASON=")) {
+                reason = w.mid(7);
+            }
+        }
+
+        LFLOG_DEBUG << "Failed to fetch the descriptor for " << address
+                    << ": " << reason;
+
+        // Other failures are typically a single directory that misbehaves.
+        if (reason == "NOT_FOUND") {
+            emit descriptorAvailable(address, false);
+        }
+    }
+}
+
+TorController::PublicationState TorController::getPublicationState(const QUuid &service) const
+{
+    return publication_.value(service, PublicationState::UNPUBLISHED);
+}
+
+void TorController::setPublicationState(const QUuid &service, PublicationState state)
+{
+    if (getPublicationState(service) == state) {
+        return;
+    }
+
+    if (state == PublicationState::UNPUBLISHED) {
+        publication_.remove(service);
+    } else {
+        publication_[service] = state;
+    }
+
+    LFLOG_DEBUG << "Hidden service " << service_map_.value(service)
+                << " with id " << service.toString()
+                << " changed publication state to " << static_cast<int>(state);
+
+    if (state == PublicationState::PUBLISHED) {
+        emit servicePublished(service, true);
+    } else if (state == PublicationState::UNPUBLISHED) {
+        emit servicePublished(service, false);
+    }
 }
 
 void TorController::setState(TorController::CtlState state)
@@ -228,6 +491,7 @@ void TorController::setState(TorController::TorState state,
             for(const auto& k : keys) {
                 emit serviceStopped(k);
             }
+            publication_.clear();
         }
 
         tor_state_ = state;
@@ -313,7 +577,8 @@ void TorController::OnAuthReply(const TorCtlReply &reply)
     if (reply.status == 250) {
         setState(CtlState::CONNECTED);
         emit autenticated();
-        ctl_->sendCommand("SETEVENTS STATUS_CLIENT", {});
+        ctl_->sendCommand("SETEVENTS STATUS_CLIENT HS_DESC CIRC STREAM", {});
+        querySocksListener();
         ctl_->sendCommand("GETINFO status/bootstrap-phase", [this](const TorCtlReply& reply) {
             if (reply.status == 250) {
                 auto map = reply.parse();
@@ -339,6 +604,35 @@ void TorController::OnAuthReply(const TorCtlReply &reply)
     }
 }
 
+void TorController::querySocksListener()
+{
+    ctl_->sendCommand("GETINFO net/listeners/socks", [this](const TorCtlReply& reply) {
+        if (reply.status != 250) {
+            LFLOG_WARN << "Failed to query Tor for the SOCKS listener. status=" << reply.status;
+            return;
+        }
+
+        // net/listeners/socks="127.0.0.1:9050" ...
+        // The first listener is good enough for us.
+        const auto listener = reply.parse().value("NET/LISTENERS/SOCKS").toByteArray();
+        const auto sep = listener.lastIndexOf(':');
+        const auto port = static_cast<quint16>(listener.mid(sep + 1).toUInt());
+        if (sep <= 0 || !port) {
+            LFLOG_WARN << "Tor does not report a usable SOCKS listener: " << listener;
+            return;
+        }
+
+        // IPv6 addresses are in brackets
+        auto host = QString::fromLatin1(listener.left(sep));
+        if (host.startsWith('[') && host.endsWith(']')) {
+            host = host.mid(1, host.size() - 2);
+        }
+
+        LFLOG_DEBUG << "Tor listens for SOCKS connections on " << host << ":" << port;
+        emit socksListener(host, port);
+    });
+}
+
 QByteArray TorController::GetCookie(const QString &path)
 {
     const auto size = QFileInfo(path).size();
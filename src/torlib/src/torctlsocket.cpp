@@ -1,5 +1,4 @@
 
-#include <regex>
 #include <cassert>
 #include <locale>
 
@@ -42,18 +41,69 @@ void TorCtlSocket::sendCommand(QByteArray command,
     pending_.push_back(handler);
 }
 
+void TorCtlSocket::sendCommands(const std::vector<command_t>& commands)
+{
+    QByteArray buffer;
+    for(const auto& cmd : commands) {
+        LFLOG_DEBUG << "Sending Tor command: " << cmd.first.toStdString();
+        buffer += cmd.first;
+        if (!cmd.first.endsWith("\r\n")) {
+            buffer += "\r\n";
+        }
+    }
+
+    if (buffer.isEmpty()) {
+        return;
+    }
+
+    if (write_(buffer) != buffer.size()) {
+        static const auto err = "Failed to write to the Tor command socket";
+        setError(err);
+        throw IoError(err);
+    }
+
+    for(const auto& cmd : commands) {
+        pending_.push_back(cmd.second);
+    }
+}
+
 void TorCtlSocket::processIn()
 {
     while(canReadLine_()) {
         // Reply format: nnn SP|+|- text CRLF
 
-        QByteArray line = readLine_(max_buffer_len_);
-        if (!line.endsWith("\r\n")) {
+        // Read into the same buffer each time, and work on a view of it
+        const auto len = readLine_(line_buffer_.data(), static_cast<qint64>(line_buffer_.size()));
+        if (len < 2 || line_buffer_[static_cast<size_t>(len) - 2] != '\r'
+                || line_buffer_[static_cast<size_t>(len) - 1] != '\n') {
             setError(QStringLiteral("Invalid control reply syntax: Missing CRLF"));
             return;
         }
 
-        line.chop(2);
+        const std::string_view line{line_buffer_.data(), static_cast<size_t>(len) - 2};
+
+        // Data lines are raw, so they must be dealt with before the
+        // reply-line syntax checks.
+        if (state_ == State::IN_DATA) {
+            if (line == ".") {
+                state_ = State::IN_REPLY;
+                continue;
+            }
+
+            // Remove dot-stuffing
+            const size_t skip = line.substr(0, 2) == ".." ? 1 : 0;
+            auto& data = current_reply_.lines.back();
+            if (!first_data_line_) {
+                data += '\n';
+            }
+            first_data_line_ = false;
+            data.append(line.substr(skip));
+            if (data.size() > max_data_in_one_reply_line_) {
+                setError(QStringLiteral("Invalid control reply syntax: Too verbose."));
+                return;
+            }
+            continue;
+        }
 
         if (line.size() < 4) {
             setError(QStringLiteral("Invalid control reply syntax: Too short."));
@@ -67,25 +117,17 @@ void TorCtlSocket::processIn()
             return;
         }
 
+        const auto digit = [](const char ch) { return ch >= '0' && ch <= '9'; };
+        if (!digit(line[0]) || !digit(line[1]) || !digit(line[2])) {
+            setError(QStringLiteral("Invalid control reply syntax: Invalid result code."));
+            return;
+        }
+
         if (state_ == State::READY) {
             state_ = State::IN_REPLY;
 
             current_reply_ = TorCtlReply{};
-            current_reply_.status = line.left(3).toInt();
-        }
-
-        if (state_ == State::IN_DATA) {
-            if (line == ".") {
-                state_ = State::IN_REPLY;
-            } else {
-                current_reply_.lines.back() += line.mid(4).toStdString();
-                if (current_reply_.lines.back().size()
-                        > max_data_in_one_reply_line_) {
-                    setError(QStringLiteral("Invalid control reply syntax: Too verbose."));
-                    return;
-                }
-            }
-            continue;
+            current_reply_.status = (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0');
         }
 
         assert(state_ == State::IN_REPLY);
@@ -95,10 +137,11 @@ void TorCtlSocket::processIn()
             return;
         }
 
-        current_reply_.lines.push_back(line.mid(4).toStdString());
+        current_reply_.lines.emplace_back(line.substr(4));
 
         if (line_type == '+') {
             state_ = State::IN_DATA;
+            first_data_line_ = true;
             continue;
         }
 
@@ -147,6 +190,9 @@ void TorCtlSocket::processIn()
 void TorCtlSocket::clear()
 {
     LFLOG_DEBUG << "TorCtlSocket is disconnected";
+
+    // No replies will arrive for these. TorController fails its batches.
+    pending_.clear();
 }
 
 void TorCtlSocket::setError(const QString& errorMsg)
@@ -158,29 +204,23 @@ void TorCtlSocket::setError(const QString& errorMsg)
 
 TorCtlReply::map_t TorCtlReply::parse() const
 {
-    static const std::regex line_breakup(R"(^(([\w][\w\-\/]+)(=(\w+)) )?(\w+)( (.*))?$)");
     map_t rval;
 
     for(const auto& line: lines) {
-        // Get the first word
-        std::smatch m;
-        if (std::regex_match(line, m, line_breakup)) {
-            assert(m.size() == 8);
-            const std::string level = m[4].str();
-            const std::string key = m[5].str();
-            const std::string value = m[7].str();
-
+        LineParts parts;
+        if (splitLine(line, parts)) {
             map_t kv;
 
-            if (!level.empty()) {
-                rval[toKey(m[2].str())] = level.c_str();
+            if (!parts.level.empty()) {
+                rval[toKey(parts.level_key)] = QString::fromUtf8(
+                            parts.level.data(), static_cast<int>(parts.level.size()));
             }
 
-            if (parse(value, kv)) {
-                rval[toKey(key)] = QVariant(kv);
+            if (parse(parts.value, kv)) {
+                rval[toKey(parts.key)] = QVariant(kv);
             } else {
-                auto escaped_value = unescape(value);
-                rval[toKey(key)] = QString(escaped_value.c_str());
+                auto escaped_value = unescape(parts.value, nullptr);
+                rval[toKey(parts.key)] = QString(escaped_value.c_str());
             }
         } else {
             parse(line, rval);
@@ -190,69 +230,154 @@ TorCtlReply::map_t TorCtlReply::parse() const
     return rval;
 }
 
+/* Split a reply-line into its parts in a single pass, without copying.
+ *
+ *   line := [ level-key "=" level SP ] key [ SP value ]
+ *
+ * level-key is a word of at least two characters that may also contain
+ * '-' and '/', like "status/bootstrap-phase". level and key are words.
+ * The value is the remainder of the line.
+ *
+ * Returns false if the line is not in this form, for example
+ * "ServiceID=..." lines, which are plain key=value sets.
+ */
+bool TorCtlReply::splitLine(const std::string_view line, LineParts& parts) noexcept
+{
+    const auto isWordChar = [](const char ch) {
+        return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z')
+                || (ch >= '0' && ch <= '9') || (ch == '_');
+    };
+
+    const auto isLevelKeyChar = [&isWordChar](const char ch) {
+        return isWordChar(ch) || (ch == '-') || (ch == '/');
+    };
+
+    // Length of the run of characters from pos that satisfy the predicate
+    const auto run = [&line](size_t pos, const auto& pred) {
+        size_t len = 0;
+        while ((pos + len) < line.size() && pred(line[pos + len])) {
+            ++len;
+        }
+        return len;
+    };
+
+    parts = {};
+    size_t pos = 0;
+
+    // Optional level-key=level
+    if (!line.empty() && isWordChar(line.front())) {
+        const auto key_len = run(0, isLevelKeyChar);
+        if (key_len >= 2 && key_len < line.size() && line[key_len] == '=') {
+            const auto level_len = run(key_len + 1, isWordChar);
+            const auto end = key_len + 1 + level_len;
+            if (level_len && end < line.size() && line[end] == ' ') {
+                parts.level_key = line.substr(0, key_len);
+                parts.level = line.substr(key_len + 1, level_len);
+                pos = end + 1;
+            }
+        }
+    }
+
+    const auto key_len = run(pos, isWordChar);
+    if (!key_len) {
+        return false;
+    }
+
+    const auto end = pos + key_len;
+    if (end != line.size() && line[end] != ' ') {
+        return false;
+    }
+
+    parts.key = line.substr(pos, key_len);
+    if (end < line.size()) {
+        parts.value = line.substr(end + 1);
+    }
+
+    return true;
+}
+
 bool TorCtlReply::parse(const std::string &data, TorCtlReply::map_t &kv) const
 {
-    std::locale loc;
+    return parse(std::string_view{data}, kv);
+}
+
+bool TorCtlReply::parse(const std::string_view data, TorCtlReply::map_t &kv) const
+{
     enum class State {
         SCANNING,
         KEY,
         VALUE
     };
 
+    const auto isAlpha = [](const char ch) {
+        return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z');
+    };
+
     State state = State::SCANNING;
-    QByteArray key;
-    QByteArray value;
 
-    for(auto it = data.begin(); it != data.end(); ++it) {
+    // The key and the unquoted part of the value are views into data
+    size_t key_start = 0, key_len = 0;
+    size_t value_start = 0, value_len = 0;
+    std::string quoted;
+
+    for(size_t i = 0; i < data.size(); ++i) {
+        const char ch = data[i];
+
         if (state == State::SCANNING) {
-            if (*it == ' ' || *it == '\t') {
+            if (ch == ' ' || ch == '\t') {
                 continue; // Skip whitespace
             }
 
-            if (std::isalpha(*it, loc)) {
+            if (isAlpha(ch)) {
                 state = State::KEY;
-                assert(key.isEmpty());
-                assert(value.isEmpty());
+                key_start = i;
+                assert(key_len == 0);
+                assert(value_len == 0);
             } else {
                 return false; // Not a strict key=value ... input
             }
         }
 
         if (state == State::KEY) {
-            if (*it == '=') {
+            if (ch == '=') {
                 state = State::VALUE;
+                value_start = i + 1;
                 continue;
             }
 
-            key += *it;
+            ++key_len;
         }
 
         if (state == State::VALUE) {
-            if (*it == '\"') {
+            if (ch == '\"') {
                 size_t used = 0;
-                auto escaped = unescape(it, data.end(), &used);
-                value += escaped.c_str();
+                quoted = unescape(data.substr(i), &used);
                 assert(used > 0);
 
                 // we want to wrap past doublequote in the loop, not here
-                it += static_cast<int>(used) - 1;
+                i += used - 1;
 
                 // We assume that a key="..." only contain the quoted value
                 state = State::SCANNING;
-            } else if (*it == ' ' || *it == '\t') {
+            } else if (ch == ' ' || ch == '\t') {
                 state = State::SCANNING;
             } else {
-                value += *it;
+                ++value_len;
             }
         }
 
-        if (state == State::SCANNING || (it + 1) == data.end()) {
-            if (!key.isEmpty()) {
-                kv[toKey(key)] = value;
+        if (state == State::SCANNING || (i + 1) == data.size()) {
+            if (key_len) {
+                QByteArray value{data.data() + value_start, static_cast<int>(value_len)};
+                if (!quoted.empty()) {
+                    value += quoted.c_str();
+                }
+                kv[toKey(data.substr(key_start, key_len))] = value;
             }
 
-            key = "";
-            value.clear();
+            key_len = 0;
+            value_len = 0;
+            quoted.clear();
         }
     }
 
@@ -277,77 +402,81 @@ bool TorCtlReply::parse(const std::string &data, TorCtlReply::map_t &kv) const
 std::string TorCtlReply::unescape(const std::string::const_iterator start,
                                   const std::string::const_iterator end,
                                   size_t *used)
+{
+    return unescape(std::string_view{start == end ? nullptr : &*start,
+                                     static_cast<size_t>(end - start)}, used);
+}
+
+std::string TorCtlReply::unescape(const std::string_view in, size_t *used)
 {
     std::string rval;
-    rval.reserve(static_cast<size_t>(end - start));
+    rval.reserve(in.size());
 
     bool is_escaped = false;
     if (used) {
         *used = 0;
     }
 
-    for(auto it = start; it != end; ++it) {
+    for(size_t i = 0; i < in.size(); ++i) {
         if (is_escaped) {
-            if (*it == '\\') {
-                if (++it == end) {
+            if (in[i] == '\\') {
+                if (++i == in.size()) {
                     // Invalid
                     throw ParseError("Quoted string ends with backslash");
                 }
 
-                if (*it == 'n') {
+                const char ch = in[i];
+                if (ch == 'n') {
                     rval += '\n';
-                } else if (*it == 'r') {
+                } else if (ch == 'r') {
                     rval += '\r';
-                } else if (*it == 't') {
+                } else if (ch == 't') {
                     rval += '\t';
-                } else if (*it >= '0' && *it <= '7') {
+                } else if (ch >= '0' && ch <= '7') {
                     // octal
                     int have_digits = 3;
-                    std::string octet;
+                    int octet = 0;
                     // Tor restricts first digit to 0-3 for three-digit octals.
                     // A leading digit of 4-7 would therefore be interpreted as
                     // a two-digit octal.
-                    if (*it > '3') {
+                    if (ch > '3') {
                         --have_digits;
                     }
 
                     do {
-                        octet += *it;
+                        octet = (octet * 8) + (in[i] - '0');
                     } while (--have_digits
-                             && (++it != end)
-                             && (*it >= '0' && *it <= '7'));
+                             && (++i != in.size())
+                             && (in[i] >= '0' && in[i] <= '7'));
 
                     if (have_digits) {
                         // Roll back one position
-                        --it;
+                        --i;
                     }
 
-                    assert(!octet.empty());
-
-                    auto ch = static_cast<char>(std::stoi(octet, nullptr, 8));
-                    rval += ch;
+                    rval += static_cast<char>(octet);
 
                 } else {
-                    rval += *it;
+                    rval += ch;
                 }
 
-            } else if (*it == '\"') {
+            } else if (in[i] == '\"') {
                 is_escaped = false;
                 if (used) {
-                    *used = static_cast<size_t>(it - start) + 1;
+                    *used = i + 1;
                     return rval;
                 }
             } else {
-                rval += *it;
+                rval += in[i];
             }
         } else {
             // Looking for leading quote
-            if (*it == '\"') {
+            if (in[i] == '\"') {
                 is_escaped = true;
             } else if (used) {
                 throw ParseError("Quoted string must start with a double quote");
             } else {
-                rval += *it;
+                rval += in[i];
             }
         }
     }
@@ -361,7 +490,7 @@ std::string TorCtlReply::unescape(const std::string::const_iterator start,
 
 std::string TorCtlReply::unescape(const std::string &escaped)
 {
-    return unescape(escaped.cbegin(), escaped.cend());
+    return unescape(std::string_view{escaped}, nullptr);
 }
 
 }} // namespaces
@@ -43,6 +43,11 @@ void TorMgr::stop()
     }
 }
 
+bool TorMgr::isConnected() const
+{
+    return ctl_ && ctl_->isConnected();
+}
+
 void TorMgr::updateConfig(const TorConfig &config)
 {
     config_ = config;
@@ -82,6 +87,24 @@ void TorMgr::stopService(const QUuid& service)
 
 }
 
+void TorMgr::startServices(const QList<ServiceProperties> &services)
+{
+    if (!ctl_ || !ctl_->isConnected()) {
+        throw OfflineError("Tor is offline");
+    }
+
+    ctl_->startServices(services);
+}
+
+void TorMgr::stopServices(const QList<QUuid> &services)
+{
+    if (!ctl_ || !ctl_->isConnected()) {
+        throw OfflineError("Tor is offline");
+    }
+
+    ctl_->stopServices(services);
+}
+
 void TorMgr::onTorStateUpdate(TorController::TorState state, int progress, const QString &summary)
 {
     emit torStateUpdate(state, progress, summary);
@@ -132,6 +155,11 @@ void TorMgr::onServiceStopped(const QUuid& service)
     emit serviceStopped(service);
 }
 
+void TorMgr::onBatchCompleted(const ServiceBatchResult &result)
+{
+    emit batchCompleted(result);
+}
+
 void TorMgr::startUseSystemInstance()
 {
     assert(!ctl_);
@@ -155,6 +183,18 @@ void TorMgr::startUseSystemInstance()
     connect(ctl_.get(), &TorController::serviceStopped,
             this, &TorMgr::onServiceStopped);
 
+    connect(ctl_.get(), &TorController::batchCompleted,
+            this, &TorMgr::onBatchCompleted);
+
+    connect(ctl_.get(), &TorController::servicePublished,
+            this, &TorMgr::servicePublished);
+
+    connect(ctl_.get(), &TorController::descriptorAvailable,
+            this, &TorMgr::descriptorAvailable);
+
+    connect(ctl_.get(), &TorController::socksListener,
+            this, &TorMgr::socksListener);
+
     ctl_->start();
 
 }